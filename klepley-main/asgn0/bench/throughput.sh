@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Compares the throughput of the fast path against the original loop (SPLIT_LEGACY=1)
+# on a generated log file, for a common, a rare and a newline delimiter, and checks that
+# both produce the same output. Then compares -j (one thread per CPU) against one thread
+# on eight copies of the file. Usage: bench/throughput.sh [megabytes]
+
+MB=${1:-256}
+INPUT=/tmp/split-bench-input.txt
+
+# Build the input from repeated log-like lines
+if [[ ! -f $INPUT || $(stat -c %s $INPUT) -ne $((MB * 1048576)) ]]; then
+	yes 'GET,/index.html,200,42,host-17,2024-01-01T00:00:00Z' | head -c $((MB * 1048576)) > $INPUT
+fi
+
+# Nanoseconds taken by a command
+elapsed() {
+	local start=$(date +%s%N)
+	"$@"
+	local end=$(date +%s%N)
+	echo $((end - start))
+}
+
+run() {
+	./split "$1" $INPUT > /dev/null
+}
+
+run_legacy() {
+	SPLIT_LEGACY=1 ./split "$1" $INPUT > /dev/null
+}
+
+run_files() {
+	./split "$@" > /dev/null
+}
+
+status=0
+printf "%-10s %12s %12s %8s\n" delimiter "legacy MB/s" "fast MB/s" speedup
+names=(comma rare newline)
+delimiters=(',' 'Q' $'\n')
+for i in 0 1 2; do
+	delimiter=${delimiters[$i]}
+	if ! cmp -s <(SPLIT_LEGACY=1 ./split "$delimiter" $INPUT) <(./split "$delimiter" $INPUT); then
+		echo "output differs for the ${names[$i]} delimiter"
+		status=1
+	fi
+	legacy=$(elapsed run_legacy "$delimiter")
+	fast=$(elapsed run "$delimiter")
+	awk -v d=${names[$i]} -v mb=$MB -v l=$legacy -v f=$fast \
+		'BEGIN { printf "%-10s %12.1f %12.1f %7.1fx\n", d, mb * 1e9 / l, mb * 1e9 / f, l / f }'
+done
+
+# Eight files, all at once
+files=$(for i in 1 2 3 4 5 6 7 8; do echo $INPUT; done)
+if ! cmp -s <(./split , $files) <(./split -j $(nproc) , $files); then
+	echo "-j output differs"
+	status=1
+fi
+single=$(elapsed run_files , $files)
+parallel=$(elapsed run_files -j $(nproc) , $files)
+awk -v j=$(nproc) -v mb=$((MB * 8)) -v l=$single -v f=$parallel \
+	'BEGIN { printf "-j %-7d %12.1f %12.1f %7.1fx (8 files, 1 thread vs %d)\n", j, mb * 1e9 / l, mb * 1e9 / f, l / f, j }'
+
+exit $status
@@ -1,29 +1,389 @@
+#define _DEFAULT_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BUFFER_SIZE 1024
+#define CHUNK_SIZE  (1 << 20)
+#define WINDOW      4 // Reorder buffer slots per thread
+
+// A mapped input file, unmapped once the last of its chunks has been written
+typedef struct mapping {
+    int fd;
+    char *base;
+    size_t size;
+    size_t chunks_left;
+    bool failed; // A write of it failed, so the rest of it is dropped
+} mapping;
+
+// One piece of output, in the order it must be written
+typedef enum { UNIT_CHUNK, UNIT_STREAM, UNIT_EMPTY, UNIT_OPEN_ERROR } unit_kind;
+
+typedef struct unit {
+    unit_kind kind;
+    bool ready; // Set by the worker once data is final
+    bool first; // First unit of a file that opened
+    int fd; // For streams
+    int error; // For files that failed to open
+    mapping *map; // For chunks
+    const char *src;
+    size_t len;
+    const char *data; // What to write: src itself, or out after replacing
+    char *out;
+} unit;
+
+// The work shared by the threads of -j; everything here is guarded by lock
+typedef struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_room; // Signalled when the writer frees a slot
+    pthread_cond_t has_ready; // Signalled when a unit is ready or the input runs out
+    char **files;
+    int file_count;
+    int next_file;
+    mapping *map; // File being cut into chunks, if any
+    size_t offset;
+    bool exhausted;
+    char delimiter;
+    unit *slots;
+    size_t slot_count;
+    size_t next_seq; // Sequence number of the next unit handed out
+    size_t written; // Units the writer is done with
+} pool;
+
+// Writes all of buf to stdout, going around short writes
+static int write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Copies len bytes from src to dst (which may be the same buffer), turning every delimiter
+// into a newline. Works a word at a time: the delimiter bytes of a word are found without
+// branching, and flipped to newlines with one XOR.
+static void replace_delimiter(char *dst, const char *src, size_t len, char delimiter) {
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    const uint64_t lows = 0x7f7f7f7f7f7f7f7full;
+    uint64_t pattern = ones * (unsigned char) delimiter;
+    uint64_t flip = (unsigned char) (delimiter ^ '\n');
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        // Bytes equal to the delimiter become zero, and each zero byte sets its high bit
+        uint64_t x = word ^ pattern;
+        uint64_t zeros = ~(((x & lows) + lows) | x | lows) & highs;
+        word ^= (zeros >> 7) * flip;
+        memcpy(dst + i, &word, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] = (src[i] == delimiter) ? '\n' : src[i];
+    }
+}
+
+// Splits a regular file through a read-only mapping, a chunk at a time. Chunks without a
+// delimiter are written straight from the mapping; the others are copied into out first.
+// Returns 1 without writing anything if the file cannot be mapped.
+static int split_mapped(int fd, size_t size, char delimiter, char *out) {
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    int result = 0;
+    for (size_t at = 0; at < size && result == 0; at += CHUNK_SIZE) {
+        size_t len = (size - at < CHUNK_SIZE) ? size - at : CHUNK_SIZE;
+        if (delimiter == '\n' || memchr(map + at, delimiter, len) == NULL) {
+            result = write_all(map + at, len);
+        } else {
+            replace_delimiter(out, map + at, len, delimiter);
+            result = write_all(out, len);
+        }
+    }
+    munmap(map, size);
+    if (result == -1) {
+        perror("write");
+    }
+    return result;
+}
+
+// Splits anything that cannot be mapped (pipes, terminals) with large reads
+static int split_streamed(int fd, char delimiter, char *out) {
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, out, CHUNK_SIZE)) != 0) {
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        replace_delimiter(out, out, bytes_read, delimiter);
+        if (write_all(out, bytes_read) == -1) {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The original byte-at-a-time loop, kept for comparison (SPLIT_LEGACY=1)
+static int split_legacy(int fd, char delimiter) {
+    char buffer[BUFFER_SIZE];
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        for (ssize_t j = 0; j < bytes_read; j += 1) {
+            if (delimiter == *(buffer + j)) {
+                *(buffer + j) = '\n';
+            }
+        }
+        write(STDOUT_FILENO, buffer, bytes_read);
+    }
+
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+/***********PARALLEL MODE (-j)************/
+
+// Fills u with the next unit of input, opening the next file if the current one is done.
+// Called with the pool lock held, so files are opened in order. Returns false at the end.
+static bool next_unit(pool *p, unit *u) {
+    u->first = false;
+    while (p->map == NULL) {
+        if (p->next_file == p->file_count) {
+            return false;
+        }
+        int fd = open(p->files[p->next_file++], O_RDONLY);
+        u->first = true;
+        if (fd == -1) {
+            u->kind = UNIT_OPEN_ERROR;
+            u->error = errno;
+            return true;
+        }
+        struct stat st;
+        bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (regular && st.st_size == 0) {
+            close(fd);
+            u->kind = UNIT_EMPTY;
+            return true;
+        }
+        char *base = regular
+                         ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                         : MAP_FAILED;
+        mapping *map = (base != MAP_FAILED) ? malloc(sizeof(mapping)) : NULL;
+        if (map == NULL) {
+            // Pipes and the like are left to the writer, which reads them in turn
+            if (base != MAP_FAILED) {
+                munmap(base, st.st_size);
+            }
+            u->kind = UNIT_STREAM;
+            u->fd = fd;
+            return true;
+        }
+        madvise(base, st.st_size, MADV_SEQUENTIAL);
+        map->fd = fd;
+        map->base = base;
+        map->size = st.st_size;
+        map->chunks_left = (map->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        map->failed = false;
+        p->map = map;
+        p->offset = 0;
+    }
+    u->kind = UNIT_CHUNK;
+    u->map = p->map;
+    u->src = p->map->base + p->offset;
+    u->len = (p->map->size - p->offset < CHUNK_SIZE) ? p->map->size - p->offset : CHUNK_SIZE;
+    p->offset += u->len;
+    if (p->offset == p->map->size) {
+        // The writer frees the mapping with its last chunk, so the pool must not keep it
+        p->map = NULL;
+    }
+    return true;
+}
+
+static void *split_worker(void *arg) {
+    pool *p = arg;
+    pthread_mutex_lock(&(p->lock));
+    while (true) {
+        // Stay within the reorder buffer: at most slot_count units ahead of the writer
+        while (!p->exhausted && p->next_seq - p->written == p->slot_count) {
+            pthread_cond_wait(&(p->has_room), &(p->lock));
+        }
+        if (p->exhausted) {
+            break;
+        }
+        unit *u = &(p->slots[p->next_seq % p->slot_count]);
+        if (!next_unit(p, u)) {
+            p->exhausted = true;
+            pthread_cond_broadcast(&(p->has_ready));
+            break;
+        }
+        p->next_seq++;
+        // Transform outside the lock; only chunks have anything to do
+        pthread_mutex_unlock(&(p->lock));
+        if (u->kind == UNIT_CHUNK) {
+            if (p->delimiter == '\n' || memchr(u->src, p->delimiter, u->len) == NULL) {
+                u->data = u->src;
+            } else {
+                replace_delimiter(u->out, u->src, u->len, p->delimiter);
+                u->data = u->out;
+            }
+        }
+        pthread_mutex_lock(&(p->lock));
+        u->ready = true;
+        pthread_cond_broadcast(&(p->has_ready));
+    }
+    pthread_mutex_unlock(&(p->lock));
+    return NULL;
+}
+
+// Splits the files with jobs threads, writing from this one in the original order. Keeps the
+// same error accounting as the sequential loop, with messages in the order of the files.
+static void split_parallel(char **files, int count, int jobs, char delimiter, char *out,
+    int *error_flag, int *invalid_file_error_flag, int *valid_file_count) {
+    pool p = { .files = files, .file_count = count, .delimiter = delimiter };
+    p.slot_count = (size_t) jobs * WINDOW;
+    p.slots = calloc(p.slot_count, sizeof(unit));
+    if (p.slots == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < p.slot_count; i++) {
+        p.slots[i].out = malloc(CHUNK_SIZE);
+        if (p.slots[i].out == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_init(&(p.lock), NULL);
+    pthread_cond_init(&(p.has_room), NULL);
+    pthread_cond_init(&(p.has_ready), NULL);
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&threads[i], NULL, split_worker, &p);
+    }
+    for (size_t seq = 0;; seq++) {
+        unit *u = &(p.slots[seq % p.slot_count]);
+        pthread_mutex_lock(&(p.lock));
+        while (!u->ready && !(p.exhausted && seq == p.next_seq)) {
+            pthread_cond_wait(&(p.has_ready), &(p.lock));
+        }
+        bool done = !u->ready;
+        pthread_mutex_unlock(&(p.lock));
+        if (done) {
+            break;
+        }
+        if (u->kind == UNIT_OPEN_ERROR) {
+            errno = u->error;
+            perror("open");
+            *error_flag = 1;
+            *invalid_file_error_flag = 1; // Set the flag for invalid file
+        } else if (u->first) {
+            (*valid_file_count)++;
+        }
+        if (u->kind == UNIT_CHUNK) {
+            // After a failed write the rest of that file is dropped, like the sequential path
+            if (!u->map->failed && write_all(u->data, u->len) == -1) {
+                perror("write");
+                *error_flag = 1;
+                u->map->failed = true;
+            }
+            if (--(u->map->chunks_left) == 0) {
+                munmap(u->map->base, u->map->size);
+                close(u->map->fd);
+                free(u->map);
+            }
+        } else if (u->kind == UNIT_STREAM) {
+            if (split_streamed(u->fd, delimiter, out) == -1) {
+                *error_flag = 1;
+            }
+            close(u->fd);
+        }
+        pthread_mutex_lock(&(p.lock));
+        u->ready = false;
+        p.written++;
+        pthread_cond_broadcast(&(p.has_room));
+        pthread_mutex_unlock(&(p.lock));
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    for (size_t i = 0; i < p.slot_count; i++) {
+        free(p.slots[i].out);
+    }
+    free(p.slots);
+    pthread_mutex_destroy(&(p.lock));
+    pthread_cond_destroy(&(p.has_room));
+    pthread_cond_destroy(&(p.has_ready));
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <delimiter> <file1> [file2...]\n", argv[0]);
+    // -j N spreads the work over N threads
+    int jobs = 0;
+    int first_arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        jobs = atoi(argv[2]);
+        first_arg = 3;
+    }
+    if (argc - first_arg < 2 || (first_arg == 3 && jobs < 1)) {
+        fprintf(stderr, "Usage: %s [-j jobs] <delimiter> <file1> [file2...]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    char *delimiter = argv[1];
+    char *delimiter = argv[first_arg];
     if (strlen(delimiter) != 1) {
         fprintf(stderr, "%s length is not 1\n", delimiter);
         exit(EXIT_FAILURE);
     }
 
+    // The fast path needs one chunk-sized buffer for every file
+    char *legacy = getenv("SPLIT_LEGACY");
+    char *out = NULL;
+    if (legacy == NULL || strcmp(legacy, "1") != 0) {
+        out = malloc(CHUNK_SIZE);
+        if (out == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     int error_flag = 0;
     int invalid_file_error_flag = 0; // Track error in invalid files
     int valid_file_count = 0;
 
-    for (int i = 2; i < argc; ++i) {
+    if (jobs > 0 && out != NULL) {
+        split_parallel(argv + first_arg + 1, argc - first_arg - 1, jobs, *delimiter, out,
+            &error_flag, &invalid_file_error_flag, &valid_file_count);
+    }
+
+    for (int i = first_arg + 1; i < argc && (jobs == 0 || out == NULL); ++i) {
         char *filename = argv[i];
 
         int fd = open(filename, O_RDONLY);
@@ -34,20 +394,20 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        char buffer[BUFFER_SIZE];
-
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-            for (ssize_t j = 0; j < bytes_read; j += 1) {
-                if (*delimiter == *(buffer + j)) {
-                    *(buffer + j) = '\n';
-                }
+        int result;
+        struct stat st;
+        if (out == NULL) {
+            result = split_legacy(fd, *delimiter);
+        } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            // Map regular files; fall back to reading if that is not possible
+            result = (st.st_size == 0) ? 0 : split_mapped(fd, st.st_size, *delimiter, out);
+            if (result == 1) {
+                result = split_streamed(fd, *delimiter, out);
             }
-            write(STDOUT_FILENO, buffer, bytes_read);
+        } else {
+            result = split_streamed(fd, *delimiter, out);
         }
-
-        if (bytes_read == -1) {
-            perror("read");
+        if (result == -1) {
             error_flag = 1;
         }
 
@@ -56,6 +416,8 @@ int main(int argc, char *argv[]) {
         valid_file_count++;
     }
 
+    free(out);
+
     // If there were no valid files encountered
     if (valid_file_count == 0) {
         fprintf(stderr, "No valid files provided.\n");
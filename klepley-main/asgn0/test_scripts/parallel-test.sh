@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Tests that -j writes the files in their original order, and keeps the exit status rules
+
+./split -j 3 a test_files/alla.txt test_files/mixed.txt test_files/nod.txt test_files/noletters.txt > /tmp/parallelfiles.txt
+
+difference=$(diff /tmp/parallelfiles.txt test_files/allfilescorrect.txt)
+
+./split -j 3 a test_files/alla.txt does_not_exist > /dev/null 2>&1
+status=$?
+
+# Files of several chunks each, so a file's mapping is released while the next is handed out
+yes "a line with a few delimiters in it" | head -c 5000000 > /tmp/parallelbig.txt
+tr a '\n' < /tmp/parallelbig.txt > /tmp/parallelbigcorrect.txt
+cat /tmp/parallelbigcorrect.txt /tmp/parallelbigcorrect.txt > /tmp/parallelbigtwice.txt
+
+big_difference=""
+for jobs in 1 4; do
+	./split -j $jobs a /tmp/parallelbig.txt /tmp/parallelbig.txt > /tmp/parallelbigout.txt
+	big_difference+=$(cmp /tmp/parallelbigout.txt /tmp/parallelbigtwice.txt 2>&1)
+done
+
+if [[ -z "$difference" && $status -eq 1 && -z "$big_difference" ]]; then
+	exit 0
+else
+	exit 1
+fi
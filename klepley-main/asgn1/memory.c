@@ -1,25 +1,69 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE  1024
+#define INPUT_SIZE   65536
+#define COPY_CHUNK   (1 << 30)
+#define LOCK_STRIPES 256
+#define IDLE_SECONDS 5
+
+// Input is read in blocks; whatever the command lines leave over is the start of the body.
+// Every stream has its own, and a batch keeps it from one command to the next.
+typedef struct reader {
+    int fd;
+    int mode; // How bodies leave fd: -1 not known yet, 0 copies, 1 splice, 2 copy_file_range
+    size_t start;
+    size_t end;
+    char input[INPUT_SIZE];
+    char scratch[INPUT_SIZE]; // For copies that must not touch unread input
+} reader;
+
+static reader stdin_reader = { .fd = STDIN_FILENO, .mode = -1 };
+
+// Targets hash by name onto a fixed set of locks; gets of a target share, a set has it alone
+static pthread_rwlock_t target_locks[LOCK_STRIPES];
 
 void exit_with_error(const char *msg, int code) {
     fprintf(stderr, "%s\n", msg);
     exit(code);
 }
 
-int secure_read_line(int file_descriptor, char *dest, int buffer_limit, int must_have_newline) {
+// Takes one byte of input from the block, reading the next block when it runs out
+int buffered_read_byte(reader *r, char *character) {
+    if (r->start == r->end) {
+        ssize_t bytes_read = read(r->fd, r->input, INPUT_SIZE);
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+        r->start = 0;
+        r->end = bytes_read;
+    }
+    *character = r->input[r->start++];
+    return 1;
+}
+
+int secure_read_line(reader *r, char *dest, int buffer_limit, int must_have_newline) {
     int index = 0, bytes_read;
     char character;
     int found_newline = 0;
 
     while (index < buffer_limit - 1) {
-        bytes_read = read(file_descriptor, &character, 1);
+        bytes_read = buffered_read_byte(r, &character);
         if (bytes_read == 1) {
             if (character == '\n') {
                 found_newline = 1;
@@ -29,7 +73,7 @@ int secure_read_line(int file_descriptor, char *dest, int buffer_limit, int must
         } else if (bytes_read == 0) {
             break;
         } else {
-            close(file_descriptor);
+            close(r->fd);
             exit_with_error("Operation Failed", 1);
         }
     }
@@ -41,19 +85,354 @@ int secure_read_line(int file_descriptor, char *dest, int buffer_limit, int must
     return index;
 }
 
-int main(void) {
+// Reads one line of a batch frame. Returns its length, -1 at a clean end of input, or -2 if
+// the line is cut short, too long or cannot be read
+int read_frame_line(reader *r, char *dest, int buffer_limit) {
+    int index = 0;
+    char character;
+    while (index < buffer_limit - 1) {
+        int bytes_read = buffered_read_byte(r, &character);
+        if (bytes_read != 1) {
+            // A daemon connection that idles out between frames ends like a closed one
+            bool ended = bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+            return (ended && index == 0) ? -1 : -2;
+        }
+        if (character == '\n') {
+            dest[index] = '\0';
+            return index;
+        }
+        dest[index++] = character;
+    }
+    return -2;
+}
+
+// Writes all of buf to fd, going around short writes
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Moves up to n bytes of the body from the input to fd without copying them through user
+// space where the kernel allows it: splice from a pipe, copy_file_range from a file.
+// Anything else (a terminal, a socket) is read and written through the scratch buffer.
+// Only call this once the buffered input has been used up.
+ssize_t copy_from_input(reader *r, int fd, size_t n) {
+    if (r->mode == -1) {
+        struct stat st;
+        r->mode = 0;
+        if (fstat(r->fd, &st) == 0) {
+            r->mode = S_ISFIFO(st.st_mode) ? 1 : S_ISREG(st.st_mode) ? 2 : 0;
+        }
+    }
+    n = (n < COPY_CHUNK) ? n : COPY_CHUNK;
+    ssize_t moved = -1;
+    if (r->mode == 1) {
+        moved = splice(r->fd, NULL, fd, NULL, n, SPLICE_F_MOVE);
+    } else if (r->mode == 2) {
+        moved = copy_file_range(r->fd, NULL, fd, NULL, n, 0);
+    }
+    if (moved == -1 && r->mode != 0
+        && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP)) {
+        // The kernel or the filesystem cannot do it; stay with plain copies from now on
+        r->mode = 0;
+    }
+    if (r->mode != 0) {
+        return moved;
+    }
+    ssize_t bytes_read = read(r->fd, r->scratch, (n < INPUT_SIZE) ? n : INPUT_SIZE);
+    if (bytes_read > 0 && write_all(fd, r->scratch, bytes_read) == -1) {
+        return -2;
+    }
+    return bytes_read;
+}
+
+// Sends fd to out_fd until the end of the file or limit bytes, with sendfile, or plain
+// copies where it is refused. Returns the number of bytes sent, or -1
+off_t send_file(int out_fd, int fd, off_t limit, char *read_buffer, size_t buffer_size) {
+    off_t total = 0;
+    ssize_t sent = 0;
+    while (total < limit
+           && (sent = sendfile(out_fd, fd, NULL,
+                   (limit - total < COPY_CHUNK) ? (size_t) (limit - total) : COPY_CHUNK))
+                  > 0) {
+        total += sent;
+    }
+    if (sent >= 0) {
+        return total;
+    }
+    if (total > 0 || (errno != EINVAL && errno != ENOSYS)) {
+        return -1;
+    }
+    ssize_t bytes_read;
+    while (total < limit
+           && (bytes_read = read(fd, read_buffer,
+                   (limit - total < (off_t) buffer_size) ? (size_t) (limit - total) : buffer_size))
+                  > 0) {
+        if (write_all(out_fd, read_buffer, bytes_read) == -1) {
+            return -1;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
+
+/* Batch mode. A stream holds any number of frames, each the same as a single command:
+ *     get\n<target>\n
+ *     set\n<target>\n<length>\n<length bytes>
+ * and gets exactly one result back, a status line and then that many bytes:
+ *     OK <length>\n<file contents>     (a set answers OK 0)
+ *     ERR <length>\n<message>
+ * A frame that cannot be read to its end leaves nowhere to find the next one, so the stream
+ * stops after its ERR.
+ */
+
+pthread_rwlock_t *target_lock(const char *target) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = target; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return &target_locks[hash % LOCK_STRIPES];
+}
+
+int reply(int out_fd, const char *status, size_t length, const char *body) {
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "%s %zu\n", status, length);
+    if (write_all(out_fd, header, header_length) == -1) {
+        return -1;
+    }
+    return (body != NULL) ? write_all(out_fd, body, length) : 0;
+}
+
+int reply_error(int out_fd, const char *msg) {
+    return reply(out_fd, "ERR", strlen(msg), msg);
+}
+
+// Reads past n bytes of body that have nowhere to go; -1 if the input ends first
+int skip_body(reader *r, size_t n) {
+    size_t buffered = r->end - r->start;
+    size_t take = (n < buffered) ? n : buffered;
+    r->start += take;
+    n -= take;
+    while (n > 0) {
+        ssize_t bytes_read = read(r->fd, r->scratch, (n < INPUT_SIZE) ? n : INPUT_SIZE);
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        n -= bytes_read;
+    }
+    return 0;
+}
+
+// Each of these returns 0 if the stream can go on to the next frame
+int batch_get(reader *r, int out_fd, const char *target) {
+    struct stat file_stats;
+    int status;
+    pthread_rwlock_t *lock = target_lock(target);
+    pthread_rwlock_rdlock(lock);
+    // Stat before opening, as the single command does, so that a FIFO is refused, not waited on
+    int fd = -1;
+    if (stat(target, &file_stats) != 0) {
+        status = reply_error(out_fd, "Invalid Command");
+    } else if (!S_ISREG(file_stats.st_mode)) {
+        status = reply_error(out_fd, "Operation Failed");
+    } else if (file_stats.st_size == 0 || (fd = open(target, O_RDONLY)) == -1) {
+        status = reply_error(out_fd, "Invalid Command");
+    } else if ((status = reply(out_fd, "OK", file_stats.st_size, NULL)) == 0) {
+        // The length is already out, so a file cut short under us breaks the frame
+        off_t sent = send_file(out_fd, fd, file_stats.st_size, r->scratch, INPUT_SIZE);
+        status = (sent == file_stats.st_size) ? 0 : -1;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    pthread_rwlock_unlock(lock);
+    return status;
+}
+
+int batch_set(reader *r, int out_fd, const char *target, size_t length) {
+    pthread_rwlock_t *lock = target_lock(target);
+    pthread_rwlock_wrlock(lock);
+    int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        pthread_rwlock_unlock(lock);
+        if (skip_body(r, length) == -1) {
+            reply_error(out_fd, "Invalid Command");
+            return -1;
+        }
+        return reply_error(out_fd, "Operation Failed");
+    }
+
+    // Body bytes that arrived with the command lines go first
+    size_t buffered = r->end - r->start;
+    size_t written = (length < buffered) ? length : buffered;
+    const char *error = (write_all(fd, r->input + r->start, written) == -1) ? "Write Error" : NULL;
+    r->start += written;
+    while (error == NULL && written < length) {
+        ssize_t bytes_read = copy_from_input(r, fd, length - written);
+        if (bytes_read == -2) {
+            error = "Write Error";
+        } else if (bytes_read < 0) {
+            error = "Read Error";
+        } else if (bytes_read == 0) {
+            error = "Invalid Command";
+        }
+        written += (bytes_read > 0) ? bytes_read : 0;
+    }
+    close(fd);
+    pthread_rwlock_unlock(lock);
+
+    // Whatever went wrong, the rest of the body is lost track of, so the stream ends too
+    if (error == NULL) {
+        return reply(out_fd, "OK", 0, NULL);
+    }
+    reply_error(out_fd, error);
+    return -1;
+}
+
+// Runs frames from r until the input ends. Returns 0 then, or 1 if a frame was broken
+int serve_stream(reader *r, int out_fd) {
+    char command[BUFFER_SIZE], target[BUFFER_SIZE], length[BUFFER_SIZE];
+    while (true) {
+        int command_length = read_frame_line(r, command, sizeof(command));
+        if (command_length == -1) {
+            return 0;
+        }
+        if (command_length <= 0 || read_frame_line(r, target, sizeof(target)) <= 0) {
+            reply_error(out_fd, "Invalid Command");
+            return 1;
+        }
+        int status;
+        if (!strcmp(command, "get")) {
+            status = batch_get(r, out_fd, target);
+        } else if (!strcmp(command, "set")) {
+            int digits = read_frame_line(r, length, sizeof(length));
+            if (digits <= 0 || digits > 18 || strspn(length, "0123456789") != (size_t) digits) {
+                reply_error(out_fd, "Invalid Command");
+                return 1;
+            }
+            status = batch_set(r, out_fd, target, strtoull(length, NULL, 10));
+        } else {
+            reply_error(out_fd, "Invalid Command");
+            return 1;
+        }
+        if (status != 0) {
+            return 1;
+        }
+    }
+}
+
+// One daemon worker: takes connections off the socket and runs each as a stream, with a
+// reader of its own that lasts for all of them
+void *serve_connections(void *arg) {
+    int listen_fd = *(int *) arg;
+    reader *r = malloc(sizeof(reader));
+    if (r == NULL) {
+        exit_with_error("Operation Failed", 1);
+    }
+    while (true) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            exit_with_error("Operation Failed", 1);
+        }
+        // A client that goes quiet, or stops taking replies, gives the worker back after a while
+        struct timeval idle = { .tv_sec = IDLE_SECONDS };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        r->fd = conn;
+        r->mode = -1;
+        r->start = r->end = 0;
+        serve_stream(r, conn);
+        close(conn);
+    }
+    return NULL;
+}
+
+// Listens on a Unix socket at path with jobs workers, so that up to jobs connections run at
+// once; their frames only wait on each other when they touch the same target
+void run_daemon(const char *path, int jobs) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        exit_with_error("Invalid Command", 1);
+    }
+    strcpy(addr.sun_path, path);
+    // Only a socket left behind by an earlier daemon is replaced, never some other file
+    struct stat st;
+    if (lstat(path, &st) == 0 && (!S_ISSOCK(st.st_mode) || unlink(path) == -1)) {
+        exit_with_error("Operation Failed", 1);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(listen_fd, 128) == -1) {
+        exit_with_error("Operation Failed", 1);
+    }
+    // A client that hangs up early should end its own stream, not the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * jobs);
+    if (workers == NULL) {
+        exit_with_error("Operation Failed", 1);
+    }
+    for (int i = 1; i < jobs; i++) {
+        pthread_create(&workers[i], NULL, serve_connections, &listen_fd);
+    }
+    serve_connections(&listen_fd);
+}
+
+int main(int argc, char **argv) {
     char command[BUFFER_SIZE], target[BUFFER_SIZE];
     int fd, bytes_read;
     char read_buffer[BUFFER_SIZE], extra_input[BUFFER_SIZE];
     struct stat file_stats;
 
-    if (secure_read_line(STDIN_FILENO, command, sizeof(command), 1) <= 0) {
+    // -b runs a stream of framed commands from stdin, -s a daemon serving them on a socket
+    const char *socket_path = NULL;
+    bool batch = false;
+    int jobs = 1, opt;
+    while ((opt = getopt(argc, argv, "bs:j:")) != -1) {
+        if (opt == 'b') {
+            batch = true;
+        } else if (opt == 's') {
+            socket_path = optarg;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            jobs = atoi(optarg);
+        } else {
+            exit_with_error("usage: memory [-b | -s socket [-j jobs]]", 1);
+        }
+    }
+    if (optind != argc || (batch && socket_path != NULL)) {
+        exit_with_error("usage: memory [-b | -s socket [-j jobs]]", 1);
+    }
+    if (batch || socket_path != NULL) {
+        for (int i = 0; i < LOCK_STRIPES; i++) {
+            pthread_rwlock_init(&target_locks[i], NULL);
+        }
+        if (socket_path != NULL) {
+            run_daemon(socket_path, jobs);
+        }
+        return serve_stream(&stdin_reader, STDOUT_FILENO);
+    }
+
+    if (secure_read_line(&stdin_reader, command, sizeof(command), 1) <= 0) {
 
         exit_with_error("Invalid Command", 1);
     }
 
     if (!strcmp(command, "get")) {
-        if (secure_read_line(STDIN_FILENO, target, sizeof(target), 1) <= 0) {
+        if (secure_read_line(&stdin_reader, target, sizeof(target), 1) <= 0) {
             exit_with_error("Invalid Command", 1);
         }
 
@@ -69,7 +448,7 @@ int main(void) {
             exit_with_error("Invalid Command", 1);
         }
 
-        if (secure_read_line(STDIN_FILENO, extra_input, sizeof(extra_input), 0) > 0) {
+        if (secure_read_line(&stdin_reader, extra_input, sizeof(extra_input), 0) > 0) {
             exit_with_error("Invalid Command", 1);
         }
 
@@ -79,19 +458,17 @@ int main(void) {
             exit_with_error("Invalid Command", 1);
         }
 
-        while ((bytes_read = read(fd, read_buffer, BUFFER_SIZE)) > 0) {
-            if (write(STDOUT_FILENO, read_buffer, bytes_read) != bytes_read) {
-                close(fd);
-                exit_with_error("Write Error", 1);
-            }
+        if (send_file(STDOUT_FILENO, fd, INT64_MAX, stdin_reader.input, INPUT_SIZE) == -1) {
+            close(fd);
+            exit_with_error("Write Error", 1);
         }
         close(fd);
     } else if (!strcmp(command, "set")) {
-        if (secure_read_line(STDIN_FILENO, target, sizeof(target), 1) <= 0) {
+        if (secure_read_line(&stdin_reader, target, sizeof(target), 1) <= 0) {
             exit_with_error("Invalid Command", 1);
         }
 
-        if (secure_read_line(STDIN_FILENO, read_buffer, sizeof(read_buffer), 1) <= 0) {
+        if (secure_read_line(&stdin_reader, read_buffer, sizeof(read_buffer), 1) <= 0) {
             exit_with_error("Invalid Command", 1);
         }
 
@@ -109,7 +486,8 @@ int main(void) {
         int total_written = 0;
         // If content length is zero, check for immediate newline
         if (content_length == 0) {
-            bytes_read = read(STDIN_FILENO, read_buffer, 1); // Check if there is any more input
+            // Check if there is any more input
+            bytes_read = buffered_read_byte(&stdin_reader, read_buffer);
             if (bytes_read == 1 && read_buffer[0] != '\n') {
                 close(fd);
                 exit_with_error("Invalid Command", 1); // Extra data when none should be present
@@ -119,11 +497,24 @@ int main(void) {
             return 0;
         }
 
+        // Body bytes that arrived with the command lines go first
+        size_t buffered = stdin_reader.end - stdin_reader.start;
+        if (buffered > 0) {
+            int take = ((size_t) content_length < buffered) ? content_length : (int) buffered;
+            if (write_all(fd, stdin_reader.input + stdin_reader.start, take) == -1) {
+                close(fd);
+                exit_with_error("Write Error", 1);
+            }
+            stdin_reader.start += take;
+            total_written += take;
+        }
+
         while (total_written < content_length) {
-            int to_read = (BUFFER_SIZE < content_length - total_written)
-                              ? BUFFER_SIZE
-                              : content_length - total_written;
-            bytes_read = read(STDIN_FILENO, read_buffer, to_read);
+            bytes_read = copy_from_input(&stdin_reader, fd, content_length - total_written);
+            if (bytes_read == -2) {
+                close(fd);
+                exit_with_error("Write Error", 1);
+            }
             if (bytes_read < 0) {
                 close(fd);
                 exit_with_error("Read Error", 1);
@@ -137,10 +528,6 @@ int main(void) {
                 }
                 break;
             }
-            if (write(fd, read_buffer, bytes_read) != bytes_read) {
-                close(fd);
-                exit_with_error("Write Error", 1);
-            }
             total_written += bytes_read;
         }
 
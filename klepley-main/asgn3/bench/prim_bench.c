@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../queue.h"
+#include "../rwlock.h"
+
+#define HIST_BUCKETS 40
+#define MAX_THREADS  64
+#define MAX_SWEEP    16
+
+/***********TYPES************/
+// Waits bucketed by powers of two of nanoseconds, plus the exact maximum
+typedef struct latency {
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max;
+    uint64_t count;
+} latency;
+
+// One thread's share of a run; a and b are reads and writes, or pops and pushes
+typedef struct worker {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t ops;
+    latency a;
+    latency b;
+} worker;
+
+// The settings of one run
+typedef struct run {
+    PRIORITY priority;
+    int n;
+    int threads;
+    int write_pct;
+    int cs_iters;
+    int capacity;
+} run;
+
+/***********GLOBALS************/
+static const char *impl = "asgn3";
+static long duration_ms = 100;
+static run current;
+static rwlock_t *lock = NULL;
+static queue_t *queue = NULL;
+static pthread_barrier_t start_line;
+static atomic_int stop = 0;
+static worker workers[MAX_THREADS];
+
+/***********HELPERS************/
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void spin(int iters) {
+    for (volatile int i = 0; i < iters; i++) {
+    }
+}
+
+static void record(latency *l, uint64_t ns) {
+    int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+    l->hist[(bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1]++;
+    l->max = (ns > l->max) ? ns : l->max;
+    l->count++;
+}
+
+static void merge(latency *into, const latency *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->hist[i] += from->hist[i];
+    }
+    into->max = (from->max > into->max) ? from->max : into->max;
+    into->count += from->count;
+}
+
+static double percentile_us(const latency *l, double p) {
+    // The upper edge of the bucket holding the pth wait
+    uint64_t rank = (uint64_t) (l->count * p);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += l->hist[i];
+        if (seen > rank) {
+            return (i == 0) ? 0 : (double) (1ull << i) / 1e3;
+        }
+    }
+    return l->max / 1e3;
+}
+
+static int parse_list(const char *spec, int *out) {
+    int count = 0;
+    char *end;
+    while (count < MAX_SWEEP) {
+        out[count++] = (int) strtol(spec, &end, 10);
+        if (*end != ',') {
+            break;
+        }
+        spec = end + 1;
+    }
+    return count;
+}
+
+/***********WORKERS************/
+
+static void *rwlock_worker(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(&start_line);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        bool write = (int) (next_random(&w->seed) % 100) < current.write_pct;
+        uint64_t asked = now_ns();
+        if (write) {
+            writer_lock(lock);
+            record(&w->b, now_ns() - asked);
+            spin(current.cs_iters);
+            writer_unlock(lock);
+        } else {
+            reader_lock(lock);
+            record(&w->a, now_ns() - asked);
+            spin(current.cs_iters);
+            reader_unlock(lock);
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+static void *producer(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(&start_line);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t asked = now_ns();
+        queue_push(queue, (void *) (uintptr_t) 1);
+        record(&w->b, now_ns() - asked);
+        spin(current.cs_iters);
+        w->ops++;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(&start_line);
+    // NULL is the sentinel pushed once the producers are done
+    while (true) {
+        void *elem;
+        uint64_t asked = now_ns();
+        queue_pop(queue, &elem);
+        if (elem == NULL) {
+            break;
+        }
+        record(&w->a, now_ns() - asked);
+        spin(current.cs_iters);
+        w->ops++;
+    }
+    return NULL;
+}
+
+/***********RUNS************/
+
+static void start_workers(int count, void *(*body)(void *), int first) {
+    for (int i = first; i < first + count; i++) {
+        memset(&workers[i], 0, sizeof(worker));
+        workers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&workers[i].thread, NULL, body, &workers[i]);
+    }
+}
+
+static uint64_t timed_section(void) {
+    // Everyone starts together, then the clock runs for the duration
+    pthread_barrier_wait(&start_line);
+    uint64_t start = now_ns();
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, 1);
+    return start;
+}
+
+static void report(const char *bench, int count, int total, uint64_t ops, double seconds) {
+    // Jain's fairness index over the first count threads' op counts, and the smallest share
+    double sum = 0, squares = 0;
+    uint64_t least = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        sum += workers[i].ops;
+        squares += (double) workers[i].ops * workers[i].ops;
+        least = (workers[i].ops < least) ? workers[i].ops : least;
+    }
+    // Waits from every thread
+    latency a = { { 0 }, 0, 0 }, b = { { 0 }, 0, 0 };
+    for (int i = 0; i < total; i++) {
+        merge(&a, &workers[i].a);
+        merge(&b, &workers[i].b);
+    }
+    double fairness = (squares > 0) ? sum * sum / (count * squares) : 1;
+    double min_share = (sum > 0) ? least * count / sum : 0;
+    static const char *priorities[] = { "READERS", "WRITERS", "N_WAY" };
+    printf("%s,%s,%s,%d,%d,%d,%d,%d,%llu,%.0f,%.4f,%.4f,%.3f,%.3f,%.3f,%.3f\n", impl, bench,
+        (strcmp(bench, "rwlock") == 0) ? priorities[current.priority] : "-", current.n,
+        current.threads, current.write_pct, current.cs_iters, current.capacity,
+        (unsigned long long) ops, ops / seconds, fairness, min_share, percentile_us(&a, 0.99),
+        a.max / 1e3, percentile_us(&b, 0.99), b.max / 1e3);
+    fflush(stdout);
+}
+
+static void run_rwlock(void) {
+    lock = rwlock_new(current.priority, current.n);
+    atomic_store(&stop, 0);
+    pthread_barrier_init(&start_line, NULL, current.threads + 1);
+    start_workers(current.threads, rwlock_worker, 0);
+    uint64_t start = timed_section();
+    // A starved thread only gets its turn once the others stop, which counts as its wait
+    uint64_t ops = 0;
+    for (int i = 0; i < current.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_line);
+    rwlock_delete(&lock);
+    report("rwlock", current.threads, current.threads, ops, seconds);
+}
+
+static void run_queue(void) {
+    // threads producers and as many consumers
+    queue = queue_new(current.capacity);
+    atomic_store(&stop, 0);
+    pthread_barrier_init(&start_line, NULL, 2 * current.threads + 1);
+    start_workers(current.threads, producer, 0);
+    start_workers(current.threads, consumer, current.threads);
+    uint64_t start = timed_section();
+    for (int i = 0; i < current.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < current.threads; i++) {
+        queue_push(queue, NULL);
+    }
+    uint64_t ops = 0;
+    for (int i = current.threads; i < 2 * current.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_line);
+    queue_delete(&queue);
+    // Fairness is judged among the producers, who compete for free slots
+    report("queue", current.threads, 2 * current.threads, ops, seconds);
+}
+
+/***********MAIN************/
+
+int main(int argc, char **argv) {
+    int threads[MAX_SWEEP] = { 1, 2, 4, 8 }, thread_count = 4;
+    int writes[MAX_SWEEP] = { 1, 10, 50 }, write_count = 3;
+    int cs[MAX_SWEEP] = { 0, 100, 1000 }, cs_count = 3;
+    int capacities[MAX_SWEEP] = { 1, 8, 64, 1024 }, capacity_count = 4;
+    int ns[MAX_SWEEP] = { 1, 4 }, n_count = 2;
+    bool do_rwlock = true, do_queue = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:d:t:w:c:q:n:RQ")) != -1) {
+        if (opt == 'i') {
+            impl = optarg;
+        } else if (opt == 'd') {
+            duration_ms = atol(optarg);
+        } else if (opt == 't') {
+            thread_count = parse_list(optarg, threads);
+        } else if (opt == 'w') {
+            write_count = parse_list(optarg, writes);
+        } else if (opt == 'c') {
+            cs_count = parse_list(optarg, cs);
+        } else if (opt == 'q') {
+            capacity_count = parse_list(optarg, capacities);
+        } else if (opt == 'n') {
+            n_count = parse_list(optarg, ns);
+        } else if (opt == 'R') {
+            do_queue = false;
+        } else if (opt == 'Q') {
+            do_rwlock = false;
+        } else {
+            fprintf(stderr,
+                "Usage: %s [-i name] [-d ms] [-t threads] [-w write%%] [-c cs iters] "
+                "[-q capacities] [-n n values] [-R | -Q]\n"
+                "  Lists are comma-separated. -R runs only the rwlock sweep, -Q only the queue.\n",
+                argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < thread_count; i++) {
+        if (threads[i] < 1 || 2 * threads[i] > MAX_THREADS) {
+            fprintf(stderr, "thread counts must be between 1 and %d\n", MAX_THREADS / 2);
+            return EXIT_FAILURE;
+        }
+    }
+    // For the queue, "read" columns are pops and "write" columns are pushes
+    printf("impl,bench,priority,n,threads,write_pct,cs_iters,capacity,ops,ops_per_sec,fairness,"
+           "min_share,read_p99_us,read_max_us,write_p99_us,write_max_us\n");
+    memset(&current, 0, sizeof(current));
+    for (int p = READERS; do_rwlock && p <= N_WAY; p++) {
+        // n only matters for N_WAY
+        for (int k = 0; k < ((p == N_WAY) ? n_count : 1); k++) {
+            for (int t = 0; t < thread_count; t++) {
+                for (int w = 0; w < write_count; w++) {
+                    for (int c = 0; c < cs_count; c++) {
+                        current = (run) { (PRIORITY) p, (p == N_WAY) ? ns[k] : 0, threads[t],
+                            writes[w], cs[c], 0 };
+                        run_rwlock();
+                    }
+                }
+            }
+        }
+    }
+    for (int q = 0; do_queue && q < capacity_count; q++) {
+        for (int t = 0; t < thread_count; t++) {
+            for (int c = 0; c < cs_count; c++) {
+                current = (run) { READERS, 0, threads[t], 0, cs[c], capacities[q] };
+                run_queue();
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
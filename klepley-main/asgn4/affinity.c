@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "affinity.h"
+
+/***********DEFS************/
+#define MAX_CPUS 1024
+
+// One counter per cache line so cores never share a line; the alignment keeps the array
+// itself on line boundaries, which the padding alone does not
+typedef struct cpu_counter {
+    _Alignas(64) atomic_long requests;
+    char pad[64 - sizeof(atomic_long)];
+} cpu_counter;
+
+/***********GLOBALS************/
+static int layout[MAX_CPUS];
+static int layout_len = 0;
+static cpu_counter counters[MAX_CPUS];
+
+/***********HELPERS************/
+
+static void pin_to(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/***********AFFINITY FUNCTIONS************/
+
+bool affinity_parse(const char *spec) {
+    layout_len = 0;
+    const char *ptr = spec;
+    while (*ptr != '\0') {
+        // Each item is either a CPU or an inclusive range of CPUs
+        char *end = NULL;
+        long first = strtol(ptr, &end, 10);
+        if (end == ptr || first < 0 || first >= MAX_CPUS) {
+            return false;
+        }
+        long last = first;
+        ptr = end;
+        if (*ptr == '-') {
+            last = strtol(ptr + 1, &end, 10);
+            if (end == ptr + 1 || last < first || last >= MAX_CPUS) {
+                return false;
+            }
+            ptr = end;
+        }
+        for (long cpu = first; cpu <= last && layout_len < MAX_CPUS; cpu++) {
+            layout[layout_len++] = (int) cpu;
+        }
+        if (*ptr == ',') {
+            ptr++;
+        } else if (*ptr != '\0') {
+            return false;
+        }
+    }
+    return layout_len > 0;
+}
+
+void affinity_pin(THREAD_ROLE role, int index) {
+    if (layout_len == 0) {
+        return;
+    }
+    // Split the list into acceptor, background and worker CPUs
+    int worker_start = (layout_len >= 3) ? 2 : (layout_len == 2 ? 1 : 0);
+    if (role == ROLE_ACCEPTOR) {
+        pin_to(layout[0]);
+    } else if (role == ROLE_BACKGROUND) {
+        pin_to(layout[layout_len >= 3 ? 1 : 0]);
+    } else {
+        pin_to(layout[worker_start + index % (layout_len - worker_start)]);
+    }
+}
+
+void affinity_count_request(void) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < MAX_CPUS) {
+        atomic_fetch_add_explicit(&(counters[cpu].requests), 1, memory_order_relaxed);
+    }
+}
+
+void affinity_report(FILE *out) {
+    if (layout_len > 0) {
+        int workers = (layout_len >= 3) ? layout_len - 2 : 1;
+        fprintf(out, "layout: acceptor cpu %d, background cpu %d, %d worker cpu(s)\n", layout[0],
+            layout[layout_len >= 3 ? 1 : 0], workers);
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        long requests = atomic_load_explicit(&(counters[cpu].requests), memory_order_relaxed);
+        if (requests > 0) {
+            fprintf(out, "cpu %d: %ld requests\n", cpu, requests);
+        }
+    }
+}
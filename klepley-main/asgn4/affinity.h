@@ -0,0 +1,41 @@
+/**
+ * @File affinity.h
+ *
+ * Optional CPU layout for the server's threads, plus per-core request
+ * counters used to check the layout under load.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum { ROLE_ACCEPTOR, ROLE_BACKGROUND, ROLE_WORKER } THREAD_ROLE;
+
+/** @brief Parses a CPU list such as "0-3,8,10-11" and sets up the
+ *         layout. The first CPU is given to the acceptor, the second to
+ *         background threads (stats, cache watch), and the rest are shared
+ *         round-robin by the workers. With two CPUs the acceptor and the
+ *         background threads share the first; with one, everything does.
+ *
+ *  @return false if spec is not a valid CPU list.
+ */
+bool affinity_parse(const char *spec);
+
+/** @brief Pins the calling thread to the CPU its role gets in the layout.
+ *         Does nothing when no layout was given. Workers should call this
+ *         before they allocate anything so that first-touch placement keeps
+ *         their memory on the local NUMA node.
+ *
+ *  @param index The worker number, ignored for other roles.
+ */
+void affinity_pin(THREAD_ROLE role, int index);
+
+/** @brief Counts one request against the CPU the caller is running on.
+ */
+void affinity_count_request(void);
+
+/** @brief Prints the layout and the request count of every CPU that has
+ *         served at least one request.
+ */
+void affinity_report(FILE *out);
@@ -0,0 +1,134 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/***********GLOBALS************/
+static atomic_long alloc_count = 0;
+static arena_t *arena_pool = NULL;
+static pthread_mutex_t arena_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The arena this thread released last, kept off the shared pool so a pinned
+// worker keeps reusing memory that was first touched on its own node
+static _Thread_local arena_t *local_arena = NULL;
+
+/***********COUNTED ALLOCATION************/
+
+void *counted_malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void *counted_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return calloc(count, size);
+}
+
+void *counted_aligned_alloc(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    void *memory = NULL;
+    return (posix_memalign(&memory, alignment, size) == 0) ? memory : NULL;
+}
+
+long mem_alloc_count(void) {
+    return atomic_load_explicit(&alloc_count, memory_order_relaxed);
+}
+
+/***********ARENAS************/
+
+arena_t *arena_acquire(void) {
+    // Prefer this thread's own arena, then a pooled one
+    arena_t *arena = local_arena;
+    local_arena = NULL;
+    if (arena == NULL) {
+        pthread_mutex_lock(&arena_pool_mutex);
+        arena = arena_pool;
+        if (arena != NULL) {
+            arena_pool = arena->next;
+        }
+        pthread_mutex_unlock(&arena_pool_mutex);
+    }
+    // Otherwise grow the pool by one; this only happens while warming up
+    if (arena == NULL) {
+        arena = counted_malloc(sizeof(arena_t));
+        if (arena == NULL) {
+            return NULL;
+        }
+    }
+    arena->next = NULL;
+    arena_reset(arena);
+    return arena;
+}
+
+void arena_release(arena_t *arena) {
+    if (local_arena == NULL) {
+        local_arena = arena;
+        return;
+    }
+    pthread_mutex_lock(&arena_pool_mutex);
+    arena->next = arena_pool;
+    arena_pool = arena;
+    pthread_mutex_unlock(&arena_pool_mutex);
+}
+
+void arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    // Keep every allocation 8-byte aligned
+    size_t aligned = (size + 7) & ~(size_t) 7;
+    if (aligned > ARENA_SCRATCH_SIZE - arena->used) {
+        return NULL;
+    }
+    void *memory = arena->scratch + arena->used;
+    arena->used += aligned;
+    return memory;
+}
+
+/***********SLABS************/
+
+void slab_init(slab_t *slab, size_t obj_size, size_t per_chunk) {
+    // Objects double as free-list links, so they must fit a pointer
+    slab->obj_size = (obj_size < sizeof(void *)) ? sizeof(void *) : obj_size;
+    slab->obj_size = (slab->obj_size + 7) & ~(size_t) 7;
+    slab->per_chunk = per_chunk;
+    slab->free = NULL;
+    slab->chunks = NULL;
+}
+
+void *slab_alloc(slab_t *slab) {
+    if (slab->free == NULL) {
+        // Each chunk starts with a link to the previous chunk
+        char *chunk = counted_malloc(sizeof(void *) + slab->obj_size * slab->per_chunk);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(void **) chunk = slab->chunks;
+        slab->chunks = chunk;
+        // Thread every object in the new chunk onto the free list
+        char *objects = chunk + sizeof(void *);
+        for (size_t i = 0; i < slab->per_chunk; i++) {
+            slab_free(slab, objects + i * slab->obj_size);
+        }
+    }
+    void *obj = slab->free;
+    slab->free = *(void **) obj;
+    return obj;
+}
+
+void slab_free(slab_t *slab, void *obj) {
+    *(void **) obj = slab->free;
+    slab->free = obj;
+}
+
+void slab_destroy(slab_t *slab) {
+    void *chunk = slab->chunks;
+    while (chunk != NULL) {
+        void *next = *(void **) chunk;
+        free(chunk);
+        chunk = next;
+    }
+    slab->free = NULL;
+    slab->chunks = NULL;
+}
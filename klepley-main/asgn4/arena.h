@@ -0,0 +1,100 @@
+/**
+ * @File arena.h
+ *
+ * Recycled per-connection scratch arenas and a fixed-size object slab so
+ * that the steady-state request path never touches the heap.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_IO_SIZE      4096
+#define ARENA_SCRATCH_SIZE 8192
+
+/** @struct arena_t
+ *  @brief A per-connection block holding a fixed-size I/O buffer plus a
+ *         bump-allocated scratch area that is reset for every request.
+ */
+typedef struct arena {
+    struct arena *next;
+    size_t used;
+    char io[ARENA_IO_SIZE + 1];
+    char scratch[ARENA_SCRATCH_SIZE];
+} arena_t;
+
+/** @struct slab_t
+ *  @brief A free-list allocator for objects of a single size. Chunks are
+ *         never returned to the heap until the slab is destroyed. The
+ *         slab does no locking of its own; callers must serialize access.
+ */
+typedef struct slab {
+    size_t obj_size;
+    size_t per_chunk;
+    void *free;
+    void *chunks;
+} slab_t;
+
+/** @brief malloc that is counted by mem_alloc_count. Every heap
+ *         allocation made by the server itself goes through here.
+ */
+void *counted_malloc(size_t size);
+
+/** @brief calloc counterpart of counted_malloc.
+ */
+void *counted_calloc(size_t count, size_t size);
+
+/** @brief posix_memalign counterpart of counted_malloc.
+ *
+ *  @return The memory, or NULL if it could not be allocated.
+ */
+void *counted_aligned_alloc(size_t alignment, size_t size);
+
+/** @brief The number of heap allocations made through counted_malloc,
+ *         counted_calloc and counted_aligned_alloc so far.
+ */
+long mem_alloc_count(void);
+
+/** @brief Takes the arena this thread released last if it has one, else
+ *         one from the pool, allocating a new one only if the pool is
+ *         empty. The returned arena is already reset.
+ *
+ *  @return An arena, or NULL if the pool was empty and allocation failed.
+ */
+arena_t *arena_acquire(void);
+
+/** @brief Hands an arena back for the next connection. Each thread keeps
+ *         one released arena for itself; the rest go to the shared pool.
+ */
+void arena_release(arena_t *arena);
+
+/** @brief Forgets everything allocated from the scratch area. Nothing is
+ *         cleared; callers must not rely on zeroed memory.
+ */
+void arena_reset(arena_t *arena);
+
+/** @brief Bump-allocates size bytes (8-byte aligned) from the scratch
+ *         area.
+ *
+ *  @return The memory, or NULL if the scratch area is exhausted.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/** @brief Initializes slab to hand out objects of obj_size bytes,
+ *         growing per_chunk objects at a time.
+ */
+void slab_init(slab_t *slab, size_t obj_size, size_t per_chunk);
+
+/** @brief Returns an object from the slab. Objects are not zeroed.
+ *
+ *  @return The object, or NULL if a new chunk could not be allocated.
+ */
+void *slab_alloc(slab_t *slab);
+
+/** @brief Puts obj back on the slab's free list.
+ */
+void slab_free(slab_t *slab, void *obj);
+
+/** @brief Frees every chunk owned by slab.
+ */
+void slab_destroy(slab_t *slab);
@@ -0,0 +1,101 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/***********GLOBALS************/
+static int port = 0;
+static double seconds = 5;
+static char request[256];
+static size_t request_len = 0;
+static atomic_long completed = 0;
+static atomic_long failed = 0;
+static atomic_int stop = 0;
+
+/***********HELPERS************/
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int one_connection(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // Connect, send one request and read until the server closes
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || write(fd, request, request_len) != (ssize_t) request_len) {
+        close(fd);
+        return -1;
+    }
+    char buf[4096];
+    ssize_t got = 0, total = 0;
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        total += got;
+    }
+    close(fd);
+    return (got == 0 && total > 0) ? 0 : -1;
+}
+
+static void *client(void *arg) {
+    (void) arg;
+    while (!atomic_load(&stop)) {
+        if (one_connection() == 0) {
+            atomic_fetch_add(&completed, 1);
+        } else {
+            atomic_fetch_add(&failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/***********MAIN************/
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <port> [clients] [seconds] [target]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    port = atoi(argv[1]);
+    int clients = (argc > 2) ? atoi(argv[2]) : 32;
+    seconds = (argc > 3) ? atof(argv[3]) : 5;
+    const char *target = (argc > 4) ? argv[4] : "bench";
+    request_len = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\n\r\n", target);
+    // Every client opens a brand new connection for every request
+    pthread_t *threads = malloc(clients * sizeof(pthread_t));
+    double start = now();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, client, NULL);
+    }
+    // Print the rate once a second, then the overall rate
+    long last = 0;
+    for (int tick = 1; tick <= (int) seconds; tick++) {
+        sleep(1);
+        long done = atomic_load(&completed);
+        printf("t=%ds %ld conn/s\n", tick, done - last);
+        last = done;
+    }
+    atomic_store(&stop, 1);
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    printf("clients=%d connections=%ld failed=%ld elapsed=%.2fs rate=%.0f conn/s\n", clients,
+        atomic_load(&completed), atomic_load(&failed), elapsed, atomic_load(&completed) / elapsed);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,398 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_MAX_LEN 63
+#define BODY_CHUNK   65536
+
+/***********TYPES************/
+typedef enum {
+    PHASE_LATE, // How far behind its schedule the request started
+    PHASE_CONNECT,
+    PHASE_SEND, // Head and body written
+    PHASE_WAIT, // Until the first byte of the response
+    PHASE_RECEIVE, // The rest of the response
+    PHASE_TOTAL,
+    PHASES
+} PHASE;
+
+static const char *phase_names[PHASES] = { "late", "connect", "send", "wait", "receive", "total" };
+
+// One line of the audit log
+typedef struct event {
+    bool put;
+    int target;
+    int status; // Status the server logged originally
+    double at; // Seconds after the first logged request, -1 without timestamps
+} event;
+
+typedef struct target {
+    char name[NAME_MAX_LEN + 1];
+    long size; // Bytes to upload for it, -1 if unknown
+    bool seed; // Has to exist before the replay starts
+    bool written; // A PUT for it has been seen while loading
+} target;
+
+// What happened when one event was replayed
+typedef struct result {
+    double phase[PHASES];
+    long bytes;
+    int status;
+} result;
+
+/***********GLOBALS************/
+static int port = 0;
+static double speed = 1;
+static long default_size = 4096;
+static event *events = NULL;
+static int event_count = 0;
+static target *targets = NULL;
+static int target_count = 0;
+static int *table = NULL;
+static size_t table_mask = 0;
+static result *results = NULL;
+static atomic_int cursor = 0;
+static double replay_start = 0;
+static char body_chunk[BODY_CHUNK];
+
+/***********HELPERS************/
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when) {
+    double wait = when - now();
+    if (wait > 0) {
+        struct timespec ts
+            = { .tv_sec = (time_t) wait, .tv_nsec = (long) ((wait - (time_t) wait) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int find_target(const char *name, bool add) {
+    // FNV-1a into an open-addressed table of target indexes
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    size_t slot = hash & table_mask;
+    while (table[slot] != -1) {
+        if (strcmp(targets[table[slot]].name, name) == 0) {
+            return table[slot];
+        }
+        slot = (slot + 1) & table_mask;
+    }
+    if (!add) {
+        return -1;
+    }
+    target *t = &targets[target_count];
+    strncpy(t->name, name, NAME_MAX_LEN);
+    t->name[NAME_MAX_LEN] = '\0';
+    t->size = -1;
+    t->seed = false;
+    t->written = false;
+    table[slot] = target_count;
+    return target_count++;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t wrote = write(fd, buf, len);
+        if (wrote <= 0) {
+            return false;
+        }
+        buf += wrote;
+        len -= wrote;
+    }
+    return true;
+}
+
+/***********REQUESTS************/
+
+static void run_request(bool put, target *t, result *r) {
+    double start = now();
+    r->status = -1;
+    r->bytes = 0;
+    for (int p = PHASE_CONNECT; p < PHASES; p++) {
+        r->phase[p] = 0;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    double connected = now();
+    // The head, then for a PUT the body in chunks of the same filler bytes
+    char head[192];
+    long size = (t->size >= 0) ? t->size : default_size;
+    int head_len = put ? snprintf(head, sizeof(head),
+                             "PUT /%s HTTP/1.1\r\nContent-Length: %ld\r\n\r\n", t->name, size)
+                       : snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\n\r\n", t->name);
+    bool ok = write_all(fd, head, head_len);
+    for (long left = put ? size : 0; ok && left > 0; left -= BODY_CHUNK) {
+        ok = write_all(fd, body_chunk, (left < BODY_CHUNK) ? left : BODY_CHUNK);
+    }
+    double sent = now();
+    // Read until the server closes, noting when the first byte arrives
+    char buf[65536];
+    double first = 0;
+    ssize_t got;
+    while (ok && (got = read(fd, buf, sizeof(buf))) > 0) {
+        if (first == 0) {
+            first = now();
+            if (got >= 12 && memcmp(buf, "HTTP/1.1 ", 9) == 0) {
+                r->status = atoi(buf + 9);
+            }
+        }
+        r->bytes += got;
+    }
+    close(fd);
+    double end = now();
+    if (first == 0) {
+        first = end;
+    }
+    r->phase[PHASE_CONNECT] = connected - start;
+    r->phase[PHASE_SEND] = sent - connected;
+    r->phase[PHASE_WAIT] = first - sent;
+    r->phase[PHASE_RECEIVE] = end - first;
+    r->phase[PHASE_TOTAL] = end - start;
+}
+
+static void *client(void *arg) {
+    (void) arg;
+    // Events are claimed strictly in log order and started on their schedule
+    int index;
+    while ((index = atomic_fetch_add(&cursor, 1)) < event_count) {
+        event *e = &events[index];
+        double due = replay_start;
+        if (speed > 0 && e->at >= 0) {
+            due += e->at / speed;
+            sleep_until(due);
+        }
+        double late = now() - due;
+        run_request(e->put, &targets[e->target], &results[index]);
+        results[index].phase[PHASE_LATE] = (speed > 0 && e->at >= 0) ? late : 0;
+    }
+    return NULL;
+}
+
+/***********LOADING************/
+
+static bool load_log(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return false;
+    }
+    // Count the lines first so every array can be sized once
+    int lines = 0;
+    for (int c; (c = fgetc(in)) != EOF;) {
+        lines += (c == '\n');
+    }
+    rewind(in);
+    events = calloc(lines + 1, sizeof(event));
+    targets = calloc(lines + 1, sizeof(target));
+    size_t capacity = 1;
+    while (capacity < 2 * (size_t) (lines + 1)) {
+        capacity <<= 1;
+    }
+    table = malloc(capacity * sizeof(int));
+    memset(table, -1, capacity * sizeof(int));
+    table_mask = capacity - 1;
+    // METHOD,/target,status,id[,timestamp]
+    char line[256];
+    double first_at = -1;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char method[16], name[NAME_MAX_LEN + 2];
+        int status, id;
+        double at = -1;
+        int fields = sscanf(line, "%15[^,],/%64[^,],%d,%d,%lf", method, name, &status, &id, &at);
+        if (fields < 4 || strlen(name) > NAME_MAX_LEN) {
+            continue;
+        }
+        // Batch items were reads of their own targets
+        bool put = strcmp(method, "PUT") == 0;
+        if (!put && strcmp(method, "GET") != 0 && strcmp(method, "MGET") != 0) {
+            continue;
+        }
+        if (fields == 5 && first_at < 0) {
+            first_at = at;
+        }
+        event *e = &events[event_count++];
+        e->put = put;
+        e->target = find_target(name, true);
+        e->status = status;
+        e->at = (fields == 5) ? at - first_at : -1;
+        // Reads that found the file need it to exist unless an earlier PUT made it
+        target *t = &targets[e->target];
+        if (put) {
+            t->written = true;
+        } else if (status == 200 && !t->written) {
+            t->seed = true;
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+static bool load_sizes(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return false;
+    }
+    // "name size" per line, e.g. from find . -maxdepth 1 -type f -printf '%P %s\n'
+    char name[256];
+    long size;
+    while (fscanf(in, "%255s %ld", name, &size) == 2) {
+        int index = find_target(name + (name[0] == '/'), false);
+        if (index != -1) {
+            targets[index].size = size;
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+/***********REPORTING************/
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void report_phases(bool put, double *scratch) {
+    int count = 0;
+    for (int i = 0; i < event_count; i++) {
+        count += (events[i].put == put && results[i].status != -1);
+    }
+    if (count == 0) {
+        return;
+    }
+    printf("%s (%d requests)\n", put ? "PUT" : "GET", count);
+    printf("  %-8s %10s %10s %10s %10s %10s\n", "phase", "mean ms", "p50 ms", "p90 ms", "p99 ms",
+        "max ms");
+    for (int p = 0; p < PHASES; p++) {
+        int n = 0;
+        double sum = 0;
+        for (int i = 0; i < event_count; i++) {
+            if (events[i].put == put && results[i].status != -1) {
+                scratch[n++] = results[i].phase[p];
+                sum += results[i].phase[p];
+            }
+        }
+        qsort(scratch, n, sizeof(double), compare_doubles);
+        printf("  %-8s %10.3f %10.3f %10.3f %10.3f %10.3f\n", phase_names[p], sum / n * 1e3,
+            scratch[n / 2] * 1e3, scratch[(int) (n * 0.9)] * 1e3, scratch[(int) (n * 0.99)] * 1e3,
+            scratch[n - 1] * 1e3);
+    }
+}
+
+/***********MAIN************/
+
+int main(int argc, char **argv) {
+    const char *sizes_path = NULL;
+    int clients = 16;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:x:c:b:")) != -1) {
+        if (opt == 's') {
+            sizes_path = optarg;
+        } else if (opt == 'x') {
+            speed = atof(optarg);
+        } else if (opt == 'c') {
+            clients = atoi(optarg);
+        } else if (opt == 'b') {
+            default_size = atol(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (argc - optind != 2 || clients < 1) {
+        fprintf(stderr,
+            "Usage: %s [-s sizes] [-x speed] [-c clients] [-b bytes] <port> <audit log>\n"
+            "  -x 1 replays at the logged pace, -x N N times faster, -x 0 as fast as possible\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+    port = atoi(argv[optind]);
+    if (!load_log(argv[optind + 1]) || (sizes_path != NULL && !load_sizes(sizes_path))) {
+        perror("replay");
+        return EXIT_FAILURE;
+    }
+    if (event_count == 0) {
+        fputs("replay: no GET or PUT lines in the log\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if (speed > 0 && events[0].at < 0) {
+        fputs("replay: the log has no timestamps (httpserver -L), replaying as fast as possible\n",
+            stderr);
+        speed = 0;
+    }
+    memset(body_chunk, 'r', sizeof(body_chunk));
+    results = calloc(event_count, sizeof(result));
+    // Create the files the log read successfully before anything wrote them
+    int seeded = 0;
+    for (int i = 0; i < target_count; i++) {
+        if (targets[i].seed) {
+            result r;
+            run_request(true, &targets[i], &r);
+            seeded += (r.status == 200 || r.status == 201);
+        }
+    }
+    printf(
+        "events=%d targets=%d seeded=%d clients=%d ", event_count, target_count, seeded, clients);
+    if (speed > 0) {
+        printf("speed=%gx\n", speed);
+    } else {
+        printf("speed=max\n");
+    }
+    // Replay
+    pthread_t *threads = malloc(clients * sizeof(pthread_t));
+    replay_start = now();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, client, NULL);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - replay_start;
+    // Throughput, then how the outcome compares with the log
+    long bytes = 0;
+    int failed = 0, mismatched = 0;
+    for (int i = 0; i < event_count; i++) {
+        bytes += results[i].bytes;
+        failed += (results[i].status == -1);
+        mismatched += (results[i].status != -1 && results[i].status != events[i].status);
+    }
+    printf("elapsed=%.2fs rate=%.0f req/s received=%.1f MB/s failed=%d status-mismatch=%d\n",
+        elapsed, event_count / elapsed, bytes / elapsed / 1e6, failed, mismatched);
+    double *scratch = malloc(event_count * sizeof(double));
+    report_phases(false, scratch);
+    report_phases(true, scratch);
+    free(scratch);
+    free(threads);
+    free(results);
+    free(table);
+    free(targets);
+    free(events);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scan.h"
+
+/***********DEFS************/
+#define SEGMENT     1448
+#define MIN_SECONDS 0.2
+
+static const int sizes[] = { 200, 512, 1024, 2048, 4096 };
+
+/***********HELPERS************/
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t build_head(char *buf, size_t target) {
+    // A browser-like request, padded out to the target size with cookies
+    size_t len = sprintf(buf, "GET /index.html HTTP/1.1\r\n"
+                              "Host: localhost:8080\r\n"
+                              "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101\r\n"
+                              "Accept: text/html,application/xhtml+xml\r\n"
+                              "Accept-Language: en-US,en;q=0.5\r\n"
+                              "Request-Id: 12345\r\n");
+    // Longer heads get as many cookie lines (up to 128 bytes of value) as fit
+    while (len + 8 + 1 + 4 < target) {
+        size_t room = target - len - 8 - 4;
+        size_t value = room > 128 ? 128 : room;
+        len += sprintf(buf + len, "Cookie: ");
+        for (size_t i = 0; i < value; i++) {
+            buf[len++] = 'a' + (i % 26);
+        }
+        buf[len++] = '\r';
+        buf[len++] = '\n';
+    }
+    // The blank line that ends the head
+    len += sprintf(buf + len, "\r\n");
+    return len;
+}
+
+static size_t run_rescan(const char *head, size_t len) {
+    // Emulates read_until: search the whole buffer again after every segment
+    size_t arrived = 0;
+    while (arrived < len) {
+        arrived += (len - arrived < SEGMENT) ? len - arrived : SEGMENT;
+        const char *end = memmem(head, arrived, "\r\n\r\n", 4);
+        if (end != NULL) {
+            return end - head + 4;
+        }
+    }
+    return 0;
+}
+
+static size_t run_scanner(const char *head, size_t len, header_scanner *scanner) {
+    // Feed the scanner one segment at a time, as reads would
+    scanner_init(scanner);
+    size_t arrived = 0;
+    while (arrived < len) {
+        arrived += (len - arrived < SEGMENT) ? len - arrived : SEGMENT;
+        if (scanner_feed(scanner, head, arrived)) {
+            return scanner->head_end;
+        }
+    }
+    return 0;
+}
+
+static void report(const char *name, int size, size_t len, long iterations, double elapsed) {
+    double ns = elapsed * 1e9 / iterations;
+    printf("%-6d %-8s %10.1f %10.1f\n", size, name, ns, len * iterations / elapsed / 1e6);
+}
+
+/***********MAIN************/
+
+int main(void) {
+    static char head[8192];
+    static header_scanner scanner;
+    const SCAN_KERNEL kernels[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+    volatile size_t sink = 0;
+    printf("%-6s %-8s %10s %10s\n", "bytes", "method", "ns/head", "MB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = build_head(head, sizes[s]);
+        // Baseline: the rescan-everything approach
+        long iterations = 0;
+        double start = now(), elapsed = 0;
+        do {
+            for (int i = 0; i < 1000; i++) {
+                sink += run_rescan(head, len);
+            }
+            iterations += 1000;
+            elapsed = now() - start;
+        } while (elapsed < MIN_SECONDS);
+        report("rescan", sizes[s], len, iterations, elapsed);
+        // Every scanner kernel this CPU supports
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (!scan_set_kernel(kernels[k])) {
+                continue;
+            }
+            if (run_scanner(head, len, &scanner) != len || scanner.invalid) {
+                fprintf(stderr, "%s kernel failed to parse a %zu byte head\n", scan_kernel_name(), len);
+                return EXIT_FAILURE;
+            }
+            iterations = 0;
+            start = now();
+            do {
+                for (int i = 0; i < 1000; i++) {
+                    sink += run_scanner(head, len, &scanner);
+                }
+                iterations += 1000;
+                elapsed = now() - start;
+            } while (elapsed < MIN_SECONDS);
+            report(scan_kernel_name(), sizes[s], len, iterations, elapsed);
+        }
+    }
+    (void) sink;
+    return EXIT_SUCCESS;
+}
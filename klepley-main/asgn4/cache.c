@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "coro.h"
+#include "response.h"
+
+/***********GLOBALS************/
+static size_t map_threshold = 0;
+static int max_entries = 0;
+
+// Every slot that may hold a file, swept by a CLOCK hand to pick victims
+static cache_slot **clock_ring = NULL;
+static int clock_hand = 0;
+static int clock_used = 0;
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// inotify state; while watching is set, hits are trusted without a stat
+static atomic_bool watching = false;
+static int watch_fd = -1;
+static void (*watch_callback)(void *ctx, const char *name) = NULL;
+static void *watch_ctx = NULL;
+
+/***********HELPERS************/
+
+static bool same_file(const struct stat *a, const struct stat *b) {
+    // A file is unchanged if it is the same inode with the same size and mtime
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+           && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static cached_file *open_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    // Only regular files are cached; everything else takes the slow path
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    cached_file *file = counted_malloc(sizeof(cached_file));
+    if (file == NULL) {
+        close(fd);
+        return NULL;
+    }
+    file->addr = NULL;
+    file->fd = fd;
+    file->st = st;
+    // Small, non-empty files are mapped so header and body share one writev
+    if (st.st_size > 0 && (size_t) st.st_size <= map_threshold) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            // They are sent whole, so ask for the pages up front
+            madvise(addr, st.st_size, MADV_WILLNEED);
+            file->addr = addr;
+            file->fd = -1;
+            close(fd);
+        }
+    }
+    // The slot holds the first reference
+    atomic_init(&file->refs, 1);
+    return file;
+}
+
+static void clock_track(cache_slot *slot) {
+    // Never called with a slot mutex held, so evicting below cannot deadlock
+    pthread_mutex_lock(&clock_mutex);
+    if (slot->clock_index != -1) {
+        pthread_mutex_unlock(&clock_mutex);
+        return;
+    }
+    // Sweep the hand until an unreferenced slot gives up its place
+    while (clock_used == max_entries) {
+        cache_slot *victim = clock_ring[clock_hand];
+        if (victim != NULL && atomic_exchange(&(victim->referenced), false)) {
+            clock_hand = (clock_hand + 1) % max_entries;
+            continue;
+        }
+        if (victim != NULL) {
+            clock_ring[clock_hand] = NULL;
+            victim->clock_index = -1;
+            clock_used--;
+            cache_invalidate(victim);
+        }
+    }
+    // Take the first free place at or after the hand
+    while (clock_ring[clock_hand] != NULL) {
+        clock_hand = (clock_hand + 1) % max_entries;
+    }
+    clock_ring[clock_hand] = slot;
+    slot->clock_index = clock_hand;
+    clock_used++;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+static void *watch_worker(void *arg) {
+    (void) arg;
+    _Alignas(struct inotify_event) char events[4096];
+    while (true) {
+        ssize_t len = read(watch_fd, events, sizeof(events));
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Invalidate every file the batch of events mentions
+        char *ptr = events;
+        while (ptr < events + len) {
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so go back to checking every hit
+                break;
+            }
+            if (event->len > 0) {
+                watch_callback(watch_ctx, event->name);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        if (ptr < events + len) {
+            break;
+        }
+    }
+    atomic_store(&watching, false);
+    return NULL;
+}
+
+/***********CACHE FUNCTIONS************/
+
+void cache_init(size_t threshold, int entries) {
+    map_threshold = threshold;
+    max_entries = entries;
+    if (max_entries > 0) {
+        clock_ring = counted_calloc(max_entries, sizeof(cache_slot *));
+        if (clock_ring == NULL) {
+            max_entries = 0;
+        }
+    }
+}
+
+bool cache_watch(void (*on_change)(void *ctx, const char *name), void *ctx) {
+    if (max_entries == 0) {
+        return false;
+    }
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd == -1) {
+        return false;
+    }
+    // Anything that can change what a name refers to or how big it is
+    uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                    | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(watch_fd, ".", mask) == -1) {
+        close(watch_fd);
+        watch_fd = -1;
+        return false;
+    }
+    watch_callback = on_change;
+    watch_ctx = ctx;
+    atomic_store(&watching, true);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_worker, NULL) != 0) {
+        atomic_store(&watching, false);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void cache_slot_init(cache_slot *slot) {
+    pthread_mutex_init(&(slot->mutex), NULL);
+    slot->file = NULL;
+    slot->clock_index = -1;
+    atomic_init(&(slot->referenced), false);
+}
+
+void cache_slot_destroy(cache_slot *slot) {
+    // Take the slot out of the clock before it goes away
+    pthread_mutex_lock(&clock_mutex);
+    if (slot->clock_index != -1) {
+        clock_ring[slot->clock_index] = NULL;
+        slot->clock_index = -1;
+        clock_used--;
+    }
+    pthread_mutex_unlock(&clock_mutex);
+    cache_invalidate(slot);
+    pthread_mutex_destroy(&(slot->mutex));
+}
+
+cached_file *cache_acquire(cache_slot *slot, const char *path) {
+    if (max_entries == 0) {
+        return NULL;
+    }
+    // Without inotify every hit has to be checked against the file on disk
+    bool trusted = atomic_load(&watching);
+    struct stat st;
+    if (!trusted && stat(path, &st) == -1) {
+        cache_invalidate(slot);
+        return NULL;
+    }
+    pthread_mutex_lock(&(slot->mutex));
+    cached_file *stale = slot->file;
+    // Hand out the existing entry if the file has not changed
+    if (stale != NULL && (trusted || same_file(&(stale->st), &st))) {
+        atomic_fetch_add(&(stale->refs), 1);
+        atomic_store(&(slot->referenced), true);
+        pthread_mutex_unlock(&(slot->mutex));
+        return stale;
+    }
+    // Open while holding the slot mutex so concurrent readers only open once
+    cached_file *fresh = open_file(path);
+    slot->file = fresh;
+    if (fresh != NULL) {
+        atomic_fetch_add(&(fresh->refs), 1);
+        atomic_store(&(slot->referenced), true);
+    }
+    pthread_mutex_unlock(&(slot->mutex));
+    // Drop the slot's reference to the outdated entry
+    if (stale != NULL) {
+        cache_release(stale);
+    }
+    // Count the new entry against the bound, evicting if needed
+    if (fresh != NULL) {
+        clock_track(slot);
+    }
+    return fresh;
+}
+
+void cache_release(cached_file *file) {
+    // The last reference unmaps or closes the file
+    if (atomic_fetch_sub(&(file->refs), 1) == 1) {
+        if (file->addr != NULL) {
+            munmap(file->addr, file->st.st_size);
+        } else {
+            close(file->fd);
+        }
+        free(file);
+    }
+}
+
+void cache_invalidate(cache_slot *slot) {
+    pthread_mutex_lock(&(slot->mutex));
+    cached_file *file = slot->file;
+    slot->file = NULL;
+    pthread_mutex_unlock(&(slot->mutex));
+    if (file != NULL) {
+        cache_release(file);
+    }
+}
+
+ssize_t cache_send(int fd, const char *header, size_t header_len, cached_file *file) {
+    // Descriptors are shared, so sendfile with an explicit offset
+    if (file->addr == NULL) {
+        return response_send_file(fd, header, header_len, file->fd, 0, file->st.st_size);
+    }
+    struct iovec iov[2];
+    // Header and body go out together in a single writev
+    iov[0].iov_base = (void *) header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = file->addr;
+    iov[1].iov_len = file->st.st_size;
+    ssize_t total = response_writev(fd, iov, 2);
+    if (total == -1 && errno == EFAULT) {
+        // The file was truncated underneath the mapping; writev faults instead of the
+        // thread, and the client has part of a body that can never be finished
+        shutdown(fd, SHUT_RDWR);
+    }
+    return total;
+}
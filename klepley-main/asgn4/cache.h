@@ -0,0 +1,108 @@
+/**
+ * @File cache.h
+ *
+ * Per-target cache of open files for the GET path. Small files are kept
+ * memory-mapped; larger ones keep an open read-only descriptor. Both keep
+ * the stat result they were opened with.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** @struct cached_file
+ *  @brief An open regular file along with the stat result it was opened
+ *         with. Files no larger than the mapping threshold are mapped
+ *         (addr is set and fd is -1); others keep a shared read-only fd
+ *         (addr is NULL). Entries are reference counted so that one can
+ *         be replaced or evicted while other readers still use it.
+ */
+typedef struct cached_file {
+    void *addr;
+    int fd;
+    struct stat st;
+    atomic_int refs;
+} cached_file;
+
+/** @struct cache_slot
+ *  @brief The cache entry embedded in each node of the URI lock table.
+ */
+typedef struct cache_slot {
+    pthread_mutex_t mutex;
+    cached_file *file;
+    // Position in the eviction clock, or -1 when the slot is empty
+    int clock_index;
+    atomic_bool referenced;
+} cache_slot;
+
+/** @brief Configures the cache.
+ *
+ *  @param map_threshold The largest file (in bytes) that will be mapped;
+ *         0 means nothing is mapped.
+ *
+ *  @param max_entries The most files kept open at once; 0 disables the
+ *         cache entirely.
+ */
+void cache_init(size_t map_threshold, int max_entries);
+
+/** @brief Starts a background thread that watches the working directory
+ *         with inotify and calls on_change for every file that is
+ *         modified, replaced or removed. While the watch is running cache
+ *         hits are trusted without a stat; if inotify is unavailable every
+ *         hit is checked against the file's inode, size and mtime instead.
+ *
+ *  @param on_change Called with ctx and the file name; it should find the
+ *         slot for the name and call cache_invalidate.
+ *
+ *  @return true if the watch was started.
+ */
+bool cache_watch(void (*on_change)(void *ctx, const char *name), void *ctx);
+
+/** @brief Initializes an empty cache slot.
+ */
+void cache_slot_init(cache_slot *slot);
+
+/** @brief Drops any file held by slot and destroys its mutex.
+ */
+void cache_slot_destroy(cache_slot *slot);
+
+/** @brief Looks up the cached file for path, opening and caching it if
+ *         needed. The caller must hold at least the reader lock of the
+ *         target.
+ *
+ *  @param slot The cache slot belonging to path.
+ *
+ *  @param path The target being requested.
+ *
+ *  @return A referenced entry which must be handed back with
+ *          cache_release, or NULL if path could not be opened as a
+ *          regular file (the caller should fall back to the regular path
+ *          to produce the right error).
+ */
+cached_file *cache_acquire(cache_slot *slot, const char *path);
+
+/** @brief Drops a reference taken by cache_acquire, unmapping or closing
+ *         the file when the last reference goes away.
+ */
+void cache_release(cached_file *file);
+
+/** @brief Removes the file held by slot. Called by PUT while holding the
+ *         writer lock of the target, and by the inotify watch.
+ */
+void cache_invalidate(cache_slot *slot);
+
+/** @brief Writes header followed by the whole cached file to fd. Mapped
+ *         files go out in one writev, which fails with EFAULT if the file was
+ *         truncated underneath the mapping; the connection is then shut
+ *         down and the caller should invalidate the entry. Others use
+ *         sendfile from the shared descriptor without touching its file
+ *         offset.
+ *
+ *  @return The number of bytes written, or -1 on error.
+ */
+ssize_t cache_send(int fd, const char *header, size_t header_len, cached_file *file);
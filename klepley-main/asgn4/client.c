@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "client.h"
+
+#define CLIENT_SLOTS 1024
+
+struct client {
+    char name[CLIENT_NAME_MAX + 1];
+    size_t name_len;
+    bool used;
+    // Tokens left in each bucket; bytes go negative when a transfer overdraws them
+    double requests;
+    double bytes;
+    uint64_t refilled_ns;
+    // Counters for the stats dump
+    long served;
+    long limited;
+    unsigned long long moved;
+};
+
+/***********GLOBALS************/
+static bool client_on = false;
+static double request_rate = 0;
+static double byte_rate = 0;
+// Open addressing by name, with one more record for everyone once the table fills
+static client_t clients[CLIENT_SLOTS + 1];
+static int client_count = 0;
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/***********HELPERS************/
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void claim(client_t *client, const char *name, size_t len) {
+    memcpy(client->name, name, len);
+    client->name[len] = '\0';
+    client->name_len = len;
+    client->used = true;
+    // Start with a full second's worth, and at least one request's
+    client->requests = (request_rate > 1) ? request_rate : 1;
+    client->bytes = byte_rate;
+    client->refilled_ns = now_ns();
+}
+
+// Tops both buckets up for the time since the last refill; callers hold client_mutex
+static void refill(client_t *client) {
+    uint64_t now = now_ns();
+    double elapsed = (double) (now - client->refilled_ns) / 1e9;
+    client->refilled_ns = now;
+    double request_cap = (request_rate > 1) ? request_rate : 1;
+    client->requests += elapsed * request_rate;
+    client->requests = (client->requests > request_cap) ? request_cap : client->requests;
+    client->bytes += elapsed * byte_rate;
+    client->bytes = (client->bytes > byte_rate) ? byte_rate : client->bytes;
+}
+
+/***********CLIENTS************/
+
+void client_init(double requests_per_sec, double bytes_per_sec) {
+    client_on = true;
+    request_rate = requests_per_sec;
+    byte_rate = bytes_per_sec;
+}
+
+bool client_enabled(void) {
+    return client_on;
+}
+
+client_t *client_find(const char *name, size_t len) {
+    len = (len > CLIENT_NAME_MAX) ? CLIENT_NAME_MAX : len;
+    // FNV-1a picks the first slot to probe
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    pthread_mutex_lock(&client_mutex);
+    client_t *found = NULL;
+    // Keep a quarter of the table free so that probes stay short
+    for (int i = 0; i < CLIENT_SLOTS && found == NULL; i++) {
+        client_t *client = &clients[(hash + i) % CLIENT_SLOTS];
+        if (!client->used) {
+            if (client_count >= CLIENT_SLOTS / 4 * 3) {
+                break;
+            }
+            claim(client, name, len);
+            client_count++;
+            found = client;
+        } else if (client->name_len == len && memcmp(client->name, name, len) == 0) {
+            found = client;
+        }
+    }
+    if (found == NULL) {
+        found = &clients[CLIENT_SLOTS];
+        if (!found->used) {
+            claim(found, "other", 5);
+        }
+    }
+    pthread_mutex_unlock(&client_mutex);
+    return found;
+}
+
+bool client_admit(client_t *client) {
+    pthread_mutex_lock(&client_mutex);
+    refill(client);
+    bool admit
+        = (request_rate == 0 || client->requests >= 1) && (byte_rate == 0 || client->bytes > 0);
+    if (admit) {
+        client->requests -= (request_rate == 0) ? 0 : 1;
+        client->served++;
+    } else {
+        client->limited++;
+    }
+    pthread_mutex_unlock(&client_mutex);
+    return admit;
+}
+
+void client_charge(client_t *client, size_t bytes) {
+    pthread_mutex_lock(&client_mutex);
+    client->bytes -= (byte_rate == 0) ? 0 : (double) bytes;
+    client->moved += bytes;
+    pthread_mutex_unlock(&client_mutex);
+}
+
+void client_report(FILE *out) {
+    if (!client_on) {
+        return;
+    }
+    pthread_mutex_lock(&client_mutex);
+    for (int i = 0; i <= CLIENT_SLOTS; i++) {
+        client_t *client = &clients[i];
+        if (client->used) {
+            fprintf(out, "client %s: %ld requests, %ld limited, %llu bytes\n", client->name,
+                client->served, client->limited, client->moved);
+        }
+    }
+    pthread_mutex_unlock(&client_mutex);
+}
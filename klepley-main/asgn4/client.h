@@ -0,0 +1,52 @@
+/**
+ * @File client.h
+ *
+ * Per-client accounting and rate limits. A client is whoever its requests
+ * say they are in X-Client-Id, or else the peer's IP address. Each one has
+ * a token bucket for requests and one for bytes, both refilled every second
+ * and holding one second's worth, and counters that the stats dump prints.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/** The longest client name kept; longer X-Client-Id values are cut. */
+#define CLIENT_NAME_MAX 63
+
+/** @struct client_t
+ *  @brief One client's buckets and counters.
+ */
+typedef struct client client_t;
+
+/** @brief Turns per-client accounting on. A rate of 0 leaves that kind of
+ *         traffic unlimited, but the client is still counted.
+ */
+void client_init(double requests_per_sec, double bytes_per_sec);
+
+/** @brief Whether per-client accounting is on.
+ */
+bool client_enabled(void);
+
+/** @brief Finds the client named name, adding it if it is new. Once the
+ *         table is full new clients share one record named "other".
+ */
+client_t *client_find(const char *name, size_t len);
+
+/** @brief Takes a request token from the client. Bytes may be owed, but
+ *         not while the byte bucket is still empty from earlier requests.
+ *
+ *  @return false if the request is over the limit and should get a 429.
+ */
+bool client_admit(client_t *client);
+
+/** @brief Takes bytes from the client's byte bucket once they have been
+ *         moved, going into debt if need be.
+ */
+void client_charge(client_t *client, size_t bytes);
+
+/** @brief Prints every client's requests, refusals and bytes.
+ */
+void client_report(FILE *out);
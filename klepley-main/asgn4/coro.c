@@ -0,0 +1,745 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "coro.h"
+
+// x86-64 gets a hand-written switch; everything else falls back to ucontext
+#if defined(__x86_64__)
+#define CORO_ASM 1
+#else
+#include <ucontext.h>
+#endif
+
+/***********DEFS************/
+#define CORO_STACK   (64 * 1024)
+#define CORO_POOL    1024
+#define CORO_EVENTS  256
+#define CORO_TICK    100
+#define CORO_TIMEOUT 5000
+
+typedef struct coro {
+#ifdef CORO_ASM
+    void *sp;
+#else
+    ucontext_t context;
+#endif
+    // The whole mapping, guard page included
+    char *stack;
+    size_t stack_len;
+    // Link in the ready queue or the pool
+    struct coro *next;
+    // Links in the list of coroutines parked on a socket or with a deadline
+    struct coro *wait_prev;
+    struct coro *wait_next;
+    int fd;
+    coro_sched *sched;
+    // The wait queue this is parked on, set and cleared only by its own thread
+    coro_waitq *park_on;
+    // Links in that queue, and whether it is still in it, under the queue's mutex
+    struct coro *park_prev;
+    struct coro *park_next;
+    bool parked;
+    // Set for coroutines started with coro_spawn instead of for a connection
+    void (*task)(void *arg);
+    void *arg;
+    long deadline;
+    bool waiting;
+    bool timed_out;
+    bool done;
+} coro_t;
+
+struct coro_sched {
+#ifdef CORO_ASM
+    void *sp;
+#else
+    ucontext_t context;
+#endif
+    void (*handler)(int fd, void *ctx);
+    void *ctx;
+    coro_t *current;
+    coro_t *ready_head;
+    coro_t *ready_tail;
+    coro_t *waiting;
+    // Finished coroutines whose stacks are reused
+    coro_t *pool;
+    int pooled;
+    // Coroutines started and not yet finished
+    int live;
+    // Coroutines that yielded during the current round
+    int paused;
+    int epoll_fd;
+    // Wakes the scheduler when connections are submitted or it is closed
+    int event_fd;
+    pthread_mutex_t inbox_mutex;
+    int *inbox;
+    int inbox_len;
+    int inbox_cap;
+    // Parked coroutines woken from other threads, handed over like the inbox
+    coro_t *woken;
+    bool closed;
+};
+
+/***********GLOBALS************/
+static _Thread_local coro_sched *this_sched = NULL;
+
+/***********CONTEXT SWITCH************/
+#ifdef CORO_ASM
+// Saves the callee-saved registers and FP control words on the current stack,
+// stores the stack pointer in *save, then loads load and restores the same
+// from there. A new stack is prepared to look like a suspended one.
+void coro_switch(void **save, void *load);
+__asm__(".text\n"
+        ".p2align 4\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch, .-coro_switch\n");
+#endif
+
+static void coro_entry(void);
+
+static void prepare_stack(coro_t *c) {
+#ifdef CORO_ASM
+    // The return slot sits 16-byte aligned so coro_entry starts with an ABI-aligned stack
+    char *top = c->stack + c->stack_len;
+    void **ret = (void **) (top - 16);
+    void (*entry)(void) = coro_entry;
+    memcpy(ret, &entry, sizeof(entry));
+    // Six zeroed registers, then the control words of the current thread
+    char *sp = (char *) ret - 7 * sizeof(void *);
+    memset(sp, 0, 7 * sizeof(void *));
+    __asm__ volatile("stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r"(sp) : "memory");
+    c->sp = sp;
+#else
+    long page = sysconf(_SC_PAGESIZE);
+    getcontext(&(c->context));
+    c->context.uc_stack.ss_sp = c->stack + page;
+    c->context.uc_stack.ss_size = c->stack_len - page;
+    c->context.uc_link = NULL;
+    makecontext(&(c->context), coro_entry, 0);
+#endif
+}
+
+static void resume(coro_sched *sched, coro_t *c) {
+    sched->current = c;
+#ifdef CORO_ASM
+    coro_switch(&(sched->sp), c->sp);
+#else
+    swapcontext(&(sched->context), &(c->context));
+#endif
+    sched->current = NULL;
+}
+
+static void suspend(coro_sched *sched, coro_t *c) {
+#ifdef CORO_ASM
+    coro_switch(&(c->sp), sched->sp);
+#else
+    swapcontext(&(c->context), &(sched->context));
+#endif
+}
+
+/***********HELPERS************/
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void push_ready(coro_sched *sched, coro_t *c) {
+    c->next = NULL;
+    if (sched->ready_tail == NULL) {
+        sched->ready_head = c;
+    } else {
+        sched->ready_tail->next = c;
+    }
+    sched->ready_tail = c;
+}
+
+static void link_waiting(coro_sched *sched, coro_t *c) {
+    c->waiting = true;
+    c->wait_prev = NULL;
+    c->wait_next = sched->waiting;
+    if (sched->waiting != NULL) {
+        sched->waiting->wait_prev = c;
+    }
+    sched->waiting = c;
+}
+
+static void unlink_waiting(coro_sched *sched, coro_t *c) {
+    if (c->wait_prev != NULL) {
+        c->wait_prev->wait_next = c->wait_next;
+    } else {
+        sched->waiting = c->wait_next;
+    }
+    if (c->wait_next != NULL) {
+        c->wait_next->wait_prev = c->wait_prev;
+    }
+    c->waiting = false;
+}
+
+static coro_t *coro_new(coro_sched *sched, int fd) {
+    // Reuse a pooled coroutine and its stack when there is one
+    coro_t *c = sched->pool;
+    if (c != NULL) {
+        sched->pool = c->next;
+        sched->pooled--;
+    } else {
+        c = counted_malloc(sizeof(coro_t));
+        if (c == NULL) {
+            return NULL;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        c->stack_len = CORO_STACK + page;
+        c->stack = mmap(NULL, c->stack_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (c->stack == MAP_FAILED) {
+            free(c);
+            return NULL;
+        }
+        // The lowest page faults on overflow instead of running into other memory
+        mprotect(c->stack, page, PROT_NONE);
+    }
+    c->next = NULL;
+    c->wait_prev = NULL;
+    c->wait_next = NULL;
+    c->fd = fd;
+    c->sched = sched;
+    c->park_on = NULL;
+    c->parked = false;
+    c->task = NULL;
+    c->arg = NULL;
+    c->waiting = false;
+    c->timed_out = false;
+    c->done = false;
+    prepare_stack(c);
+    sched->live++;
+    return c;
+}
+
+static void coro_free(coro_t *c) {
+    munmap(c->stack, c->stack_len);
+    free(c);
+}
+
+static void recycle(coro_sched *sched, coro_t *c) {
+    sched->live--;
+    if (sched->pooled < CORO_POOL) {
+        c->next = sched->pool;
+        sched->pool = c;
+        sched->pooled++;
+    } else {
+        coro_free(c);
+    }
+}
+
+static void coro_entry(void) {
+    coro_sched *sched = this_sched;
+    coro_t *self = sched->current;
+    if (self->task != NULL) {
+        self->task(self->arg);
+    } else {
+        sched->handler(self->fd, sched->ctx);
+    }
+    // Hand control back for good; the scheduler recycles the stack
+    self->done = true;
+    suspend(sched, self);
+}
+
+// Parks the current coroutine until fd is ready or, for reads, the idle timeout passes
+static bool wait_fd(coro_sched *sched, int fd, uint32_t events) {
+    coro_t *self = sched->current;
+    struct epoll_event event = { .events = events | EPOLLONESHOT, .data.ptr = self };
+    // The fd stays registered (disarmed) between waits, so try re-arming first
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        if (errno != ENOENT || epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            return false;
+        }
+    }
+    self->fd = fd;
+    // Like a blocking socket with only a receive timeout, writes wait as long as it takes
+    self->deadline = (events & EPOLLIN) ? now_ms() + CORO_TIMEOUT : LONG_MAX;
+    self->timed_out = false;
+    link_waiting(sched, self);
+    suspend(sched, self);
+    return !self->timed_out;
+}
+
+// Takes c out of q; the caller holds q's mutex
+static void park_unlink(coro_waitq *q, coro_t *c) {
+    if (c->park_prev != NULL) {
+        c->park_prev->park_next = c->park_next;
+    } else {
+        q->head = c->park_next;
+    }
+    if (c->park_next != NULL) {
+        c->park_next->park_prev = c->park_prev;
+    } else {
+        q->tail = c->park_prev;
+    }
+    c->parked = false;
+}
+
+// Makes a coroutine taken out of its wait queue ready again on its own scheduler
+static void deliver(coro_t *c) {
+    coro_sched *sched = c->sched;
+    if (sched == this_sched) {
+        if (c->waiting) {
+            unlink_waiting(sched, c);
+        }
+        push_ready(sched, c);
+        return;
+    }
+    // Only the owning thread may touch its queues, so pass it over with the inbox
+    pthread_mutex_lock(&(sched->inbox_mutex));
+    c->next = sched->woken;
+    sched->woken = c;
+    pthread_mutex_unlock(&(sched->inbox_mutex));
+    uint64_t one = 1;
+    while (write(sched->event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
+
+static void expire(coro_sched *sched, long now) {
+    coro_t *c = sched->waiting;
+    while (c != NULL) {
+        coro_t *next = c->wait_next;
+        if (c->deadline <= now && c->park_on != NULL) {
+            // A coroutine already taken out of its queue has a wake on the way instead
+            pthread_mutex_lock(&(c->park_on->mutex));
+            bool queued = c->parked;
+            if (queued) {
+                park_unlink(c->park_on, c);
+            }
+            pthread_mutex_unlock(&(c->park_on->mutex));
+            if (queued) {
+                unlink_waiting(sched, c);
+                c->timed_out = true;
+                push_ready(sched, c);
+            }
+        } else if (c->deadline <= now) {
+            epoll_ctl(sched->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            unlink_waiting(sched, c);
+            c->timed_out = true;
+            push_ready(sched, c);
+        }
+        c = next;
+    }
+}
+
+static void take_inbox(coro_sched *sched) {
+    uint64_t count;
+    while (read(sched->event_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+    pthread_mutex_lock(&(sched->inbox_mutex));
+    for (int i = 0; i < sched->inbox_len; i++) {
+        coro_t *c = coro_new(sched, sched->inbox[i]);
+        if (c == NULL) {
+            close(sched->inbox[i]);
+            continue;
+        }
+        push_ready(sched, c);
+    }
+    sched->inbox_len = 0;
+    while (sched->woken != NULL) {
+        coro_t *c = sched->woken;
+        sched->woken = c->next;
+        if (c->waiting) {
+            unlink_waiting(sched, c);
+        }
+        push_ready(sched, c);
+    }
+    pthread_mutex_unlock(&(sched->inbox_mutex));
+}
+
+// Whether fd is worth retrying after the failed call that set errno
+static bool io_retry(int fd, uint32_t events) {
+    if (errno == EINTR) {
+        return true;
+    }
+    coro_sched *sched = this_sched;
+    if (errno != EAGAIN || sched == NULL || sched->current == NULL) {
+        return false;
+    }
+    if (!wait_fd(sched, fd, events)) {
+        errno = EAGAIN;
+        return false;
+    }
+    return true;
+}
+
+/***********SCHEDULER************/
+
+coro_sched *coro_sched_new(void (*handler)(int fd, void *ctx), void *ctx) {
+    coro_sched *sched = counted_calloc(1, sizeof(coro_sched));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->handler = handler;
+    sched->ctx = ctx;
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sched->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // The eventfd is the only registration without a coroutine behind it
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (sched->epoll_fd == -1 || sched->event_fd == -1
+        || epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->event_fd, &event) == -1) {
+        close(sched->epoll_fd);
+        close(sched->event_fd);
+        free(sched);
+        return NULL;
+    }
+    pthread_mutex_init(&(sched->inbox_mutex), NULL);
+    return sched;
+}
+
+void coro_sched_delete(coro_sched **sched) {
+    if (sched && *sched) {
+        while ((*sched)->pool != NULL) {
+            coro_t *c = (*sched)->pool;
+            (*sched)->pool = c->next;
+            coro_free(c);
+        }
+        close((*sched)->epoll_fd);
+        close((*sched)->event_fd);
+        pthread_mutex_destroy(&((*sched)->inbox_mutex));
+        free((*sched)->inbox);
+        free(*sched);
+        *sched = NULL;
+    }
+}
+
+bool coro_sched_submit(coro_sched *sched, void **fds, int count) {
+    pthread_mutex_lock(&(sched->inbox_mutex));
+    if (sched->closed) {
+        pthread_mutex_unlock(&(sched->inbox_mutex));
+        return false;
+    }
+    // The inbox only grows while the scheduler falls behind
+    if (sched->inbox_len + count > sched->inbox_cap) {
+        int cap = (sched->inbox_cap == 0) ? 64 : sched->inbox_cap;
+        while (cap < sched->inbox_len + count) {
+            cap *= 2;
+        }
+        int *inbox = counted_malloc(cap * sizeof(int));
+        if (inbox == NULL) {
+            pthread_mutex_unlock(&(sched->inbox_mutex));
+            return false;
+        }
+        memcpy(inbox, sched->inbox, sched->inbox_len * sizeof(int));
+        free(sched->inbox);
+        sched->inbox = inbox;
+        sched->inbox_cap = cap;
+    }
+    for (int i = 0; i < count; i++) {
+        sched->inbox[sched->inbox_len++] = (int) (uintptr_t) fds[i];
+    }
+    pthread_mutex_unlock(&(sched->inbox_mutex));
+    uint64_t one = 1;
+    while (write(sched->event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+    return true;
+}
+
+void coro_sched_close(coro_sched *sched) {
+    pthread_mutex_lock(&(sched->inbox_mutex));
+    sched->closed = true;
+    pthread_mutex_unlock(&(sched->inbox_mutex));
+    uint64_t one = 1;
+    while (write(sched->event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
+
+void coro_sched_run(coro_sched *sched) {
+    this_sched = sched;
+    struct epoll_event events[CORO_EVENTS];
+    long next_scan = now_ms() + CORO_TICK;
+    while (true) {
+        // Run one round: only the coroutines that were ready when it started
+        coro_t *round = sched->ready_head;
+        sched->ready_head = NULL;
+        sched->ready_tail = NULL;
+        sched->paused = 0;
+        int ran = 0;
+        while (round != NULL) {
+            coro_t *c = round;
+            round = c->next;
+            resume(sched, c);
+            ran++;
+            if (c->done) {
+                recycle(sched, c);
+            }
+        }
+        // Done once closed with nothing running and nothing left to start
+        if (sched->live == 0) {
+            pthread_mutex_lock(&(sched->inbox_mutex));
+            bool finished = sched->closed && sched->inbox_len == 0;
+            pthread_mutex_unlock(&(sched->inbox_mutex));
+            if (finished) {
+                break;
+            }
+        }
+        // Poll without sleeping while there is work, but back off if all of it
+        // is spinning on locks held elsewhere
+        int timeout = -1;
+        if (sched->ready_head != NULL) {
+            timeout = (sched->paused == ran) ? 1 : 0;
+        } else if (sched->waiting != NULL) {
+            timeout = CORO_TICK;
+        }
+        int count = epoll_wait(sched->epoll_fd, events, CORO_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            coro_t *c = events[i].data.ptr;
+            if (c == NULL) {
+                take_inbox(sched);
+            } else if (c->waiting) {
+                unlink_waiting(sched, c);
+                push_ready(sched, c);
+            }
+        }
+        // Time out idle sockets every tick
+        if (sched->waiting != NULL) {
+            long now = now_ms();
+            if (now >= next_scan) {
+                expire(sched, now);
+                next_scan = now + CORO_TICK;
+            }
+        }
+    }
+    this_sched = NULL;
+}
+
+bool coro_active(void) {
+    return this_sched != NULL && this_sched->current != NULL;
+}
+
+bool coro_spawn(void (*task)(void *arg), void *arg) {
+    coro_sched *sched = this_sched;
+    if (sched == NULL || sched->current == NULL) {
+        return false;
+    }
+    coro_t *c = coro_new(sched, -1);
+    if (c == NULL) {
+        return false;
+    }
+    c->task = task;
+    c->arg = arg;
+    push_ready(sched, c);
+    return true;
+}
+
+void coro_yield(void) {
+    coro_sched *sched = this_sched;
+    if (sched == NULL || sched->current == NULL) {
+        sched_yield();
+        return;
+    }
+    coro_t *self = sched->current;
+    sched->paused++;
+    push_ready(sched, self);
+    suspend(sched, self);
+}
+
+/***********WAITING************/
+
+void coro_waitq_init(coro_waitq *q) {
+    pthread_mutex_init(&(q->mutex), NULL);
+    // Deadlines for threads are monotonic, like the coroutines'
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(q->cond), &attr);
+    pthread_condattr_destroy(&attr);
+    q->head = NULL;
+    q->tail = NULL;
+    atomic_init(&(q->sleepers), 0);
+}
+
+bool coro_wait(coro_waitq *q, bool (*ready)(void *arg), void *arg, int timeout_ms) {
+    coro_sched *sched = this_sched;
+    bool in_coro = sched != NULL && sched->current != NULL;
+    long deadline = (timeout_ms < 0) ? LONG_MAX : now_ms() + timeout_ms;
+    // Counted before the first check, so a waker that changes the condition after it
+    // either sees a sleeper or was seen by the check
+    atomic_fetch_add(&(q->sleepers), 1);
+    pthread_mutex_lock(&(q->mutex));
+    bool met;
+    while (!(met = ready(arg)) && now_ms() < deadline) {
+        if (!in_coro) {
+            if (timeout_ms < 0) {
+                pthread_cond_wait(&(q->cond), &(q->mutex));
+            } else {
+                struct timespec ts = { .tv_sec = deadline / 1000,
+                    .tv_nsec = (deadline % 1000) * 1000000 };
+                pthread_cond_timedwait(&(q->cond), &(q->mutex), &ts);
+            }
+            continue;
+        }
+        coro_t *self = sched->current;
+        self->park_on = q;
+        self->parked = true;
+        self->park_next = NULL;
+        self->park_prev = q->tail;
+        if (q->tail != NULL) {
+            q->tail->park_next = self;
+        } else {
+            q->head = self;
+        }
+        q->tail = self;
+        // Only a deadline needs the scheduler to look at it; a wake finds it through q
+        if (timeout_ms >= 0) {
+            self->fd = -1;
+            self->deadline = deadline;
+            link_waiting(sched, self);
+        }
+        pthread_mutex_unlock(&(q->mutex));
+        suspend(sched, self);
+        self->park_on = NULL;
+        pthread_mutex_lock(&(q->mutex));
+    }
+    pthread_mutex_unlock(&(q->mutex));
+    atomic_fetch_sub(&(q->sleepers), 1);
+    return met;
+}
+
+void coro_wake_all(coro_waitq *q) {
+    if (atomic_load(&(q->sleepers)) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    coro_t *c = q->head;
+    q->head = NULL;
+    q->tail = NULL;
+    for (coro_t *p = c; p != NULL; p = p->park_next) {
+        p->parked = false;
+    }
+    pthread_cond_broadcast(&(q->cond));
+    pthread_mutex_unlock(&(q->mutex));
+    while (c != NULL) {
+        coro_t *next = c->park_next;
+        deliver(c);
+        c = next;
+    }
+}
+
+/***********LOCKS************/
+
+// The wait conditions try to take the lock, so a waiter that sees it free has it
+static bool try_write(void *arg) {
+    coro_rwlock *lock = arg;
+    int expected = 0;
+    return atomic_compare_exchange_strong(&(lock->state), &expected, -1);
+}
+
+static bool try_read(void *arg) {
+    coro_rwlock *lock = arg;
+    int state = atomic_load(&(lock->state));
+    while (state >= 0 && atomic_load(&(lock->writers_waiting)) == 0) {
+        if (atomic_compare_exchange_weak(&(lock->state), &state, state + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void coro_rwlock_init(coro_rwlock *lock) {
+    atomic_init(&(lock->state), 0);
+    atomic_init(&(lock->writers_waiting), 0);
+    coro_waitq_init(&(lock->waiters));
+}
+
+void coro_rwlock_lock(coro_rwlock *lock, bool write) {
+    if (write) {
+        // Announce the writer so no new readers get in, then wait for the holders to leave
+        atomic_fetch_add(&(lock->writers_waiting), 1);
+        if (!try_write(lock)) {
+            coro_wait(&(lock->waiters), try_write, lock, -1);
+        }
+        // Readers held back meanwhile are woken when it unlocks
+        atomic_fetch_sub(&(lock->writers_waiting), 1);
+        return;
+    }
+    if (!try_read(lock)) {
+        coro_wait(&(lock->waiters), try_read, lock, -1);
+    }
+}
+
+void coro_rwlock_unlock(coro_rwlock *lock, bool write) {
+    if (write) {
+        atomic_store(&(lock->state), 0);
+    } else if (atomic_fetch_sub(&(lock->state), 1) != 1) {
+        // Readers are still in, so nobody waiting could get it yet
+        return;
+    }
+    coro_wake_all(&(lock->waiters));
+}
+
+/***********I/O************/
+
+ssize_t coro_read(int fd, void *buf, size_t n) {
+    ssize_t result;
+    while ((result = read(fd, buf, n)) == -1 && io_retry(fd, EPOLLIN)) {
+    }
+    return result;
+}
+
+ssize_t coro_write(int fd, const void *buf, size_t n) {
+    ssize_t result;
+    while ((result = write(fd, buf, n)) == -1 && io_retry(fd, EPOLLOUT)) {
+    }
+    return result;
+}
+
+ssize_t coro_writev(int fd, const struct iovec *iov, int count) {
+    ssize_t result;
+    while ((result = writev(fd, iov, count)) == -1 && io_retry(fd, EPOLLOUT)) {
+    }
+    return result;
+}
+
+ssize_t coro_send(int fd, const void *buf, size_t n, int flags) {
+    ssize_t result;
+    while ((result = send(fd, buf, n, flags)) == -1 && io_retry(fd, EPOLLOUT)) {
+    }
+    return result;
+}
+
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t n) {
+    ssize_t result;
+    while ((result = sendfile(out_fd, in_fd, offset, n)) == -1 && io_retry(out_fd, EPOLLOUT)) {
+    }
+    return result;
+}
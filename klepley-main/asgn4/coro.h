@@ -0,0 +1,146 @@
+/**
+ * @File coro.h
+ *
+ * Stackful coroutines for serving many connections per worker thread.
+ * Each worker runs a scheduler that starts a coroutine for every
+ * connection handed to it. When a coroutine's socket would block it parks
+ * on the scheduler's epoll set and another coroutine runs, so the request
+ * handlers keep their plain sequential code. Stacks come from a per-thread
+ * pool and have a guard page below them.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** @struct coro_sched
+ *  @brief One worker's scheduler: its ready queue, epoll set, stack pool
+ *         and the inbox of connections waiting to be started.
+ */
+typedef struct coro_sched coro_sched;
+
+/** @struct coro_waitq
+ *  @brief Coroutines waiting for a condition that some other coroutine or
+ *         thread makes true and then announces with coro_wake_all. A parked
+ *         coroutine is off its scheduler's ready queue until then, so it
+ *         costs nothing while it waits. Threads outside a coroutine wait on
+ *         the condition variable instead.
+ */
+typedef struct coro_waitq {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct coro *head;
+    struct coro *tail;
+    // Callers inside coro_wait, so that a wake with nobody waiting skips the mutex
+    atomic_int sleepers;
+} coro_waitq;
+
+/** @struct coro_rwlock
+ *  @brief A reader/writer lock whose waiters park their coroutine instead
+ *         of blocking their thread. Writers go first: new readers wait
+ *         while a writer is waiting.
+ */
+typedef struct coro_rwlock {
+    // -1 while a writer holds it, otherwise the number of readers
+    atomic_int state;
+    atomic_int writers_waiting;
+    coro_waitq waiters;
+} coro_rwlock;
+
+/** @brief Creates a scheduler that runs handler(fd, ctx) in a new coroutine
+ *         for every connection submitted to it. The handler must close fd.
+ *
+ *  @return The scheduler, or NULL on error.
+ */
+coro_sched *coro_sched_new(void (*handler)(int fd, void *ctx), void *ctx);
+
+/** @brief Frees a scheduler once coro_sched_run has returned, along with
+ *         its pooled stacks, and sets *sched to NULL.
+ */
+void coro_sched_delete(coro_sched **sched);
+
+/** @brief Hands count connections (fds stored as void pointers) to the
+ *         scheduler. Safe to call from any thread.
+ *
+ *  @return false if the scheduler has been closed or is out of memory; the
+ *          caller still owns the fds.
+ */
+bool coro_sched_submit(coro_sched *sched, void **fds, int count);
+
+/** @brief Stops the scheduler from taking connections. coro_sched_run
+ *         returns once every connection already submitted is finished.
+ */
+void coro_sched_close(coro_sched *sched);
+
+/** @brief Runs the scheduler on the calling thread until it is closed and
+ *         idle.
+ */
+void coro_sched_run(coro_sched *sched);
+
+/** @brief Whether the caller is running inside a coroutine.
+ */
+bool coro_active(void);
+
+/** @brief Starts task(arg) in a new coroutine on the caller's scheduler.
+ *         It first runs once the caller yields or parks. The scheduler
+ *         keeps running until it finishes, like a connection.
+ *
+ *  @return false outside a coroutine or if out of memory.
+ */
+bool coro_spawn(void (*task)(void *arg), void *arg);
+
+/** @brief Lets the other ready coroutines run. Outside a coroutine it
+ *         yields the thread instead.
+ */
+void coro_yield(void);
+
+/** @brief Initializes an empty coro_waitq.
+ */
+void coro_waitq_init(coro_waitq *q);
+
+/** @brief Waits until ready(arg) returns true, parking the calling
+ *         coroutine (or blocking the calling thread) between checks. ready
+ *         runs with the queue's mutex held and may take what it checks for,
+ *         such as a lock. Whoever makes it true must call coro_wake_all
+ *         afterwards.
+ *
+ *  @param timeout_ms How long to wait at most, or -1 for no limit. In a
+ *         coroutine the deadline is checked every 100 ms.
+ *
+ *  @return What ready last returned, so false only on a timeout.
+ */
+bool coro_wait(coro_waitq *q, bool (*ready)(void *arg), void *arg, int timeout_ms);
+
+/** @brief Wakes everything waiting on q to check its condition again. Safe
+ *         to call from any thread.
+ */
+void coro_wake_all(coro_waitq *q);
+
+/** @brief Initializes an unlocked coro_rwlock.
+ */
+void coro_rwlock_init(coro_rwlock *lock);
+
+/** @brief Takes the lock for reading or, if write is set, for writing.
+ */
+void coro_rwlock_lock(coro_rwlock *lock, bool write);
+
+/** @brief Releases a lock taken by coro_rwlock_lock with the same write.
+ */
+void coro_rwlock_unlock(coro_rwlock *lock, bool write);
+
+/** @brief Socket I/O that parks the calling coroutine while fd would block.
+ *         Like a blocking socket with a 5 second receive timeout, reads
+ *         give up with -1 and errno EAGAIN after 5 idle seconds, while
+ *         writes wait for as long as it takes. Outside a coroutine they are
+ *         plain system calls. EINTR is retried.
+ */
+ssize_t coro_read(int fd, void *buf, size_t n);
+ssize_t coro_write(int fd, const void *buf, size_t n);
+ssize_t coro_writev(int fd, const struct iovec *iov, int count);
+ssize_t coro_send(int fd, const void *buf, size_t n, int flags);
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t n);
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "dispatch.h"
+
+// One client's share of a fair queue
+typedef struct flow {
+    void **buffer; // Ring of the flow's elements, as large as the whole queue
+    int head; // Index the next push goes to
+    int tail; // Index the next pop comes from
+    int count; // Elements currently queued
+    long deficit; // Bytes the flow may still move before others get ahead of it
+} flow_t;
+
+// Define the structure for the dispatch queue
+typedef struct dispatch {
+    void **buffer; // Ring of queued elements
+    int capacity; // Capacity of the ring
+    int head; // Index the next push goes to
+    int tail; // Index the next pop comes from
+    int count; // Elements currently queued
+    bool closed; // Set once no more pushes are accepted
+
+    // Fair queuing; without it the ring above is used
+    flow_t *flows; // Per-client rings, NULL when not fair
+    int flow_count; // Number of flows keys are hashed into
+    long quantum; // Credit a flow gets per round
+    int *active; // Ring of the flows with elements queued, in round-robin order
+    int active_head; // Index of the flow whose turn it is
+    int active_count; // Flows in the ring
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty; // Signalled when elements arrive
+    pthread_cond_t not_full; // Signalled when room frees up
+} dispatch_t;
+
+/***********QUEUE FUNCTIONS************/
+
+dispatch_t *dispatch_new(int size) {
+    dispatch_t *d = counted_malloc(sizeof(dispatch_t));
+    if (!d) {
+        return NULL;
+    }
+    d->buffer = counted_malloc(size * sizeof(void *));
+    if (!d->buffer) {
+        free(d);
+        return NULL;
+    }
+    d->capacity = size;
+    d->head = 0;
+    d->tail = 0;
+    d->count = 0;
+    d->closed = false;
+    d->flows = NULL;
+    d->flow_count = 0;
+    d->quantum = 0;
+    d->active = NULL;
+    d->active_head = 0;
+    d->active_count = 0;
+    pthread_mutex_init(&(d->mutex), NULL);
+    pthread_cond_init(&(d->not_empty), NULL);
+    pthread_cond_init(&(d->not_full), NULL);
+    return d;
+}
+
+void dispatch_delete(dispatch_t **d) {
+    if (d && *d) {
+        pthread_mutex_destroy(&((*d)->mutex));
+        pthread_cond_destroy(&((*d)->not_empty));
+        pthread_cond_destroy(&((*d)->not_full));
+        for (int i = 0; i < (*d)->flow_count; i++) {
+            free((*d)->flows[i].buffer);
+        }
+        free((*d)->flows);
+        free((*d)->active);
+        free((*d)->buffer);
+        free(*d);
+        *d = NULL;
+    }
+}
+
+bool dispatch_make_fair(dispatch_t *d, int flows, long quantum) {
+    d->flows = counted_calloc(flows, sizeof(flow_t));
+    d->active = counted_malloc(flows * sizeof(int));
+    if (!d->flows || !d->active) {
+        return false;
+    }
+    d->flow_count = flows;
+    d->quantum = quantum;
+    // Each flow can hold the whole queue, so pushes only ever wait on the total
+    for (int i = 0; i < flows; i++) {
+        d->flows[i].buffer = counted_malloc(d->capacity * sizeof(void *));
+        if (!d->flows[i].buffer) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Queues one element, on the flow its key hashes to when the queue is fair
+static void enqueue(dispatch_t *d, void *elem, unsigned key) {
+    if (!d->flows) {
+        d->buffer[d->head] = elem;
+        d->head = (d->head + 1) % d->capacity;
+        d->count++;
+        return;
+    }
+    flow_t *flow = &(d->flows[key % d->flow_count]);
+    if (flow->count == 0) {
+        // A flow joins at the back of the round; only debt run up while queued counts
+        d->active[(d->active_head + d->active_count) % d->flow_count] = key % d->flow_count;
+        d->active_count++;
+        flow->deficit = 0;
+    }
+    flow->buffer[flow->head] = elem;
+    flow->head = (flow->head + 1) % d->capacity;
+    flow->count++;
+    d->count++;
+}
+
+// Takes the next element in deficit round-robin order, one element per turn
+static void *dequeue(dispatch_t *d) {
+    if (!d->flows) {
+        void *elem = d->buffer[d->tail];
+        d->tail = (d->tail + 1) % d->capacity;
+        d->count--;
+        return elem;
+    }
+    // When every queued flow is in debt, skip straight past the rounds that only add credit
+    long rounds = -1;
+    for (int i = 0; i < d->active_count && rounds != 0; i++) {
+        long deficit = d->flows[d->active[(d->active_head + i) % d->flow_count]].deficit;
+        long needed = (deficit > 0) ? 0 : -deficit / d->quantum + 1;
+        rounds = (rounds == -1 || needed < rounds) ? needed : rounds;
+    }
+    for (int i = 0; i < d->active_count && rounds > 0; i++) {
+        d->flows[d->active[(d->active_head + i) % d->flow_count]].deficit += rounds * d->quantum;
+    }
+    // A flow in credit is served and goes to the back; one in debt earns a quantum and waits
+    while (true) {
+        int index = d->active[d->active_head];
+        flow_t *flow = &(d->flows[index]);
+        bool serve = flow->deficit > 0;
+        if (!serve) {
+            flow->deficit += d->quantum;
+        }
+        d->active_head = (d->active_head + 1) % d->flow_count;
+        d->active_count--;
+        void *elem = NULL;
+        if (serve) {
+            elem = flow->buffer[flow->tail];
+            flow->tail = (flow->tail + 1) % d->capacity;
+            flow->count--;
+            d->count--;
+        }
+        if (flow->count > 0) {
+            d->active[(d->active_head + d->active_count) % d->flow_count] = index;
+            d->active_count++;
+        }
+        if (serve) {
+            return elem;
+        }
+    }
+}
+
+bool dispatch_push_batch(dispatch_t *d, void **elems, const unsigned *keys, int count) {
+    if (!d) {
+        return false;
+    }
+    int pushed = 0;
+    pthread_mutex_lock(&(d->mutex));
+    while (pushed < count) {
+        // Only wait if the batch does not fit in what is left
+        while (d->count == d->capacity && !d->closed) {
+            pthread_cond_wait(&(d->not_full), &(d->mutex));
+        }
+        if (d->closed) {
+            pthread_mutex_unlock(&(d->mutex));
+            return false;
+        }
+        // Copy in as much of the batch as fits
+        int before = pushed;
+        while (pushed < count && d->count < d->capacity) {
+            enqueue(d, elems[pushed], (keys != NULL) ? keys[pushed] : 0);
+            pushed++;
+        }
+        // Wake one worker for a single element, all of them for a batch
+        if (pushed - before == 1) {
+            pthread_cond_signal(&(d->not_empty));
+        } else {
+            pthread_cond_broadcast(&(d->not_empty));
+        }
+    }
+    pthread_mutex_unlock(&(d->mutex));
+    return true;
+}
+
+bool dispatch_pop(dispatch_t *d, void **elem) {
+    if (!d) {
+        return false;
+    }
+    pthread_mutex_lock(&(d->mutex));
+    while (d->count == 0 && !d->closed) {
+        pthread_cond_wait(&(d->not_empty), &(d->mutex));
+    }
+    // Closed and drained
+    if (d->count == 0) {
+        pthread_mutex_unlock(&(d->mutex));
+        return false;
+    }
+    *elem = dequeue(d);
+    pthread_cond_signal(&(d->not_full));
+    pthread_mutex_unlock(&(d->mutex));
+    return true;
+}
+
+void dispatch_charge(dispatch_t *d, unsigned key, long cost) {
+    if (!d || !d->flows) {
+        return;
+    }
+    pthread_mutex_lock(&(d->mutex));
+    d->flows[key % d->flow_count].deficit -= cost;
+    pthread_mutex_unlock(&(d->mutex));
+}
+
+void dispatch_close(dispatch_t *d) {
+    pthread_mutex_lock(&(d->mutex));
+    d->closed = true;
+    pthread_cond_broadcast(&(d->not_empty));
+    pthread_cond_broadcast(&(d->not_full));
+    pthread_mutex_unlock(&(d->mutex));
+}
+
+/***********ACCEPTING************/
+
+int listener_tune(int listen_fd) {
+    // accept_batch drains the backlog until accept4 would block
+    int flags = fcntl(listen_fd, F_GETFL);
+    if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    // Keep the listener out of processes started for an upgrade; it is passed explicitly
+    if (fcntl(listen_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        return -1;
+    }
+    // Accepted sockets inherit these, so they are only set here
+    struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    int on = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        || setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        return -1;
+    }
+    // A deeper backlog absorbs connection storms between batches
+    return listen(listen_fd, SOMAXCONN);
+}
+
+unsigned dispatch_key(const struct sockaddr *addr) {
+    // FNV-1a over the address alone; every connection from a host shares a key
+    const unsigned char *bytes;
+    size_t len;
+    if (addr->sa_family == AF_INET) {
+        bytes = (const unsigned char *) &(((const struct sockaddr_in *) addr)->sin_addr);
+        len = sizeof(struct in_addr);
+    } else if (addr->sa_family == AF_INET6) {
+        bytes = (const unsigned char *) &(((const struct sockaddr_in6 *) addr)->sin6_addr);
+        len = sizeof(struct in6_addr);
+    } else {
+        return 0;
+    }
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int accept_batch(int listen_fd, void **fds, unsigned *keys, int max, int timeout_ms, int flags) {
+    // Sleep until at least one connection is pending
+    struct pollfd pending = { .fd = listen_fd, .events = POLLIN, .revents = 0 };
+    if (poll(&pending, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    // Then take everything that is queued, up to max
+    int count = 0;
+    while (count < max) {
+        // The peer address is only asked for when it is wanted
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        peer.ss_family = AF_UNSPEC;
+        struct sockaddr *peer_addr = (keys != NULL) ? (struct sockaddr *) &peer : NULL;
+        int fd = accept4(listen_fd, peer_addr, (keys != NULL) ? &peer_len : NULL,
+            SOCK_CLOEXEC | flags);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        if (keys != NULL) {
+            keys[count] = dispatch_key((struct sockaddr *) &peer);
+        }
+        fds[count++] = (void *) (uintptr_t) fd;
+    }
+    return count;
+}
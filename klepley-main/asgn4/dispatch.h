@@ -0,0 +1,95 @@
+/**
+ * @File dispatch.h
+ *
+ * Batched connection acceptance and the bounded queue that hands
+ * accepted connections to the worker threads, optionally in deficit
+ * round-robin order across clients.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/** @struct dispatch_t
+ *  @brief A bounded FIFO like queue_t that can take a whole batch of
+ *         elements under one lock acquisition and can be closed to wake
+ *         every waiting worker.
+ */
+typedef struct dispatch dispatch_t;
+
+/** @brief Dynamically allocates and initializes a new dispatch queue
+ *         holding at most size elements.
+ */
+dispatch_t *dispatch_new(int size);
+
+/** @brief Delete the queue and free all of its memory, setting *d to
+ *         NULL.
+ */
+void dispatch_delete(dispatch_t **d);
+
+/** @brief Makes d a fair queue: elements are kept per flow, by their key
+ *         modulo flows, and popped one flow at a time in deficit
+ *         round-robin order. Every turn a flow gets quantum of credit, and
+ *         it is only served while its credit is positive, so flows that are
+ *         charged more (dispatch_charge) get fewer turns. Must be called
+ *         before the queue is used.
+ *
+ *  @return false if the flows could not be allocated.
+ */
+bool dispatch_make_fair(dispatch_t *d, int flows, long quantum);
+
+/** @brief Pushes count elements in order. Takes the lock once for as many
+ *         as fit and only waits if the queue fills up part way.
+ *
+ *  @param keys The flow key of each element, or NULL to put them all in
+ *         the first flow. Ignored unless the queue is fair.
+ *
+ *  @return false if d is NULL or has been closed.
+ */
+bool dispatch_push_batch(dispatch_t *d, void **elems, const unsigned *keys, int count);
+
+/** @brief Pops the oldest element, waiting while the queue is empty.
+ *
+ *  @return false once the queue has been closed and drained.
+ */
+bool dispatch_pop(dispatch_t *d, void **elem);
+
+/** @brief Charges the flow of key for cost bytes of work, once an element
+ *         of it has been handled. Does nothing unless the queue is fair.
+ *         Debt only counts while the flow has elements queued.
+ */
+void dispatch_charge(dispatch_t *d, unsigned key, long cost);
+
+/** @brief Closes the queue. Elements already queued can still be popped;
+ *         after that every pop returns false.
+ */
+void dispatch_close(dispatch_t *d);
+
+/** @brief Prepares a listening socket for accept_batch: makes it
+ *         non-blocking, raises its backlog to SOMAXCONN, and sets the
+ *         options that accepted sockets inherit (a 5 second receive
+ *         timeout and TCP_NODELAY) so that they are applied once instead
+ *         of per connection.
+ *
+ *  @return 0, or -1 on error.
+ */
+int listener_tune(int listen_fd);
+
+/** @brief The flow key of a peer address: a hash of the host part, so that
+ *         all of a client's connections share it. 0 for non-IP addresses.
+ */
+unsigned dispatch_key(const struct sockaddr *addr);
+
+/** @brief Waits up to timeout_ms for pending connections, then drains as
+ *         many as are queued (up to max) with accept4 and SOCK_CLOEXEC.
+ *         Each accepted fd is stored in fds as a void pointer.
+ *
+ *  @param keys If not NULL, receives the dispatch_key of each peer.
+ *
+ *  @param flags Further accept4 flags, e.g. SOCK_NONBLOCK.
+ *
+ *  @return The number of connections accepted; 0 on timeout or
+ *          interruption.
+ */
+int accept_batch(int listen_fd, void **fds, unsigned *keys, int max, int timeout_ms, int flags);
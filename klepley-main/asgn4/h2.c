@@ -0,0 +1,889 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "coro.h"
+#include "h2.h"
+#include "hpack.h"
+#include "proxy.h"
+#include "response.h"
+
+/***********DEFS************/
+#define FRAME_HEADER  9
+#define FRAME_MAX     16384
+#define BLOCK_MAX     16384
+#define STREAMS       100
+#define STREAM_WINDOW 65535
+#define RING_SIZE     65536
+#define CONN_WINDOW   (16 << 20)
+#define WINDOW_LIMIT  0x7fffffff
+#define IN_SIZE       (2 * (FRAME_HEADER + FRAME_MAX))
+#define HEAD_MAX      1024
+#define FIELD_MAX     129
+#define RELAY_SIZE    FRAME_MAX
+
+// The rest of the preface after the line read as a request head
+#define PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_REST "SM\r\n\r\n"
+
+typedef enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+} FRAME_TYPE;
+
+#define FLAG_END_STREAM  0x1
+#define FLAG_ACK         0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED      0x8
+#define FLAG_PRIORITY    0x20
+
+#define SETTING_MAX_STREAMS    0x3
+#define SETTING_INITIAL_WINDOW 0x4
+#define SETTING_MAX_FRAME      0x5
+
+typedef enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+    H2_HTTP_1_1_REQUIRED = 0xd
+} H2_ERROR;
+
+typedef struct h2_conn h2_conn;
+
+typedef struct h2_stream {
+    h2_conn *conn;
+    uint32_t id;
+    // Our end of the socketpair; the handler has the other one
+    int bridge_fd;
+    int handler_fd;
+    // Poked by the reader when body bytes or window arrive, or the stream ends
+    int wake_fd;
+    // Body bytes not yet handed to the handler
+    char *ring;
+    size_t ring_head;
+    size_t ring_len;
+    // What the client may still send, and what we may still send it
+    int64_t recv_window;
+    int64_t send_window;
+    // Body bytes handed over but not yet given back to the client's window
+    size_t credit;
+    bool remote_closed;
+    bool body_dropped;
+    bool reset;
+    bool handler_done;
+} h2_stream;
+
+struct h2_conn {
+    int fd;
+    // A dup of fd for writes, so the reader and a writer can park on it at once
+    int write_fd;
+    coro_rwlock write_lock;
+    // Woken as handlers and bridges finish
+    coro_waitq finished;
+    h2_handler serve;
+    void *ctx;
+    hpack_decoder decoder;
+    h2_stream *streams[STREAMS];
+    int stream_count;
+    // Bridges still running; the connection outlives all of them
+    int live;
+    uint32_t last_stream;
+    int64_t send_window;
+    int64_t recv_window;
+    int64_t peer_window;
+    uint32_t peer_frame;
+    bool dead;
+    // The header block being put together from HEADERS and CONTINUATION frames
+    uint32_t block_stream;
+    bool block_end_stream;
+    size_t block_len;
+    uint8_t block[BLOCK_MAX];
+    char scratch[2 * BLOCK_MAX];
+    uint8_t in[IN_SIZE];
+    size_t in_start;
+    size_t in_end;
+};
+
+// The fields of one request while its header block is decoded
+typedef struct h2_request {
+    char method[FIELD_MAX + 1];
+    char path[FIELD_MAX + 1];
+    char headers[HEAD_MAX];
+    size_t headers_len;
+    bool malformed;
+} h2_request;
+
+// Request headers the handlers understand, with their HTTP/1.1 spelling
+static const struct {
+    const char *h2;
+    const char *h1;
+} forwarded[] = {
+    { "content-length", "Content-Length" },
+    { "request-id", "Request-Id" },
+    { "if-match", "If-Match" },
+    { "if-none-match", "If-None-Match" },
+    { "batch-order", "Batch-Order" },
+    { "x-client-id", "X-Client-Id" },
+};
+
+/***********HELPERS************/
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+static bool send_frame(
+    h2_conn *c, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t len) {
+    if (c->dead) {
+        return false;
+    }
+    uint8_t header[FRAME_HEADER];
+    header[0] = (uint8_t) (len >> 16);
+    header[1] = (uint8_t) (len >> 8);
+    header[2] = (uint8_t) len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, stream);
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = FRAME_HEADER },
+        { .iov_base = (void *) payload, .iov_len = len },
+    };
+    // Frames from different streams must not interleave on the wire
+    coro_rwlock_lock(&(c->write_lock), true);
+    bool sent = response_writev(c->write_fd, iov, (len > 0) ? 2 : 1) != -1;
+    coro_rwlock_unlock(&(c->write_lock), true);
+    if (!sent) {
+        c->dead = true;
+    }
+    return sent;
+}
+
+static void send_rst(h2_conn *c, uint32_t stream, H2_ERROR code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    send_frame(c, FRAME_RST_STREAM, 0, stream, payload, 4);
+}
+
+static void send_window_update(h2_conn *c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    send_frame(c, FRAME_WINDOW_UPDATE, 0, stream, payload, 4);
+}
+
+static void send_goaway(h2_conn *c, H2_ERROR code) {
+    uint8_t payload[8];
+    put32(payload, c->last_stream);
+    put32(payload + 4, code);
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+static h2_stream *find_stream(h2_conn *c, uint32_t id) {
+    for (int i = 0; i < STREAMS; i++) {
+        if (c->streams[i] != NULL && c->streams[i]->id == id) {
+            return c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void wake(h2_stream *s) {
+    uint64_t one = 1;
+    while (write(s->wake_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
+
+static void wake_all(h2_conn *c) {
+    for (int i = 0; i < STREAMS; i++) {
+        if (c->streams[i] != NULL) {
+            wake(c->streams[i]);
+        }
+    }
+}
+
+// Makes sure need bytes are buffered at in_start, reading more as needed
+static bool fill(h2_conn *c, size_t need) {
+    while (c->in_end - c->in_start < need) {
+        if (IN_SIZE - c->in_start < need) {
+            memmove(c->in, c->in + c->in_start, c->in_end - c->in_start);
+            c->in_end -= c->in_start;
+            c->in_start = 0;
+        }
+        ssize_t got = coro_read(c->fd, c->in + c->in_end, IN_SIZE - c->in_end);
+        if (got > 0) {
+            c->in_end += got;
+        } else if (got == 0 || errno != EAGAIN || c->dead || c->live == 0) {
+            // Closed, failed, or idle with nothing in progress
+            return false;
+        }
+    }
+    return true;
+}
+
+static H2_ERROR apply_settings(h2_conn *c, const uint8_t *payload, size_t len) {
+    if (len % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t id = (uint16_t) ((payload[i] << 8) | payload[i + 1]);
+        uint32_t value = get32(payload + i + 2);
+        if (id == SETTING_INITIAL_WINDOW) {
+            if (value > WINDOW_LIMIT) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            // Open streams' windows move by the difference
+            for (int j = 0; j < STREAMS; j++) {
+                if (c->streams[j] != NULL) {
+                    c->streams[j]->send_window += (int64_t) value - c->peer_window;
+                }
+            }
+            c->peer_window = value;
+            wake_all(c);
+        } else if (id == SETTING_MAX_FRAME) {
+            if (value < FRAME_MAX || value > 0xffffff) {
+                return H2_PROTOCOL_ERROR;
+            }
+            c->peer_frame = value;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+// Decodes base64url without padding, as HTTP2-Settings is sent
+static size_t decode_base64url(const char *in, uint8_t *out, size_t max) {
+    static const char alphabet[]
+        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits = 0;
+    int count = 0;
+    size_t len = 0;
+    for (; *in != '\0' && *in != '='; in++) {
+        const char *found = strchr(alphabet, *in);
+        if (found == NULL) {
+            return 0;
+        }
+        bits = (bits << 6) | (uint32_t) (found - alphabet);
+        count += 6;
+        if (count >= 8 && len < max) {
+            count -= 8;
+            out[len++] = (uint8_t) (bits >> count);
+        }
+    }
+    return len;
+}
+
+/***********STREAMS************/
+
+static bool handler_finished(void *arg) {
+    return ((h2_stream *) arg)->handler_done;
+}
+
+static bool streams_finished(void *arg) {
+    return ((h2_conn *) arg)->live == 0;
+}
+
+static void handler_task(void *arg) {
+    h2_stream *s = arg;
+    h2_conn *c = s->conn;
+    // The handler reads the request from its end and closes it when done
+    c->serve(s->handler_fd, c->ctx);
+    s->handler_done = true;
+    coro_wake_all(&(c->finished));
+}
+
+static bool wait_window(h2_stream *s) {
+    h2_conn *c = s->conn;
+    // WINDOW_UPDATE frames arrive through the reader, which pokes wake_fd while this parks
+    while ((c->send_window <= 0 || s->send_window <= 0) && !s->reset && !c->dead) {
+        // A peer that leaves the window shut for 5 seconds loses the stream, like a
+        // silent uploader, and the handler it holds up is let go
+        uint64_t count;
+        if (coro_read(s->wake_fd, &count, sizeof(count)) == -1) {
+            s->reset = true;
+            send_rst(c, s->id, H2_CANCEL);
+        }
+    }
+    return !s->reset && !c->dead;
+}
+
+static void pump_body(h2_stream *s) {
+    h2_conn *c = s->conn;
+    while (!s->reset && !c->dead) {
+        if (s->ring_len > 0) {
+            size_t chunk = RING_SIZE - s->ring_head;
+            chunk = (s->ring_len < chunk) ? s->ring_len : chunk;
+            ssize_t sent = coro_send(s->bridge_fd, s->ring + s->ring_head, chunk, MSG_NOSIGNAL);
+            if (sent == -1) {
+                // The handler has answered without reading the rest; drop it
+                s->body_dropped = true;
+                s->recv_window += s->ring_len;
+                s->credit += s->ring_len;
+                s->ring_len = 0;
+            } else {
+                s->ring_head = (s->ring_head + sent) % RING_SIZE;
+                s->ring_len -= sent;
+                s->recv_window += sent;
+                s->credit += sent;
+            }
+            // Give the window back in quarters rather than per write
+            if (!s->remote_closed && (s->credit >= RING_SIZE / 4 || s->ring_len == 0)) {
+                send_window_update(c, s->id, (uint32_t) s->credit);
+                s->credit = 0;
+            }
+            if (s->body_dropped) {
+                break;
+            }
+            continue;
+        }
+        if (s->remote_closed) {
+            break;
+        }
+        // Park until the reader has more; a client silent for 5 seconds is cut off
+        uint64_t count;
+        if (coro_read(s->wake_fd, &count, sizeof(count)) == -1) {
+            s->reset = true;
+            send_rst(c, s->id, H2_CANCEL);
+        }
+    }
+    shutdown(s->bridge_fd, SHUT_WR);
+}
+
+static void relay_response(h2_stream *s) {
+    h2_conn *c = s->conn;
+    char buffer[RELAY_SIZE];
+    proxy_reply reply;
+    // The handler's HTTP/1.1 answer is read like the proxy reads an origin's
+    if (!proxy_read_reply(s->bridge_fd, buffer, sizeof(buffer), &reply)) {
+        if (!s->reset) {
+            send_rst(c, s->id, H2_INTERNAL_ERROR);
+        }
+        return;
+    }
+    uint8_t block[64 + 2 * RESPONSE_ETAG_MAX];
+    size_t block_len = hpack_encode_status(block, reply.status);
+    if (reply.content_len != -1) {
+        char digits[24];
+        int len = snprintf(digits, sizeof(digits), "%lld", (long long) reply.content_len);
+        block_len += hpack_encode_field(block + block_len, HPACK_CONTENT_LENGTH, digits, len);
+    }
+    if (reply.etag_len > 0) {
+        block_len += hpack_encode_field(block + block_len, HPACK_ETAG, reply.etag, reply.etag_len);
+    }
+    // Only batch responses carry a type
+    static const char batch_type[] = "application/x-batch";
+    if (memmem(buffer, reply.head_len, batch_type, sizeof(batch_type) - 1) != NULL) {
+        block_len += hpack_encode_field(
+            block + block_len, HPACK_CONTENT_TYPE, batch_type, sizeof(batch_type) - 1);
+    }
+    bool done = reply.content_len == 0;
+    if (!send_frame(c, FRAME_HEADERS, FLAG_END_HEADERS | (done ? FLAG_END_STREAM : 0), s->id,
+            block, block_len)) {
+        return;
+    }
+    // Without a length (batches) the body runs until the handler closes its end
+    char *data = buffer + reply.head_len;
+    size_t have = reply.buffered - reply.head_len;
+    ssize_t left = reply.content_len;
+    while (!done) {
+        if (have == 0) {
+            ssize_t got = coro_read(s->bridge_fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                if (got == 0 && left == -1) {
+                    send_frame(c, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+                } else if (!s->reset) {
+                    send_rst(c, s->id, H2_INTERNAL_ERROR);
+                }
+                return;
+            }
+            data = buffer;
+            have = got;
+        }
+        if (left != -1 && (ssize_t) have > left) {
+            have = left;
+        }
+        while (have > 0) {
+            if (!wait_window(s)) {
+                return;
+            }
+            size_t len = have;
+            len = (len > c->peer_frame) ? c->peer_frame : len;
+            len = ((int64_t) len > c->send_window) ? (size_t) c->send_window : len;
+            len = ((int64_t) len > s->send_window) ? (size_t) s->send_window : len;
+            done = left != -1 && (ssize_t) len == left;
+            // Take the credit before sending: send_frame can park, and another stream's bridge
+            // must not size its frame against the same connection window meanwhile
+            c->send_window -= len;
+            s->send_window -= len;
+            if (!send_frame(c, FRAME_DATA, done ? FLAG_END_STREAM : 0, s->id, data, len)) {
+                c->send_window += len;
+                s->send_window += len;
+                return;
+            }
+            left = (left != -1) ? left - (ssize_t) len : -1;
+            data += len;
+            have -= len;
+        }
+    }
+}
+
+static void bridge_task(void *arg) {
+    h2_stream *s = arg;
+    h2_conn *c = s->conn;
+    if (s->ring != NULL) {
+        pump_body(s);
+    }
+    if (!s->reset && !c->dead) {
+        relay_response(s);
+    }
+    // A client still uploading after the answer is told to stop
+    if (!s->reset && !c->dead && !s->remote_closed) {
+        send_rst(c, s->id, H2_NO_ERROR);
+    }
+    // Closing our end makes a handler that is still writing fail and finish
+    close(s->bridge_fd);
+    coro_wait(&(c->finished), handler_finished, s, -1);
+    for (int i = 0; i < STREAMS; i++) {
+        if (c->streams[i] == s) {
+            c->streams[i] = NULL;
+        }
+    }
+    c->stream_count--;
+    close(s->wake_fd);
+    free(s->ring);
+    free(s);
+    c->live--;
+    coro_wake_all(&(c->finished));
+}
+
+static bool start_stream(h2_conn *c, uint32_t id, const char *head, size_t head_len, bool body) {
+    h2_stream *s = counted_calloc(1, sizeof(h2_stream));
+    if (s == NULL) {
+        return false;
+    }
+    s->conn = c;
+    s->id = id;
+    s->recv_window = STREAM_WINDOW;
+    s->send_window = c->peer_window;
+    s->remote_closed = !body;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) == -1) {
+        free(s);
+        return false;
+    }
+    s->bridge_fd = pair[0];
+    s->handler_fd = pair[1];
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (body) {
+        s->ring = counted_malloc(RING_SIZE);
+    }
+    // The head always fits in an empty socket buffer
+    if ((body && s->ring == NULL) || s->wake_fd == -1
+        || send(s->bridge_fd, head, head_len, MSG_NOSIGNAL) != (ssize_t) head_len
+        || (!body && shutdown(s->bridge_fd, SHUT_WR) == -1)) {
+        close(pair[0]);
+        close(pair[1]);
+        if (s->wake_fd != -1) {
+            close(s->wake_fd);
+        }
+        free(s->ring);
+        free(s);
+        return false;
+    }
+    for (int i = 0; i < STREAMS; i++) {
+        if (c->streams[i] == NULL) {
+            c->streams[i] = s;
+            break;
+        }
+    }
+    c->stream_count++;
+    c->live++;
+    // Once spawned the bridge owns the stream; a failed handler spawn looks finished
+    if (!coro_spawn(handler_task, s)) {
+        close(s->handler_fd);
+        s->handler_done = true;
+        s->reset = true;
+    }
+    if (!coro_spawn(bridge_task, s)) {
+        // Without a bridge nobody would free it, so run its cleanup here
+        s->reset = true;
+        bridge_task(s);
+        return false;
+    }
+    return true;
+}
+
+/***********HEADER BLOCKS************/
+
+static void copy_field(char *to, const char *value, size_t len, bool *malformed) {
+    // Values longer than the limit are cut one past what the parser accepts
+    len = (len > FIELD_MAX) ? FIELD_MAX : len;
+    for (size_t i = 0; i < len; i++) {
+        // Control characters could end the rebuilt request line early
+        if ((unsigned char) value[i] < 0x20 || value[i] == 0x7f) {
+            *malformed = true;
+        }
+    }
+    memcpy(to, value, len);
+    to[len] = '\0';
+}
+
+static void collect_field(
+    void *ctx, const char *name, size_t name_len, const char *value, size_t value_len) {
+    h2_request *req = ctx;
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        copy_field(req->method, value, value_len, &(req->malformed));
+        return;
+    }
+    if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        copy_field(req->path, value, value_len, &(req->malformed));
+        return;
+    }
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        if (strlen(forwarded[i].h2) == name_len && memcmp(forwarded[i].h2, name, name_len) == 0) {
+            char field[FIELD_MAX + 1];
+            copy_field(field, value, value_len, &(req->malformed));
+            int len = snprintf(req->headers + req->headers_len,
+                sizeof(req->headers) - req->headers_len, "%s: %s\r\n", forwarded[i].h1, field);
+            if (len > 0 && (size_t) len < sizeof(req->headers) - req->headers_len) {
+                req->headers_len += len;
+            }
+            return;
+        }
+    }
+}
+
+static H2_ERROR finish_block(h2_conn *c) {
+    uint32_t id = c->block_stream;
+    c->block_stream = 0;
+    h2_request req;
+    req.method[0] = '\0';
+    req.path[0] = '\0';
+    req.headers_len = 0;
+    req.malformed = false;
+    // Every block is decoded, even for streams that are refused, to keep the table in step
+    if (!hpack_decode(&(c->decoder), c->block, c->block_len, c->scratch, sizeof(c->scratch),
+            collect_field, &req)) {
+        return H2_COMPRESSION_ERROR;
+    }
+    h2_stream *s = find_stream(c, id);
+    if (s != NULL) {
+        // Trailers; only their END_STREAM matters
+        if (c->block_end_stream) {
+            s->remote_closed = true;
+            wake(s);
+        }
+        return H2_NO_ERROR;
+    }
+    if (id <= c->last_stream) {
+        return H2_PROTOCOL_ERROR;
+    }
+    c->last_stream = id;
+    if (req.method[0] == '\0' || req.path[0] == '\0' || req.malformed) {
+        send_rst(c, id, H2_PROTOCOL_ERROR);
+        return H2_NO_ERROR;
+    }
+    char head[HEAD_MAX + 2 * FIELD_MAX + 16];
+    int head_len = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\n%.*s\r\n", req.method,
+        req.path, (int) req.headers_len, req.headers);
+    if (c->stream_count >= STREAMS
+        || !start_stream(c, id, head, head_len, !c->block_end_stream)) {
+        send_rst(c, id, H2_REFUSED_STREAM);
+    }
+    return H2_NO_ERROR;
+}
+
+/***********FRAMES************/
+
+static H2_ERROR on_data(h2_conn *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (id == 0) {
+        return H2_PROTOCOL_ERROR;
+    }
+    // The whole frame counts against the connection window, padding included
+    c->recv_window -= len;
+    if (c->recv_window < 0) {
+        return H2_FLOW_CONTROL_ERROR;
+    }
+    if (c->recv_window < CONN_WINDOW / 2) {
+        send_window_update(c, 0, (uint32_t) (CONN_WINDOW - c->recv_window));
+        c->recv_window = CONN_WINDOW;
+    }
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        pad = (len > 0) ? p[0] + 1 : 1;
+        if (pad > len) {
+            return H2_PROTOCOL_ERROR;
+        }
+    }
+    h2_stream *s = find_stream(c, id);
+    if (s == NULL) {
+        // Frames still in flight for a finished stream are dropped
+        return (id > c->last_stream) ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+    }
+    if (s->remote_closed) {
+        send_rst(c, id, H2_STREAM_CLOSED);
+        s->reset = true;
+        wake(s);
+        return H2_NO_ERROR;
+    }
+    if ((int64_t) len > s->recv_window) {
+        send_rst(c, id, H2_FLOW_CONTROL_ERROR);
+        s->reset = true;
+        wake(s);
+        return H2_NO_ERROR;
+    }
+    size_t data_len = len - pad;
+    const uint8_t *data = p + ((flags & FLAG_PADDED) ? 1 : 0);
+    s->remote_closed = (flags & FLAG_END_STREAM) != 0;
+    if (s->body_dropped) {
+        // Nobody reads it any more, so give the window straight back
+        if (!s->remote_closed && len > 0) {
+            send_window_update(c, id, (uint32_t) len);
+        }
+    } else {
+        // The window keeps the ring from overflowing; padding is given back at once
+        s->recv_window -= data_len;
+        for (size_t copied = 0; copied < data_len;) {
+            size_t tail = (s->ring_head + s->ring_len) % RING_SIZE;
+            size_t chunk = RING_SIZE - tail;
+            chunk = (data_len - copied < chunk) ? data_len - copied : chunk;
+            memcpy(s->ring + tail, data + copied, chunk);
+            s->ring_len += chunk;
+            copied += chunk;
+        }
+        if (pad > 0 && !s->remote_closed) {
+            send_window_update(c, id, (uint32_t) pad);
+        }
+    }
+    wake(s);
+    return H2_NO_ERROR;
+}
+
+static H2_ERROR on_headers(h2_conn *c, uint8_t type, uint8_t flags, uint32_t id,
+    const uint8_t *p, size_t len) {
+    if (type == FRAME_HEADERS) {
+        if (id == 0 || id % 2 == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        // Strip the padding and the priority fields around the fragment
+        size_t pad = 0;
+        if (flags & FLAG_PADDED) {
+            if (len < 1 || (size_t) p[0] + 1 > len) {
+                return H2_PROTOCOL_ERROR;
+            }
+            pad = p[0];
+            p++;
+            len -= 1 + pad;
+        }
+        if (flags & FLAG_PRIORITY) {
+            if (len < 5) {
+                return H2_PROTOCOL_ERROR;
+            }
+            p += 5;
+            len -= 5;
+        }
+        c->block_stream = id;
+        c->block_end_stream = (flags & FLAG_END_STREAM) != 0;
+        c->block_len = 0;
+    } else if (id != c->block_stream) {
+        return H2_PROTOCOL_ERROR;
+    }
+    if (c->block_len + len > BLOCK_MAX) {
+        return H2_ENHANCE_YOUR_CALM;
+    }
+    memcpy(c->block + c->block_len, p, len);
+    c->block_len += len;
+    return (flags & FLAG_END_HEADERS) ? finish_block(c) : H2_NO_ERROR;
+}
+
+static H2_ERROR on_window_update(h2_conn *c, uint32_t id, const uint8_t *p, size_t len) {
+    if (len != 4) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    uint32_t increment = get32(p) & WINDOW_LIMIT;
+    if (id == 0) {
+        c->send_window += increment;
+        wake_all(c);
+        return (increment == 0 || c->send_window > WINDOW_LIMIT) ? H2_FLOW_CONTROL_ERROR
+                                                                   : H2_NO_ERROR;
+    }
+    h2_stream *s = find_stream(c, id);
+    if (s != NULL) {
+        s->send_window += increment;
+        if (increment == 0 || s->send_window > WINDOW_LIMIT) {
+            send_rst(c, id, H2_FLOW_CONTROL_ERROR);
+            s->reset = true;
+        }
+        wake(s);
+    }
+    return H2_NO_ERROR;
+}
+
+static H2_ERROR on_frame(
+    h2_conn *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    // Nothing may come between a HEADERS frame and the end of its block
+    if (c->block_stream != 0 && type != FRAME_CONTINUATION) {
+        return H2_PROTOCOL_ERROR;
+    }
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(c, flags, id, p, len);
+    case FRAME_HEADERS:
+    case FRAME_CONTINUATION:
+        return on_headers(c, type, flags, id, p, len);
+    case FRAME_RST_STREAM: {
+        h2_stream *s = (len == 4) ? find_stream(c, id) : NULL;
+        if (s != NULL) {
+            s->reset = true;
+            wake(s);
+        }
+        return (len == 4) ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    case FRAME_SETTINGS: {
+        if (id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (flags & FLAG_ACK) {
+            return H2_NO_ERROR;
+        }
+        H2_ERROR error = apply_settings(c, p, len);
+        if (error == H2_NO_ERROR) {
+            send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        }
+        return error;
+    }
+    case FRAME_PING:
+        if (id != 0 || len != 8) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (!(flags & FLAG_ACK)) {
+            send_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+        }
+        return H2_NO_ERROR;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(c, id, p, len);
+    case FRAME_PUSH_PROMISE:
+        return H2_PROTOCOL_ERROR;
+    default:
+        // PRIORITY, GOAWAY (streams already open still finish) and unknown types
+        return H2_NO_ERROR;
+    }
+}
+
+/***********CONNECTIONS************/
+
+bool h2_preface(const char *buf, size_t len) {
+    size_t head = sizeof(H2_PREFACE_HEAD) - 1;
+    return len >= head && memcmp(buf, H2_PREFACE_HEAD, head) == 0;
+}
+
+void h2_serve(int socket_fd, const char *pending, size_t pending_len, const char *upgraded,
+    const char *settings, h2_handler serve, void *ctx) {
+    h2_conn *c = counted_calloc(1, sizeof(h2_conn));
+    if (c == NULL) {
+        return;
+    }
+    c->fd = socket_fd;
+    c->write_fd = fcntl(socket_fd, F_DUPFD_CLOEXEC, 0);
+    if (c->write_fd == -1 || pending_len > IN_SIZE) {
+        close(c->write_fd);
+        free(c);
+        return;
+    }
+    coro_rwlock_init(&(c->write_lock));
+    coro_waitq_init(&(c->finished));
+    c->serve = serve;
+    c->ctx = ctx;
+    hpack_decoder_init(&(c->decoder));
+    c->send_window = STREAM_WINDOW;
+    c->recv_window = CONN_WINDOW;
+    c->peer_window = STREAM_WINDOW;
+    c->peer_frame = FRAME_MAX;
+    memcpy(c->in, pending, pending_len);
+    c->in_end = pending_len;
+    // Our preface: the stream limit, then a connection window far larger than the default
+    uint8_t ours[6] = { 0, SETTING_MAX_STREAMS };
+    put32(ours + 2, STREAMS);
+    send_frame(c, FRAME_SETTINGS, 0, 0, ours, sizeof(ours));
+    send_window_update(c, 0, CONN_WINDOW - STREAM_WINDOW);
+    H2_ERROR error = H2_NO_ERROR;
+    if (upgraded != NULL) {
+        // The upgraded request is stream 1, already complete, with the settings it carried
+        uint8_t payload[128];
+        size_t len = (settings != NULL) ? decode_base64url(settings, payload, sizeof(payload)) : 0;
+        error = apply_settings(c, payload, len - len % 6);
+        c->last_stream = 1;
+        if (error == H2_NO_ERROR && !start_stream(c, 1, upgraded, strlen(upgraded), false)) {
+            error = H2_INTERNAL_ERROR;
+        }
+    }
+    // After an upgrade the whole preface is still to come
+    const char *rest = (upgraded != NULL) ? PREFACE : PREFACE_REST;
+    size_t rest_len = strlen(rest);
+    if (error != H2_NO_ERROR || !fill(c, rest_len)
+        || memcmp(c->in + c->in_start, rest, rest_len) != 0) {
+        error = (error != H2_NO_ERROR) ? error : H2_PROTOCOL_ERROR;
+    } else {
+        c->in_start += rest_len;
+    }
+    while (error == H2_NO_ERROR && !c->dead && fill(c, FRAME_HEADER)) {
+        const uint8_t *h = c->in + c->in_start;
+        size_t len = ((size_t) h[0] << 16) | ((size_t) h[1] << 8) | h[2];
+        if (len > FRAME_MAX) {
+            error = H2_FRAME_SIZE_ERROR;
+            break;
+        }
+        if (!fill(c, FRAME_HEADER + len)) {
+            break;
+        }
+        h = c->in + c->in_start;
+        error = on_frame(c, h[3], h[4], get32(h + 5) & WINDOW_LIMIT, h + FRAME_HEADER, len);
+        c->in_start += FRAME_HEADER + len;
+    }
+    if (error != H2_NO_ERROR) {
+        send_goaway(c, error);
+    }
+    // Stop every stream and wait for their coroutines before freeing what they share
+    c->dead = true;
+    wake_all(c);
+    coro_wait(&(c->finished), streams_finished, c, -1);
+    hpack_decoder_free(&(c->decoder));
+    close(c->write_fd);
+    free(c);
+}
+
+void h2_refuse(int socket_fd) {
+    // A SETTINGS frame first, as the server preface requires, then the GOAWAY
+    static const uint8_t frames[] = { 0, 0, 0, FRAME_SETTINGS, 0, 0, 0, 0, 0, 0, 0, 8,
+        FRAME_GOAWAY, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, H2_HTTP_1_1_REQUIRED };
+    while (send(socket_fd, frames, sizeof(frames), MSG_NOSIGNAL) == -1 && errno == EINTR) {
+    }
+}
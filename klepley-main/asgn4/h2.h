@@ -0,0 +1,52 @@
+/**
+ * @File h2.h
+ *
+ * Cleartext HTTP/2 (h2c), reached with prior knowledge or an Upgrade from
+ * HTTP/1.1. One connection carries many streams. Each stream's request is
+ * turned back into an HTTP/1.1 request and served by the usual handler in
+ * a coroutine of its own, over one end of a socketpair. A second coroutine
+ * per stream feeds it the request body and turns its HTTP/1.1 response into
+ * HEADERS and DATA frames, within the client's flow control windows. The
+ * handlers therefore take the same per-target locks and write the same
+ * audit log lines as on HTTP/1.1. Needs coroutine mode.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** The first line of the client connection preface, which reads like a
+ *  request head of its own. */
+#define H2_PREFACE_HEAD "PRI * HTTP/2.0\r\n\r\n"
+
+/** @brief Serves one request: reads an HTTP/1.1 request from fd, answers
+ *         it and closes fd. The same signature as a coroutine handler.
+ */
+typedef void (*h2_handler)(int fd, void *ctx);
+
+/** @brief Whether the request head read into buf is the start of the
+ *         connection preface.
+ */
+bool h2_preface(const char *buf, size_t len);
+
+/** @brief Serves an HTTP/2 connection until the client leaves, it stays
+ *         idle for 5 seconds, or an error ends it. Must run inside a
+ *         coroutine. Does not close socket_fd.
+ *
+ *  @param pending Bytes already read past the request head: past the
+ *         preface's first line with prior knowledge, or past the head of
+ *         the upgraded request.
+ *
+ *  @param upgraded For an Upgrade, the HTTP/1.1 head of the request that
+ *         asked for it, which becomes stream 1; NULL with prior knowledge.
+ *
+ *  @param settings The HTTP2-Settings value sent with the Upgrade, or NULL.
+ */
+void h2_serve(int socket_fd, const char *pending, size_t pending_len, const char *upgraded,
+    const char *settings, h2_handler serve, void *ctx);
+
+/** @brief Answers a connection preface with a GOAWAY asking for HTTP/1.1,
+ *         for when HTTP/2 is not available.
+ */
+void h2_refuse(int socket_fd);
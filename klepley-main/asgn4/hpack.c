@@ -0,0 +1,381 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "hpack.h"
+
+#define STATIC_ENTRIES 61
+#define EOS            256
+
+/***********TABLES************/
+// RFC 7541 Appendix A
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Code lengths of RFC 7541 Appendix B, symbol 256 being EOS. The code is
+// canonical, so the codes themselves follow from the lengths.
+static const uint8_t huffman_lengths[EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Canonical decoding: the first code of each length, how many codes have
+// that length, and where their symbols start in symbol order
+static uint32_t first_code[31];
+static uint16_t code_count[31];
+static uint16_t code_offset[31];
+static uint16_t symbols[EOS + 1];
+static pthread_once_t tables_built = PTHREAD_ONCE_INIT;
+
+/***********HELPERS************/
+
+static void build_tables(void) {
+    for (int s = 0; s <= EOS; s++) {
+        code_count[huffman_lengths[s]]++;
+    }
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for (int len = 1; len <= 30; len++) {
+        first_code[len] = code;
+        code_offset[len] = offset;
+        code = (code + code_count[len]) << 1;
+        offset += code_count[len];
+    }
+    // Symbols sorted by length, then by value, as the canonical code assigns them
+    uint16_t filled[31] = { 0 };
+    for (int s = 0; s <= EOS; s++) {
+        int len = huffman_lengths[s];
+        symbols[code_offset[len] + filled[len]++] = (uint16_t) s;
+    }
+}
+
+static bool huffman_decode(const uint8_t *in, size_t len, char *out, size_t *out_len) {
+    uint32_t code = 0;
+    int bits = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            bits++;
+            // Unsigned wrap makes codes below the first one fail the check too
+            uint32_t index = code - first_code[bits];
+            if (index < code_count[bits]) {
+                uint16_t symbol = symbols[code_offset[bits] + index];
+                if (symbol == EOS) {
+                    return false;
+                }
+                out[count++] = (char) symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == 30) {
+                return false;
+            }
+        }
+    }
+    // Padding is the start of EOS: fewer than 8 bits, all ones
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return false;
+    }
+    *out_len = count;
+    return true;
+}
+
+static bool decode_int(const uint8_t **pos, const uint8_t *end, int prefix, size_t *value) {
+    if (*pos >= end) {
+        return false;
+    }
+    size_t mask = (1u << prefix) - 1;
+    *value = **pos & mask;
+    (*pos)++;
+    if (*value < mask) {
+        return true;
+    }
+    // Continuation bytes, 7 bits at a time, least significant first
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= end) {
+            return false;
+        }
+        uint8_t byte = *((*pos)++);
+        *value += (size_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t **pos, const uint8_t *end, char **scratch,
+    const char *scratch_end, const char **str, size_t *str_len) {
+    if (*pos >= end) {
+        return false;
+    }
+    bool huffman = (**pos & 0x80) != 0;
+    size_t len;
+    if (!decode_int(pos, end, 7, &len) || len > (size_t) (end - *pos)) {
+        return false;
+    }
+    if (!huffman) {
+        // Plain strings are used straight from the block
+        *str = (const char *) *pos;
+        *str_len = len;
+    } else {
+        // The shortest code is 5 bits, which bounds the decoded length
+        if (len * 8 / 5 > (size_t) (scratch_end - *scratch)
+            || !huffman_decode(*pos, len, *scratch, str_len)) {
+            return false;
+        }
+        *str = *scratch;
+        *scratch += *str_len;
+    }
+    *pos += len;
+    return true;
+}
+
+static hpack_entry *dynamic_entry(hpack_decoder *decoder, size_t index) {
+    // Index 0 of the dynamic part is the newest entry
+    int slot = (decoder->newest - (int) index + HPACK_ENTRIES) % HPACK_ENTRIES;
+    return &(decoder->entries[slot]);
+}
+
+static void evict_to(hpack_decoder *decoder, size_t limit) {
+    while (decoder->size > limit && decoder->count > 0) {
+        hpack_entry *oldest = dynamic_entry(decoder, decoder->count - 1);
+        decoder->size -= oldest->name_len + oldest->value_len + 32;
+        free(oldest->bytes);
+        oldest->bytes = NULL;
+        decoder->count--;
+    }
+}
+
+static bool lookup(hpack_decoder *decoder, size_t index, const char **name, size_t *name_len,
+    const char **value, size_t *value_len) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    if (index - STATIC_ENTRIES - 1 >= (size_t) decoder->count) {
+        return false;
+    }
+    hpack_entry *entry = dynamic_entry(decoder, index - STATIC_ENTRIES - 1);
+    *name = entry->bytes;
+    *name_len = entry->name_len;
+    *value = entry->bytes + entry->name_len;
+    *value_len = entry->value_len;
+    return true;
+}
+
+static bool insert(hpack_decoder *decoder, const char *name, size_t name_len, const char *value,
+    size_t value_len) {
+    size_t entry_size = name_len + value_len + 32;
+    // An entry larger than the table empties it and is not added
+    if (entry_size > decoder->max_size) {
+        evict_to(decoder, 0);
+        return true;
+    }
+    // Copy first: the name may belong to an entry the eviction below removes
+    char *bytes = counted_malloc(name_len + value_len + 1);
+    if (bytes == NULL) {
+        return false;
+    }
+    memcpy(bytes, name, name_len);
+    memcpy(bytes + name_len, value, value_len);
+    evict_to(decoder, decoder->max_size - entry_size);
+    decoder->newest = (decoder->newest + 1) % HPACK_ENTRIES;
+    hpack_entry *entry = &(decoder->entries[decoder->newest]);
+    entry->bytes = bytes;
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    decoder->count++;
+    decoder->size += entry_size;
+    return true;
+}
+
+static size_t encode_int(uint8_t *buf, uint8_t first, int prefix, size_t value) {
+    size_t mask = (1u << prefix) - 1;
+    if (value < mask) {
+        buf[0] = first | (uint8_t) value;
+        return 1;
+    }
+    buf[0] = first | (uint8_t) mask;
+    size_t len = 1;
+    value -= mask;
+    while (value >= 0x80) {
+        buf[len++] = (uint8_t) (0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    buf[len++] = (uint8_t) value;
+    return len;
+}
+
+/***********DECODER************/
+
+void hpack_decoder_init(hpack_decoder *decoder) {
+    pthread_once(&tables_built, build_tables);
+    memset(decoder, 0, sizeof(hpack_decoder));
+    decoder->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_decoder_free(hpack_decoder *decoder) {
+    evict_to(decoder, 0);
+}
+
+bool hpack_decode(hpack_decoder *decoder, const uint8_t *block, size_t len, char *scratch,
+    size_t scratch_len, hpack_field field, void *ctx) {
+    const uint8_t *pos = block;
+    const uint8_t *end = block + len;
+    const char *scratch_end = scratch + scratch_len;
+    while (pos < end) {
+        // Decoded strings only need to last until the field is handed over
+        char *free_scratch = scratch;
+        const char *name, *value;
+        size_t name_len, value_len, index;
+        uint8_t first = *pos;
+        if (first & 0x80) {
+            // Indexed field
+            if (!decode_int(&pos, end, 7, &index)
+                || !lookup(decoder, index, &name, &name_len, &value, &value_len)) {
+                return false;
+            }
+            field(ctx, name, name_len, value, value_len);
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            // Table size update, never above what the server allows
+            if (!decode_int(&pos, end, 5, &index) || index > HPACK_TABLE_SIZE) {
+                return false;
+            }
+            decoder->max_size = index;
+            evict_to(decoder, index);
+            continue;
+        }
+        // Literal: with incremental indexing, without indexing, or never indexed
+        bool indexing = (first & 0xc0) == 0x40;
+        if (!decode_int(&pos, end, indexing ? 6 : 4, &index)) {
+            return false;
+        }
+        if (index == 0) {
+            if (!decode_string(&pos, end, &free_scratch, scratch_end, &name, &name_len)) {
+                return false;
+            }
+        } else if (!lookup(decoder, index, &name, &name_len, &value, &value_len)) {
+            return false;
+        }
+        if (!decode_string(&pos, end, &free_scratch, scratch_end, &value, &value_len)) {
+            return false;
+        }
+        field(ctx, name, name_len, value, value_len);
+        if (indexing && !insert(decoder, name, name_len, value, value_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/***********ENCODER************/
+
+size_t hpack_encode_status(uint8_t *buf, int status) {
+    // The statuses the static table has are sent as a single index byte
+    static const int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    for (int i = 0; i < 7; i++) {
+        if (indexed[i] == status) {
+            return encode_int(buf, 0x80, 7, HPACK_STATUS + i);
+        }
+    }
+    char digits[3] = { (char) ('0' + status / 100 % 10), (char) ('0' + status / 10 % 10),
+        (char) ('0' + status % 10) };
+    return hpack_encode_field(buf, HPACK_STATUS, digits, 3);
+}
+
+size_t hpack_encode_field(uint8_t *buf, int name_index, const char *value, size_t value_len) {
+    // Literal without indexing, indexed name, plain (not Huffman) value
+    size_t len = encode_int(buf, 0x00, 4, name_index);
+    len += encode_int(buf + len, 0x00, 7, value_len);
+    memcpy(buf + len, value, value_len);
+    return len + value_len;
+}
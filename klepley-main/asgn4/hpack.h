@@ -0,0 +1,93 @@
+/**
+ * @File hpack.h
+ *
+ * HPACK header compression (RFC 7541) for the HTTP/2 mode. The decoder
+ * keeps the dynamic table the client's encoder builds and decodes
+ * Huffman-coded strings. The encoder only emits literals without
+ * indexing, so responses never add to the client's table.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The dynamic table size the server allows, the protocol default. */
+#define HPACK_TABLE_SIZE 4096
+
+/** Every entry costs at least 32 bytes, which bounds how many fit. */
+#define HPACK_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/** Static table indexes of the response header names the server sends. */
+#define HPACK_STATUS         8
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE   31
+#define HPACK_ETAG           34
+
+/** The most bytes one field can add to an encoded block. */
+#define HPACK_FIELD_MAX(value_len) (6 + (value_len))
+
+/** @struct hpack_entry
+ *  @brief A dynamic table entry: the name followed by the value in one
+ *         allocation.
+ */
+typedef struct hpack_entry {
+    char *bytes;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry;
+
+/** @struct hpack_decoder
+ *  @brief One connection's decoding state. The dynamic table is a ring of
+ *         entries, newest first in index order.
+ */
+typedef struct hpack_decoder {
+    hpack_entry entries[HPACK_ENTRIES];
+    // Ring slot of the newest entry, and how many entries there are
+    int newest;
+    int count;
+    // Current size by the protocol's accounting, and the limit the encoder set
+    size_t size;
+    size_t max_size;
+} hpack_decoder;
+
+/** @brief The callback hpack_decode makes for every header. Names and
+ *         values are not null-terminated and are only valid during the
+ *         call.
+ */
+typedef void (*hpack_field)(
+    void *ctx, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/** @brief Initializes an empty decoder.
+ */
+void hpack_decoder_init(hpack_decoder *decoder);
+
+/** @brief Frees the decoder's dynamic table.
+ */
+void hpack_decoder_free(hpack_decoder *decoder);
+
+/** @brief Decodes one complete header block.
+ *
+ *  @param scratch Space for decoded strings; 2 * len bytes always suffice.
+ *
+ *  @return false on a compression error, after which the decoder's state
+ *          is no longer in step with the client and the connection must end.
+ */
+bool hpack_decode(hpack_decoder *decoder, const uint8_t *block, size_t len, char *scratch,
+    size_t scratch_len, hpack_field field, void *ctx);
+
+/** @brief Encodes :status, fully indexed when the static table has it.
+ *
+ *  @return The number of bytes written to buf (at most 5).
+ */
+size_t hpack_encode_status(uint8_t *buf, int status);
+
+/** @brief Encodes a literal field without indexing whose name is the
+ *         static table entry name_index. The value is sent as is.
+ *
+ *  @param buf At least HPACK_FIELD_MAX(value_len) bytes.
+ *
+ *  @return The number of bytes written to buf.
+ */
+size_t hpack_encode_field(uint8_t *buf, int name_index, const char *value, size_t value_len);
@@ -1,18 +1,37 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
-#include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "asgn2_helper_funcs.h"
+#include "cache.h"
+#include "client.h"
+#include "coro.h"
+#include "dispatch.h"
+#include "h2.h"
+#include "lane.h"
+#include "lockstats.h"
+#include "proxy.h"
+#include "response.h"
+#include "scan.h"
+#include "trace.h"
+#include "upgrade.h"
 #include "queue.h"
 #include "rwlock.h"
 
@@ -20,13 +39,29 @@
 #ifndef O_DIRECTORY
 #define O_DIRECTORY 0
 #endif
-#define REQUEST_REGEX "^([a-zA-Z]{1,8}) /([a-zA-Z0-9.-]{1,63}) (HTTP/[0-9]\\.[0-9])\r\n"
-#define HEADER_REGEX  "([a-zA-Z0-9.-]{1,128}): ([ -~]{1,128})\r\n"
 #define BUFFER_SIZE   4096
-#define PATH_MAX      4069
+#define TARGET_MAX    63
+#define NODE_CHUNK    64
+#define MMAP_MAX      65536
+#define CACHE_ENTRIES 512
+#define ACCEPT_BATCH  64
+#define ACCEPT_POLL   500
+#define LOCK_TOP      10
+#define BATCH_BODY    65536
+#define BATCH_ITEMS   1024
+#define LARGE_PUT     (8 << 20)
+#define DIRECT_ALIGN  4096
+#define DIRECT_CHUNK  (1 << 20)
+#define DROP_WINDOW   (8 << 20)
+#define GET_MISS      2
+#define BULK_SIZE     (1 << 20)
+#define FAIR_FLOWS    64
+#define FAIR_QUANTUM  65536
+#define TEMP_DIR      ".httpserver-tmp"
+#define TEMP_MAX      (sizeof(TEMP_DIR) + TARGET_MAX + 32)
 
 /*****************STRUCT DEFS************/
-queue_t *request_queue;
+dispatch_t *request_queue;
 pthread_mutex_t log_mutex;
 rwlock_t *rw_lock;
 typedef struct list list_t;
@@ -37,22 +72,66 @@ typedef struct thread_container {
     list_t *list;
 } thread_container;
 
+// How bodies of at least large_put bytes are streamed to disk
+typedef enum { LARGE_CACHED, LARGE_DONTNEED, LARGE_DIRECT } LARGE_MODE;
+
 typedef struct user_req {
     char *target;
     char *http_version;
     char *body;
-    int content_len;
+    ssize_t content_len;
     int id;
     char *command;
     int socket_fd;
     int remaining_len;
+    struct list_node *node;
+    trace_req *trace;
+    // Set by "Batch-Order: completion" on an MGET
+    bool completion_order;
+    // PUT preconditions, NULL when the header is absent
+    char *if_match;
+    char *if_none_match;
+    // Upgrade and HTTP2-Settings, for switching to HTTP/2
+    char *upgrade;
+    char *h2_settings;
+    // Who is asking, for rate limits and fair dispatch, and the bytes they are charged
+    char *client_id;
+    client_t *client;
+    unsigned flow_key;
+    size_t moved;
+#ifdef LOCK_STATS
+    uint64_t lock_held_at;
+#endif
 } user_req;
 
+// An MGET's body and item list; these come from a slab and go back after every batch
+typedef struct batch_scratch {
+    char body[BATCH_BODY + 1];
+    char *names[BATCH_ITEMS];
+    bool deferred[BATCH_ITEMS];
+} batch_scratch;
+
+// A bulk request parked until a slot frees up, with everything needed to finish it later
+typedef struct parked_conn {
+    lane_job job;
+    user_req req;
+    trace_req trace;
+    arena_t *arena;
+} parked_conn;
+
 typedef struct list_node {
     struct list_node *first;
     struct list_node *last;
     rwlock_t *lock;
-    char path[PATH_MAX];
+    // Used instead of lock when requests run as coroutines
+    coro_rwlock task_lock;
+    // Writers waiting for or holding the lock, so batches can skip busy targets
+    atomic_int writers;
+    cache_slot cache;
+#ifdef LOCK_STATS
+    lock_stats stats;
+#endif
+    char path[TARGET_MAX + 1];
 } list_node;
 
 typedef struct linked_list {
@@ -60,11 +139,13 @@ typedef struct linked_list {
     list_node *tail;
     int size;
     pthread_mutex_t mutex;
+    slab_t nodes;
 } linked_list;
 
 /*******LIST FUNCTION DEFS******************/
 linked_list *create_list();
 list_node *find_in_list(linked_list *list, char *path);
+list_node *lock_and_find_in_list(linked_list *list, char *path);
 
 bool push_to_list(linked_list *list, char *path);
 bool lock_and_push_to_list(linked_list *list, char *path);
@@ -72,40 +153,178 @@ bool lock_and_access_list(linked_list *list, char *path, bool write);
 bool unlock_access_list(linked_list *list, char *path, bool write);
 
 void delete_list(linked_list **list);
+ssize_t receive_body(int socket_fd, int file_fd, ssize_t n, off_t drop_from);
+void release_direct(char *buffer);
+ssize_t receive_direct(user_req *req, int file_fd);
+ssize_t receive_put_body(user_req *req, int file_fd);
+#ifdef LOCK_STATS
+void print_lock_stats(FILE *out, linked_list *list);
+#endif
 
 /*******MISC DEFS******************/
 int server_port = 0;
 int thread_count = 4;
+size_t mmap_threshold = MMAP_MAX;
+int cache_entries = CACHE_ENTRIES;
+int trace_sample = 0;
+char *upgrade_path = NULL;
+char **server_argv = NULL;
+atomic_bool handed_off = false;
 volatile atomic_int server_shutdown = 0;
+atomic_long requests_served = 0;
+atomic_int workers_started = 0;
+bool coroutine_mode = false;
+bool snapshot_puts = false;
+bool log_times = false;
+ssize_t large_put = LARGE_PUT;
+LARGE_MODE large_mode = LARGE_CACHED;
+mode_t temp_mode = 0666;
+int bulk_slots = 0;
+size_t bulk_size = BULK_SIZE;
+bool fair_dispatch = false;
+double client_requests = 0;
+double client_bytes = 0;
+slab_t batch_slab;
+pthread_mutex_t batch_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef LOCK_STATS
+linked_list *lock_table = NULL;
+#endif
 void parse_arguments(int count, char **values);
-int parse_request(user_req *req, char *buffer, ssize_t buffer_len);
+bool is_token_char(char c);
+bool parse_head_line(user_req *req, char *buffer, size_t end);
+int parse_request(user_req *req, char *buffer, ssize_t buffer_len, header_scanner *scanner);
 int handle_request(user_req *req, linked_list *list);
+void lock_target(linked_list *list, user_req *req, bool write);
+void unlock_target(linked_list *list, user_req *req, bool write);
 void handle_signal(int signo);
 void log_entry(const char *operation, const char *path, int status, int id);
+void serve_connection(int client_socket, void *list_ptr);
+void finish_connection(user_req *req, arena_t *arena, linked_list *list, bool parsed);
+bool is_bulk(user_req *req);
+bool admit_client(user_req *req);
+void serve_bulk(user_req *req, arena_t *arena, linked_list *list);
 void *thread_worker();
+void *coro_worker(void *sched);
 void configure_signals();
-int process_get(user_req *req);
+void invalidate_target(void *list_ptr, const char *name);
+void print_stats(FILE *out);
+void *stats_worker(void *signals);
+void *upgrade_worker(void *fds);
+int process_get(user_req *req, bool may_fill);
+int process_fill(user_req *req);
 int process_put(user_req *req);
+int process_put_forward(user_req *req);
+int process_put_snapshot(user_req *req, linked_list *list);
+int process_mget(user_req *req, linked_list *list);
+bool process_upgrade(user_req *req, linked_list *list);
+bool serve_batch_item(user_req *req, linked_list *list, char *name);
+bool target_busy(linked_list *list, char *name);
+int check_preconditions(user_req *req);
+size_t stamp_written(int file_fd, char *etag);
+void sweep_temps(void);
+int open_temp(const char *target, char *path);
+int check_preconditions(user_req *req) {
+    if (req->if_match == NULL && req->if_none_match == NULL) {
+        return 0;
+    }
+    // Compare against the tag of whatever is at the target right now
+    struct stat st;
+    bool exists = stat(req->target, &st) == 0;
+    char etag[RESPONSE_ETAG_MAX];
+    size_t etag_len = exists ? response_etag(etag, &st) : 0;
+    // If-Match needs the file to exist with one of the listed tags
+    if (req->if_match != NULL
+        && (!exists || !response_etag_listed(req->if_match, etag, etag_len))) {
+        return 412;
+    }
+    // If-None-Match fails if it does; "*" matches any existing file
+    if (req->if_none_match != NULL && exists
+        && response_etag_listed(req->if_none_match, etag, etag_len)) {
+        return 412;
+    }
+    return 0;
+}
+
+size_t stamp_written(int file_fd, char *etag) {
+    // Timer-tick mtimes can repeat between two quick writes of the same size,
+    // so stamp the file with the nanosecond clock before taking its tag
+    struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+    clock_gettime(CLOCK_REALTIME, &times[1]);
+    futimens(file_fd, times);
+    struct stat st;
+    if (fstat(file_fd, &st) == -1) {
+        return 0;
+    }
+    return response_etag(etag, &st);
+}
+
+void sweep_temps(void) {
+    // Temps live in a subdirectory, where no target can name them, on the same filesystem
+    if (mkdir(TEMP_DIR, 0700) == -1 && errno != EEXIST) {
+        return;
+    }
+    DIR *dir = opendir(TEMP_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    // Each name starts with the pid that made it; a server replaced by an upgrade may
+    // still be writing its own, so only those of servers that are gone are removed
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (end != entry->d_name && *end == '.' && kill((pid_t) pid, 0) == -1 && errno == ESRCH) {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+int open_temp(const char *target, char *path) {
+    snprintf(path, TEMP_MAX, TEMP_DIR "/%d.%s.XXXXXX", (int) getpid(), target);
+    int file_fd = mkostemp(path, O_CLOEXEC);
+    // mkostemp creates files 0600, so apply the mode open would have used
+    if (file_fd != -1) {
+        fchmod(file_fd, temp_mode);
+    }
+    return file_fd;
+}
+
+int open_for_read(
+    list_node *node, char *target, cached_file **cached, int *file_fd, struct stat *st);
+ssize_t send_opened(int socket_fd, const char *header, size_t header_len, cached_file *cached,
+    int file_fd, off_t size);
 
 /*****FUNCTIONS NEEDED FOR LIST FUNCTIONS TO WORK*******/
 
-list_node *create_list_node(PRIORITY priority, char *path) {
-    // Allocate memory for a new list node and initialize it to zero
-    list_node *new_node = calloc(1, sizeof(list_node));
+list_node *create_list_node(slab_t *slab, PRIORITY priority, char *path) {
+    // Take a node from the slab; slab memory is not zeroed
+    list_node *new_node = slab_alloc(slab);
+    if (new_node == NULL) {
+        return NULL;
+    }
     // Initialize the previous and next pointers to NULL
     new_node->first = NULL;
     new_node->last = NULL;
-    // Copy the provided path to the path field of the new node
-    strcpy(new_node->path, path);
+    // Copy the provided path (at most TARGET_MAX characters) into the node
+    strncpy(new_node->path, path, TARGET_MAX);
+    new_node->path[TARGET_MAX] = '\0';
     // Create a new read-write lock with the given priority and some constant (4)
     new_node->lock = rwlock_new(priority, 4);
+    coro_rwlock_init(&(new_node->task_lock));
+    atomic_init(&(new_node->writers), 0);
+    // Start with nothing cached for this path
+    cache_slot_init(&(new_node->cache));
+#ifdef LOCK_STATS
+    lock_stats_init(&(new_node->stats));
+#endif
     // Return the newly created node
     return new_node;
 }
 
 thread_container *create_thread_container(queue_t *queue, list_t *list) {
     // Allocate memory for a new thread container and initialize it to zero
-    thread_container *container = calloc(1, sizeof(thread_container));
+    thread_container *container = counted_calloc(1, sizeof(thread_container));
     // Assign the provided queue and list to the container
     container->queue = queue;
     container->list = list;
@@ -123,8 +342,10 @@ void clear_list(linked_list *list) {
         while (current != NULL) {
             // Store the next node
             temp_node = current->last;
-            // Free the current node
-            free(current);
+            // Drop the node's lock and cached file and return it to the slab
+            rwlock_delete(&(current->lock));
+            cache_slot_destroy(&(current->cache));
+            slab_free(&(list->nodes), current);
             // Move to the next node
             current = temp_node;
         }
@@ -135,13 +356,15 @@ void clear_list(linked_list *list) {
 
 linked_list *create_list() {
     // Allocate memory for the new list and initialize it to zero
-    linked_list *new_list = (linked_list *) calloc(1, sizeof(linked_list));
+    linked_list *new_list = (linked_list *) counted_calloc(1, sizeof(linked_list));
     // Initialize the list properties
     new_list->head = NULL;
     new_list->tail = NULL;
     new_list->size = 0;
     // Initialize the mutex associated with the list
     pthread_mutex_init(&(new_list->mutex), NULL);
+    // Nodes are carved out of a slab so new URIs rarely hit the heap
+    slab_init(&(new_list->nodes), sizeof(list_node), NODE_CHUNK);
     // Return the newly created list
     return new_list;
 }
@@ -151,6 +374,8 @@ void delete_list(linked_list **list) {
     if (list != NULL && *list != NULL) {
         // Clear all nodes in the list
         clear_list(*list);
+        // Release the slab chunks that backed the nodes
+        slab_destroy(&((*list)->nodes));
         // Destroy the mutex associated with the list
         pthread_mutex_destroy(&((*list)->mutex));
         // Free the memory allocated for the list
@@ -166,7 +391,10 @@ bool push_to_list(linked_list *list, char *path) {
         return false;
     }
     // Create a new list node with the given path
-    list_node *new_node = create_list_node(N_WAY, path);
+    list_node *new_node = create_list_node(&(list->nodes), N_WAY, path);
+    if (new_node == NULL) {
+        return false;
+    }
     // If the list is empty, set the head and tail to the new node
     if (list->size == 0) {
         list->head = new_node;
@@ -214,7 +442,10 @@ bool lock_and_access_list(linked_list *list, char *path, bool write) {
         return false;
     }
     pthread_mutex_unlock(&(list->mutex));
-    if (write) {
+    if (coroutine_mode) {
+        // Yield to the worker's other requests instead of blocking the thread
+        coro_rwlock_lock(&(node->task_lock), write);
+    } else if (write) {
         writer_lock(node->lock);
     } else {
         reader_lock(node->lock);
@@ -230,7 +461,9 @@ bool unlock_access_list(linked_list *list, char *path, bool write) {
         pthread_mutex_unlock(&(list->mutex));
         return false;
     }
-    if (write) {
+    if (coroutine_mode) {
+        coro_rwlock_unlock(&(node->task_lock), write);
+    } else if (write) {
         writer_unlock(node->lock);
     } else {
         reader_unlock(node->lock);
@@ -286,8 +519,10 @@ bool lock_and_delete_from_list(linked_list *list, char *path) {
             }
             // Delete the read-write lock associated with the node
             rwlock_delete(&(node_to_delete->lock));
-            // Free the memory allocated for the node
-            free(node_to_delete);
+            // Drop any cached file for the path
+            cache_slot_destroy(&(node_to_delete->cache));
+            // Return the node to the slab
+            slab_free(&(list->nodes), node_to_delete);
             // Decrement the size of the list
             list->size--;
             // Unlock the mutex
@@ -322,26 +557,242 @@ list_node *find_in_list(linked_list *list, char *path) {
     return NULL;
 }
 
+list_node *lock_and_find_in_list(linked_list *list, char *path) {
+    // Look up the node for path while holding the list mutex
+    pthread_mutex_lock(&(list->mutex));
+    list_node *node = find_in_list(list, path);
+    pthread_mutex_unlock(&(list->mutex));
+    return node;
+}
+
 /************Other Helper Functions************/
 
+ssize_t receive_body(int socket_fd, int file_fd, ssize_t n, off_t drop_from) {
+    // Like pass_n_bytes, but a coroutine yields instead of blocking on the socket
+    char buffer[BUFFER_SIZE];
+    ssize_t passed = 0;
+    // With drop_from set, written pages are flushed and dropped a window behind
+    off_t flushed = drop_from;
+    while (passed < n) {
+        size_t want = (n - passed < BUFFER_SIZE) ? (size_t) (n - passed) : BUFFER_SIZE;
+        ssize_t got = coro_read(socket_fd, buffer, want);
+        if (got == -1) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        if (write_n_bytes(file_fd, buffer, got) == -1) {
+            return -1;
+        }
+        passed += got;
+        if (drop_from >= 0 && drop_from + passed - flushed >= DROP_WINDOW) {
+            // Start writeback of the new window, then wait for and drop the one before it
+            sync_file_range(file_fd, flushed, DROP_WINDOW, SYNC_FILE_RANGE_WRITE);
+            if (flushed >= DROP_WINDOW) {
+                sync_file_range(file_fd, flushed - DROP_WINDOW, DROP_WINDOW,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(file_fd, flushed - DROP_WINDOW, DROP_WINDOW, POSIX_FADV_DONTNEED);
+            }
+            flushed += DROP_WINDOW;
+        }
+    }
+    // Drop whatever the windows have not covered yet
+    if (drop_from >= 0 && passed > 0) {
+        sync_file_range(file_fd, flushed - DROP_WINDOW * (flushed >= DROP_WINDOW), 0,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return passed;
+}
+
+// The O_DIRECT chunk this thread used last, kept so that large uploads after the first do
+// not allocate. Coroutines on the thread that overlap take a fresh one while it is out.
+_Thread_local char *spare_direct = NULL;
+
+void release_direct(char *buffer) {
+    if (spare_direct == NULL) {
+        spare_direct = buffer;
+    } else {
+        free(buffer);
+    }
+}
+
+ssize_t receive_direct(user_req *req, int file_fd) {
+    // O_DIRECT needs aligned memory, offsets and lengths; -2 means it is unavailable
+    char *buffer = spare_direct;
+    spare_direct = NULL;
+    if (buffer == NULL) {
+        buffer = counted_aligned_alloc(DIRECT_ALIGN, DIRECT_CHUNK);
+        if (buffer == NULL) {
+            return -2;
+        }
+    }
+    int flags = fcntl(file_fd, F_GETFL);
+    if (flags == -1 || fcntl(file_fd, F_SETFL, flags | O_DIRECT) == -1) {
+        release_direct(buffer);
+        return -2;
+    }
+    // The part of the body that came with the head starts the first chunk
+    memcpy(buffer, req->body, req->remaining_len);
+    size_t fill = req->remaining_len;
+    ssize_t remaining = req->content_len - req->remaining_len;
+    off_t offset = 0;
+    bool done = false;
+    while (!done) {
+        while (fill < DIRECT_CHUNK && remaining > 0) {
+            size_t want = DIRECT_CHUNK - fill;
+            ssize_t got = coro_read(req->socket_fd, buffer + fill,
+                (remaining < (ssize_t) want) ? (size_t) remaining : want);
+            if (got == -1) {
+                release_direct(buffer);
+                return -1;
+            }
+            if (got == 0) {
+                break;
+            }
+            fill += got;
+            remaining -= got;
+        }
+        // A partly filled chunk is the last one
+        done = fill < DIRECT_CHUNK || remaining == 0;
+        size_t aligned = fill & ~(size_t) (DIRECT_ALIGN - 1);
+        for (size_t written = 0; written < aligned;) {
+            ssize_t result = pwrite(file_fd, buffer + written, aligned - written, offset);
+            if (result <= 0) {
+                release_direct(buffer);
+                return -1;
+            }
+            written += result;
+            offset += result;
+        }
+        memmove(buffer, buffer + aligned, fill - aligned);
+        fill -= aligned;
+    }
+    // The unaligned tail goes through the page cache
+    fcntl(file_fd, F_SETFL, flags);
+    ssize_t tail = (fill > 0) ? pwrite(file_fd, buffer, fill, offset) : 0;
+    release_direct(buffer);
+    return (tail == -1) ? -1 : offset + tail;
+}
+
+ssize_t receive_put_body(user_req *req, int file_fd) {
+    bool large = large_put > 0 && req->content_len >= large_put;
+    if (large) {
+        // Reserve the extents in one go; KEEP_SIZE leaves a cut-off upload at what arrived
+        fallocate(file_fd, FALLOC_FL_KEEP_SIZE, 0, req->content_len);
+        if (large_mode == LARGE_DIRECT && req->remaining_len <= req->content_len) {
+            ssize_t written = receive_direct(req, file_fd);
+            if (written != -2) {
+                return written;
+            }
+        }
+    }
+    // Write the part of the body that arrived with the head
+    ssize_t written = 0;
+    if (req->remaining_len > 0) {
+        written = write_n_bytes(file_fd, req->body, req->remaining_len);
+        if (written == -1) {
+            return -1;
+        }
+    }
+    // Then the rest straight from the socket
+    ssize_t rest = req->content_len - written;
+    if (rest > 0) {
+        ssize_t got = receive_body(
+            req->socket_fd, file_fd, rest, (large && large_mode != LARGE_CACHED) ? written : -1);
+        if (got == -1) {
+            return -1;
+        }
+        written += got;
+    }
+    return written;
+}
+
 /***********PARSING AND HANDLING**************/
 
 void parse_arguments(int count, char **values) {
     // Initialize variables for option parsing
     int opt_char = 0;
-    char *options = "t:";
+    char *options = "t:m:c:a:T:U:o:B:b:r:R:CSLFP:D:";
     // Parse command-line options
     opt_char = getopt(count, values, options);
     while (opt_char != -1) {
         if (opt_char == 't') {
             // Set the thread count from the option argument
             thread_count = atoi(optarg);
+        } else if (opt_char == 'm') {
+            // Set the largest file size served from the mapping cache (0 disables it)
+            mmap_threshold = strtoul(optarg, NULL, 10);
+        } else if (opt_char == 'c') {
+            // Set how many files the GET cache keeps open (0 disables it)
+            cache_entries = atoi(optarg);
+        } else if (opt_char == 'C') {
+            // Run each connection as a coroutine on the worker threads
+            coroutine_mode = true;
+        } else if (opt_char == 'B') {
+            // Let at most this many workers run bulk transfers at once (0 disables it)
+            bulk_slots = atoi(optarg);
+        } else if (opt_char == 'b') {
+            // Count transfers of at least this many bytes as bulk
+            bulk_size = strtoull(optarg, NULL, 10);
+        } else if (opt_char == 'r') {
+            // Limit each client to this many requests per second
+            client_requests = strtod(optarg, NULL);
+        } else if (opt_char == 'R') {
+            // Limit each client to this many bytes per second
+            client_bytes = strtod(optarg, NULL);
+        } else if (opt_char == 'F') {
+            // Dispatch connections in deficit round-robin order across clients
+            fair_dispatch = true;
+        } else if (opt_char == 'P') {
+            // Preallocate PUT bodies of at least this many bytes (0 disables it)
+            large_put = strtoll(optarg, NULL, 10);
+        } else if (opt_char == 'D') {
+            // Keep large PUT bodies out of the page cache
+            if (strcmp(optarg, "direct") == 0) {
+                large_mode = LARGE_DIRECT;
+            } else if (strcmp(optarg, "dontneed") == 0) {
+                large_mode = LARGE_DONTNEED;
+            } else {
+                fputs("Invalid -D mode, expected direct or dontneed\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt_char == 'L') {
+            // Append the wall-clock time to every audit log line for replays
+            log_times = true;
+        } else if (opt_char == 'S') {
+            // Upload PUTs to a temporary file and rename it over the target
+            snapshot_puts = true;
+        } else if (opt_char == 'o') {
+            // Cache the files of the origin server at host:port
+            if (!proxy_parse(optarg)) {
+                fputs("Invalid origin, expected host:port\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt_char == 'U') {
+            // Hand the listener over through this Unix socket path on upgrade
+            upgrade_path = optarg;
+        } else if (opt_char == 'T') {
+            // Trace one request in every N (0 disables tracing)
+            trace_sample = atoi(optarg);
+        } else if (opt_char == 'a') {
+            // Pin threads to the given CPU list
+            if (!affinity_parse(optarg)) {
+                fputs("Invalid CPU list\n", stderr);
+                exit(EXIT_FAILURE);
+            }
         } else {
             // Exit if an unknown option is encountered
             exit(EXIT_FAILURE);
         }
         opt_char = getopt(count, values, options);
     }
+    // The mode open would have given new files, for the temps snapshots and fills rename
+    mode_t mask = umask(0);
+    umask(mask);
+    temp_mode = 0666 & ~mask;
     // Check if a server port is specified as a non-option argument
     if (optind < count) {
         server_port = atoi(values[optind]);
@@ -352,121 +803,201 @@ void parse_arguments(int count, char **values) {
     }
 }
 
-int parse_request(user_req *req, char *buffer, ssize_t buffer_len) {
-    // Initialize variables for regex and offsets
-    int offset = 0;
-    regex_t request_regex;
-    regmatch_t matches[4];
-    // Compile the request regex pattern
-    if (regcomp(&request_regex, REQUEST_REGEX, REG_EXTENDED) != 0) {
-        return EXIT_FAILURE;
+bool is_token_char(char c) {
+    // Characters allowed in targets and header names
+    return isalnum((unsigned char) c) || c == '.' || c == '-';
+}
+
+bool parse_head_line(user_req *req, char *buffer, size_t end) {
+    size_t pos = 0;
+    // Method: 1 to 8 letters followed by a space
+    while (pos < end && pos < 8 && isalpha((unsigned char) buffer[pos])) {
+        pos++;
     }
-    // Execute regex to match the request line
-    if (regexec(&request_regex, buffer, 4, matches, 0) == 0) {
-        // Extract and null-terminate the command, target, and HTTP version
-        req->command = buffer;
-        req->target = buffer + matches[2].rm_so;
-        req->http_version = buffer + matches[3].rm_so;
-        buffer[matches[1].rm_eo] = '\0';
-        req->target[matches[2].rm_eo - matches[2].rm_so] = '\0';
-        req->http_version[matches[3].rm_eo - matches[3].rm_so] = '\0';
-        // Update buffer and offset to point past the request line
-        buffer += matches[3].rm_eo + 2;
-        offset += matches[3].rm_eo + 2;
-    } else {
-        // Handle bad request
-        dprintf(req->socket_fd,
-            "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
-        log_entry(req->command, req->target, 400, req->id);
-        regfree(&request_regex);
-        return EXIT_FAILURE;
+    if (pos == 0 || buffer[pos] != ' ') {
+        return false;
+    }
+    buffer[pos++] = '\0';
+    // Target: a slash then 1 to TARGET_MAX token characters followed by a space
+    if (buffer[pos++] != '/') {
+        return false;
     }
+    size_t start = pos;
+    while (pos < end && pos - start < TARGET_MAX && is_token_char(buffer[pos])) {
+        pos++;
+    }
+    if (pos == start || buffer[pos] != ' ') {
+        return false;
+    }
+    buffer[pos++] = '\0';
+    // Version: exactly HTTP/<digit>.<digit> up to the end of the line
+    char *version = buffer + pos;
+    if (end - pos != 8 || strncmp(version, "HTTP/", 5) != 0 || !isdigit((unsigned char) version[5])
+        || version[6] != '.' || !isdigit((unsigned char) version[7])) {
+        return false;
+    }
+    buffer[end] = '\0';
+    req->command = buffer;
+    req->target = buffer + start;
+    req->http_version = version;
+    return true;
+}
+
+int parse_request(user_req *req, char *buffer, ssize_t buffer_len, header_scanner *scanner) {
     // Initialize content length and request ID
     req->content_len = -1;
     req->id = 0;
-    // Compile the header regex pattern
-    if (regcomp(&request_regex, HEADER_REGEX, REG_EXTENDED) != 0) {
+    req->completion_order = false;
+    req->if_match = NULL;
+    req->if_none_match = NULL;
+    req->upgrade = NULL;
+    req->h2_settings = NULL;
+    req->client_id = NULL;
+    // The scanner has already found every line and checked every byte
+    if (scanner->head_end == 0 || scanner->invalid || scanner->line_count == 0
+        || !parse_head_line(req, buffer, scanner->line_ends[0])) {
+        // Handle bad request
+        response_send_status(req->socket_fd, 400);
+        log_entry(req->command, req->target, 400, req->id);
         return EXIT_FAILURE;
     }
-    // Parse headers
-    while (regexec(&request_regex, buffer, 3, matches, 0) == 0) {
+    // Parse headers, one complete line at a time
+    for (int i = 1; i < scanner->line_count; i++) {
+        char *line = buffer + scanner->line_ends[i - 1] + 2;
+        size_t len = scanner->line_ends[i] - (scanner->line_ends[i - 1] + 2);
+        // Header name: 1 to 128 token characters, then ": ", then 1 to 128 bytes of value
+        size_t name_len = 0;
+        while (name_len < len && name_len < 128 && is_token_char(line[name_len])) {
+            name_len++;
+        }
+        size_t value_len = len - name_len - 2;
+        if (name_len == 0 || name_len + 2 >= len || line[name_len] != ':'
+            || line[name_len + 1] != ' ' || value_len > 128) {
+            // Handle bad request for malformed headers
+            response_send_status(req->socket_fd, 400);
+            log_entry(req->command, req->target, 400, req->id);
+            return EXIT_FAILURE;
+        }
         // Null-terminate the header field and value
-        buffer[matches[1].rm_eo] = '\0';
-        buffer[matches[2].rm_eo] = '\0';
+        line[name_len] = '\0';
+        line[len] = '\0';
+        char *value = line + name_len + 2;
         // Process specific headers
-        if (strncmp(buffer, "Content-Length", 14) == 0) {
+        if (name_len == 14 && strcmp(line, "Content-Length") == 0) {
+            // Digits only: no sign, nothing after them and nothing that overflows, so -1 can
+            // only ever mean the header was absent
+            char *end;
             errno = 0;
-            int value = strtol(buffer + matches[2].rm_so, NULL, 10);
-            if (errno == EINVAL) {
+            ssize_t content_len = strtoll(value, &end, 10);
+            if (!isdigit((unsigned char) value[0]) || *end != '\0' || errno == ERANGE) {
                 // Handle bad request for invalid content length
-                dprintf(req->socket_fd,
-                    "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
+                response_send_status(req->socket_fd, 400);
                 log_entry(req->command, req->target, 400, req->id);
                 return EXIT_FAILURE;
             }
-            req->content_len = value;
-        } else if (strncmp(buffer, "Request-Id", 10) == 0) {
-            int id = strtol(buffer + matches[2].rm_so, NULL, 10);
-            req->id = id;
-        }
-        // Update buffer and offset to point past the current header
-        buffer += matches[2].rm_eo + 2;
-        offset += matches[2].rm_eo + 2;
-    }
-    // Check for end of headers and start of body
-    if (buffer[0] == '\r' && buffer[1] == '\n') {
-        req->body = buffer + 2;
-        offset += 2;
-        req->remaining_len = buffer_len - offset;
-    } else {
-        // Handle bad request for malformed headers
-        dprintf(req->socket_fd,
-            "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
-        log_entry(req->command, req->target, 400, req->id);
-        regfree(&request_regex);
-        return EXIT_FAILURE;
+            req->content_len = content_len;
+        } else if (name_len == 10 && strcmp(line, "Request-Id") == 0) {
+            req->id = strtol(value, NULL, 10);
+        } else if (name_len == 11 && strcmp(line, "Batch-Order") == 0) {
+            req->completion_order = (strcmp(value, "completion") == 0);
+        } else if (name_len == 8 && strcmp(line, "If-Match") == 0) {
+            req->if_match = value;
+        } else if (name_len == 13 && strcmp(line, "If-None-Match") == 0) {
+            req->if_none_match = value;
+        } else if (name_len == 7 && strcmp(line, "Upgrade") == 0) {
+            req->upgrade = value;
+        } else if (name_len == 14 && strcmp(line, "HTTP2-Settings") == 0) {
+            req->h2_settings = value;
+        } else if (name_len == 11 && strcmp(line, "X-Client-Id") == 0) {
+            req->client_id = value;
+        }
     }
-    // Free the compiled regex
-    regfree(&request_regex);
+    // Whatever was read past the blank line is the start of the body
+    req->body = buffer + scanner->head_end;
+    req->remaining_len = buffer_len - scanner->head_end;
     return EXIT_SUCCESS;
 }
 
+void lock_target(linked_list *list, user_req *req, bool write) {
+    // Time the wait for tracing and, when built in, the contention counters
+    trace_phase_begin(req->trace, PHASE_LOCK);
+    if (write) {
+        atomic_fetch_add(&(req->node->writers), 1);
+    }
+#ifdef LOCK_STATS
+    uint64_t wait_start = lock_stats_wait(&(req->node->stats));
+#endif
+    lock_and_access_list(list, req->target, write);
+#ifdef LOCK_STATS
+    req->lock_held_at = lock_stats_acquired(&(req->node->stats), write, wait_start);
+#endif
+    trace_phase_end(req->trace, PHASE_LOCK);
+}
+
+void unlock_target(linked_list *list, user_req *req, bool write) {
+    unlock_access_list(list, req->target, write);
+    if (write) {
+        atomic_fetch_sub(&(req->node->writers), 1);
+    }
+#ifdef LOCK_STATS
+    lock_stats_released(&(req->node->stats), req->lock_held_at);
+#endif
+}
+
 int handle_request(user_req *req, linked_list *list) {
+    // A batch names its targets in the body, so its own target is not locked
+    if (strcmp(req->command, "MGET") == 0 && strncmp(req->http_version, "HTTP/1.1", 8) == 0) {
+        return process_mget(req, list);
+    }
     // Add the request target to the list with locking
     lock_and_push_to_list(list, req->target);
+    // Remember the node so GET and PUT can reach its cache slot
+    req->node = lock_and_find_in_list(list, req->target);
     // Initialize variables to track lock acquisition and request status
     int lock_acquired = 0;
     int status = EXIT_FAILURE;
     // Check the HTTP version
     if (strncmp(req->http_version, "HTTP/1.1", 8) != 0) {
         // Respond with 505 Version Not Supported
-        dprintf(req->socket_fd,
-            "HTTP/1.1 505 Version Not Supported\r\nContent-Length: %d\r\n\r\nVersion Not "
-            "Supported\n",
-            12);
+        response_send_status(req->socket_fd, 505);
         log_entry(req->command, req->target, 505, req->id);
     } else if (strncmp(req->command, "GET", 3) == 0) {
         // Handle GET request
-        lock_and_access_list(list, req->target, false);
+        lock_target(list, req, false);
+        lock_acquired = 1;
+        status = process_get(req, true);
+        if (status == GET_MISS) {
+            // Misses queue on the writer lock, so only the first one goes to the origin
+            unlock_target(list, req, false);
+            lock_target(list, req, true);
+            status = process_fill(req);
+            unlock_target(list, req, true);
+            lock_acquired = 0;
+        }
+    } else if (strncmp(req->command, "PUT", 3) == 0 && proxy_enabled()) {
+        // The origin takes the write; the local copy goes while readers are held off
+        lock_target(list, req, true);
         lock_acquired = 1;
-        status = process_get(req);
+        status = process_put_forward(req);
+    } else if (strncmp(req->command, "PUT", 3) == 0 && snapshot_puts) {
+        // Snapshot PUTs take the writer lock themselves, only for the rename
+        status = process_put_snapshot(req, list);
     } else if (strncmp(req->command, "PUT", 3) == 0) {
         // Handle PUT request
-        lock_and_access_list(list, req->target, true);
+        lock_target(list, req, true);
         lock_acquired = 1;
         status = process_put(req);
     } else {
         // Respond with 501 Not Implemented
-        dprintf(req->socket_fd,
-            "HTTP/1.1 501 Not Implemented\r\nContent-Length: %d\r\n\r\nNot Implemented\n", 12);
+        response_send_status(req->socket_fd, 501);
         log_entry(req->command, req->target, 501, req->id);
     }
     // Release locks if they were acquired
     if (lock_acquired) {
         if (strncmp(req->command, "GET", 3) == 0) {
-            unlock_access_list(list, req->target, false);
+            unlock_target(list, req, false);
         } else if (strncmp(req->command, "PUT", 3) == 0) {
-            unlock_access_list(list, req->target, true);
+            unlock_target(list, req, true);
         }
     }
     // Return the status of the request handling
@@ -488,138 +1019,739 @@ void log_entry(const char *operation, const char *path, int status, int id) {
     pthread_mutex_lock(&log_mutex);
 
     // Log the operation and path
-    fprintf(stderr, "%s,/%s,%d,%d\n", operation, path, status, id);
+    if (log_times) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        fprintf(stderr, "%s,/%s,%d,%d,%ld.%06ld\n", operation, path, status, id, (long) ts.tv_sec,
+            ts.tv_nsec / 1000);
+    } else {
+        fprintf(stderr, "%s,/%s,%d,%d\n", operation, path, status, id);
+    }
 
     // Unlock the mutex after logging
     pthread_mutex_unlock(&log_mutex);
 }
 
-void *thread_worker(void *list_ptr) {
+void serve_connection(int client_socket, void *list_ptr) {
     linked_list *list = (linked_list *) list_ptr;
-    // Continue processing while the server is not shut down
-    while (!atomic_load(&server_shutdown)) {
-        uintptr_t client_socket;
-        // Pop a request from the request queue
-        if (!queue_pop(request_queue, (void **) &client_socket)) {
-            continue;
+    // Borrow a recycled arena for the connection's buffer and scratch space
+    arena_t *arena = arena_acquire();
+    if (arena == NULL) {
+        close(client_socket);
+        return;
+    }
+    char *buffer = arena->io;
+    // Sampled requests record when each phase starts and ends
+    trace_req trace;
+    trace_begin(&trace, client_socket);
+    user_req req;
+    req.socket_fd = client_socket;
+    req.trace = &trace;
+    // Log something sensible if the request line never parses
+    req.command = "";
+    req.target = "";
+    req.id = 0;
+    req.client = NULL;
+    req.flow_key = 0;
+    req.moved = 0;
+    // Read the request head, scanning only new bytes after each read
+    header_scanner *scanner = arena_alloc(arena, sizeof(header_scanner));
+    scanner_init(scanner);
+    ssize_t bytes_read = read_request_head(client_socket, buffer, ARENA_IO_SIZE, scanner);
+    trace_phase_end(&trace, PHASE_READ);
+    if (bytes_read == -1) {
+        // Handle bad request
+        response_send_status(req.socket_fd, 400);
+        log_entry(req.command, req.target, 400, req.id);
+        arena_release(arena);
+        close(client_socket);
+        return;
+    }
+    // A client with prior knowledge of HTTP/2 opens with a preface that reads like a head
+    if (h2_preface(buffer, bytes_read)) {
+        size_t head_len = sizeof(H2_PREFACE_HEAD) - 1;
+        if (coroutine_mode) {
+            h2_serve(client_socket, buffer + head_len, bytes_read - head_len, NULL, NULL,
+                serve_connection, list);
+        } else {
+            h2_refuse(client_socket);
         }
-        // Initialize request buffer and user request structure
-        char buffer[BUFFER_SIZE + 1] = { '\0' };
-        user_req req;
-        req.socket_fd = client_socket;
-        // Read the request from the client socket
-        ssize_t bytes_read = read_until(client_socket, buffer, BUFFER_SIZE, "\r\n\r\n");
-        if (bytes_read == -1) {
-            // Handle bad request
-            dprintf(req.socket_fd,
-                "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
-            log_entry(req.command, req.target, 400, req.id);
-            close(client_socket);
-            continue;
+        arena_release(arena);
+        close(client_socket);
+        return;
+    }
+    // Only the bytes read need terminating; the rest of the buffer is never looked at
+    buffer[bytes_read] = '\0';
+    // Parse the request and handle it if parsing is successful
+    trace_phase_begin(&trace, PHASE_PARSE);
+    int parsed = parse_request(&req, buffer, bytes_read, scanner);
+    trace_phase_end(&trace, PHASE_PARSE);
+    if (parsed != EXIT_FAILURE && process_upgrade(&req, list)) {
+        // Each stream of the connection counts as a request of its own
+        arena_release(arena);
+        close(client_socket);
+        return;
+    }
+    if (parsed != EXIT_FAILURE && !admit_client(&req)) {
+        // Over its limit: a canned answer before any file is looked at
+        response_send_status(client_socket, 429);
+        log_entry(req.command, req.target, 429, req.id);
+        finish_connection(&req, arena, list, false);
+        return;
+    }
+    if (parsed != EXIT_FAILURE && is_bulk(&req)) {
+        serve_bulk(&req, arena, list);
+        return;
+    }
+    finish_connection(&req, arena, list, parsed != EXIT_FAILURE);
+}
+
+void finish_connection(user_req *req, arena_t *arena, linked_list *list, bool parsed) {
+    if (parsed) {
+        handle_request(req, list);
+        // Charge what was moved, a PUT's body whatever came of it
+        size_t moved = (strcmp(req->command, "PUT") == 0 && req->content_len > 0)
+                           ? (size_t) req->content_len
+                           : req->moved;
+        if (req->client != NULL) {
+            client_charge(req->client, moved);
         }
-        // Parse the request and handle it if parsing is successful
-        if (parse_request(&req, buffer, bytes_read) != EXIT_FAILURE) {
-            handle_request(&req, list);
+        dispatch_charge(request_queue, req->flow_key, moved);
+    }
+    trace_commit(req->trace, req->id, req->command, req->target);
+    atomic_fetch_add(&requests_served, 1);
+    affinity_count_request();
+    // Hand the arena back and close the client socket
+    int client_socket = req->socket_fd;
+    arena_release(arena);
+    close(client_socket);
+}
+
+bool admit_client(user_req *req) {
+    if (!client_enabled() && !fair_dispatch) {
+        return true;
+    }
+    // The peer address names the client unless it names itself, and always picks the flow
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    char name[INET6_ADDRSTRLEN] = "local";
+    if (getpeername(req->socket_fd, (struct sockaddr *) &peer, &peer_len) == 0) {
+        req->flow_key = dispatch_key((struct sockaddr *) &peer);
+        if (peer.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &(((struct sockaddr_in *) &peer)->sin_addr), name, sizeof(name));
+        } else if (peer.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &(((struct sockaddr_in6 *) &peer)->sin6_addr), name, sizeof(name));
         }
-        // Clear the buffer and close the client socket
-        memset(buffer, '\0', sizeof(buffer));
-        close(client_socket);
+    }
+    if (!client_enabled()) {
+        return true;
+    }
+    req->client = (req->client_id != NULL) ? client_find(req->client_id, strlen(req->client_id))
+                                           : client_find(name, strlen(name));
+    return client_admit(req->client);
+}
+
+bool is_bulk(user_req *req) {
+    if (!lane_enabled()) {
+        return false;
+    }
+    if (strcmp(req->command, "PUT") == 0) {
+        return req->content_len > 0 && lane_is_bulk(req->content_len);
+    }
+    // A GET's size is only known from the file; one that is missing is small
+    struct stat st;
+    return strcmp(req->command, "GET") == 0 && stat(req->target, &st) == 0
+           && S_ISREG(st.st_mode) && lane_is_bulk(st.st_size);
+}
+
+void serve_bulk(user_req *req, arena_t *arena, linked_list *list) {
+    if (coroutine_mode) {
+        // A waiting coroutine costs its worker nothing, so it waits in place
+        lane_wait();
+        finish_connection(req, arena, list, true);
+        lane_leave();
+        return;
+    }
+    // Move the request off this stack so that any worker can finish it
+    parked_conn *parked = arena_alloc(arena, sizeof(parked_conn));
+    if (parked == NULL) {
+        finish_connection(req, arena, list, true);
+        return;
+    }
+    parked->req = *req;
+    parked->trace = *(req->trace);
+    parked->req.trace = &(parked->trace);
+    parked->arena = arena;
+    if (!lane_enter(&(parked->job))) {
+        // The worker that frees the next slot serves it; this one goes back to the queue
+        return;
+    }
+    // Serve this one, then whatever was parked while the slot was held
+    lane_job *job = &(parked->job);
+    while (job != NULL) {
+        parked = (parked_conn *) job;
+        finish_connection(&(parked->req), parked->arena, list, true);
+        job = lane_leave();
+    }
+}
+
+void *thread_worker(void *list_ptr) {
+    uintptr_t client_socket;
+    // Pin before the first arena is touched so it lands on this CPU's node
+    affinity_pin(ROLE_WORKER, atomic_fetch_add(&workers_started, 1));
+    // Keep popping connections until the queue is closed and drained
+    while (dispatch_pop(request_queue, (void **) &client_socket)) {
+        serve_connection(client_socket, list_ptr);
     }
     return NULL;
 }
 
+void *coro_worker(void *sched) {
+    affinity_pin(ROLE_WORKER, atomic_fetch_add(&workers_started, 1));
+    // Each connection runs as a coroutine until the scheduler is closed and idle
+    coro_sched_run((coro_sched *) sched);
+    return NULL;
+}
+
 void configure_signals() {
-    // Configure signal handlers for SIGINT and SIGTERM
-    if (signal(SIGINT, handle_signal) == SIG_ERR || signal(SIGTERM, handle_signal) == SIG_ERR) {
+    // Configure signal handlers for SIGINT and SIGTERM; writes to a peer that has gone
+    // (a client, or a reset HTTP/2 stream's bridge) fail with EPIPE instead of killing us
+    if (signal(SIGINT, handle_signal) == SIG_ERR || signal(SIGTERM, handle_signal) == SIG_ERR
+        || signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         perror("signal");
         exit(EXIT_FAILURE);
     }
 }
 
+void invalidate_target(void *list_ptr, const char *name) {
+    // Names longer than a target can never be in the lock table
+    if (strlen(name) > TARGET_MAX) {
+        return;
+    }
+    list_node *node = lock_and_find_in_list((linked_list *) list_ptr, (char *) name);
+    if (node != NULL) {
+        cache_invalidate(&(node->cache));
+    }
+}
+
+void print_stats(FILE *out) {
+    // Report requests against heap allocations; the latter stays flat once warmed up
+    fprintf(out, "requests: %ld\n", atomic_load(&requests_served));
+    fprintf(out, "heap allocations: %ld\n", mem_alloc_count());
+    affinity_report(out);
+    lane_report(out);
+    client_report(out);
+#ifdef LOCK_STATS
+    print_lock_stats(out, lock_table);
+#endif
+    fflush(out);
+}
+
+#ifdef LOCK_STATS
+void print_lock_stats(FILE *out, linked_list *list) {
+    // Keep the LOCK_TOP targets with the most total wait, most waited first
+    list_node *top[LOCK_TOP];
+    int count = 0;
+    pthread_mutex_lock(&(list->mutex));
+    for (list_node *node = list->head; node != NULL; node = node->last) {
+        long wait = atomic_load(&(node->stats.wait_ns));
+        int at = count;
+        while (at > 0 && atomic_load(&(top[at - 1]->stats.wait_ns)) < wait) {
+            at--;
+        }
+        if (at == LOCK_TOP) {
+            continue;
+        }
+        int last = (count < LOCK_TOP) ? count++ : LOCK_TOP - 1;
+        for (int i = last; i > at; i--) {
+            top[i] = top[i - 1];
+        }
+        top[at] = node;
+    }
+    // Print before unlocking so none of the nodes can be deleted underneath
+    for (int i = 0; i < count; i++) {
+        lock_stats_print(out, top[i]->path, &(top[i]->stats));
+    }
+    pthread_mutex_unlock(&(list->mutex));
+}
+#endif
+
+void *stats_worker(void *signals) {
+    int signo = 0;
+    // Dump statistics to stdout on SIGUSR1 and the trace rings to a file on SIGUSR2, and
+    // start a replacement server on SIGHUP
+    while (sigwait((sigset_t *) signals, &signo) == 0) {
+        if (signo == SIGUSR1) {
+            print_stats(stdout);
+        } else if (signo == SIGHUP && upgrade_path != NULL) {
+            // Start the binary we were run as; it takes over through the upgrade socket
+            if (!upgrade_spawn(server_argv)) {
+                perror("upgrade");
+            }
+        } else if (signo == SIGUSR2) {
+            // Every dump gets a fresh name, since an existing file is never overwritten
+            static int dumps = 0;
+            char path[64];
+            snprintf(path, sizeof(path), "/tmp/httpserver-trace-%d-%d.json", (int) getpid(),
+                dumps++);
+            int written = trace_dump(path);
+            if (written == -1) {
+                perror(path);
+            } else {
+                fprintf(stdout, "trace: %d requests written to %s\n", written, path);
+                fflush(stdout);
+            }
+        }
+    }
+    return NULL;
+}
+
+void *upgrade_worker(void *fds) {
+    int upgrade_fd = ((int *) fds)[0];
+    int listen_fd = ((int *) fds)[1];
+    // Serve replacements until one confirms it is accepting
+    while (!atomic_load(&server_shutdown)) {
+        if (upgrade_serve(upgrade_fd, listen_fd)) {
+            // Stop accepting; main drains what is in flight and exits
+            atomic_store(&handed_off, true);
+            atomic_store(&server_shutdown, 1);
+        }
+    }
+    close(upgrade_fd);
+    return NULL;
+}
+
 /***********HANDLING GETS AND PUTS****************/
-int process_get(user_req *req) {
-    struct stat stat_buf;
-    int file_fd = open(req->target, O_RDONLY | O_DIRECTORY);
+int open_for_read(
+    list_node *node, char *target, cached_file **cached, int *file_fd, struct stat *st) {
+    // Serve straight from the cached descriptor or mapping when possible
+    *cached = cache_acquire(&(node->cache), target);
+    *file_fd = -1;
+    if (*cached != NULL) {
+        *st = (*cached)->st;
+        return 200;
+    }
+    int fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    // Check if the target is a directory
+    if (fd != -1) {
+        close(fd);
+        return 403;
+    }
+    // Open the target file
+    fd = open(target, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        // Determine the error code based on errno
+        if (errno == ENOENT) {
+            return 404;
+        } else if (errno == EACCES) {
+            return 403;
+        }
+        return 500;
+    }
+    // Get the file size and the fields its ETag is made of
+    fstat(fd, st);
+    *file_fd = fd;
+    return 200;
+}
+
+ssize_t send_opened(int socket_fd, const char *header, size_t header_len, cached_file *cached,
+    int file_fd, off_t size) {
+    if (cached != NULL) {
+        return cache_send(socket_fd, header, header_len, cached);
+    }
+    // Send the header corked together with the file content
+    return response_send_file(socket_fd, header, header_len, file_fd, 0, size);
+}
+
+int process_get(user_req *req, bool may_fill) {
     // Check for invalid request content length or remaining length
     if ((req->content_len != -1) || (req->remaining_len > 0)) {
-        dprintf(req->socket_fd,
-            "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
+        response_send_status(req->socket_fd, 400);
         log_entry(req->command, req->target, 400, req->id);
         return EXIT_FAILURE;
     }
-    // Check if the target is a directory
-    if (file_fd != -1) {
-        dprintf(
-            req->socket_fd, "HTTP/1.1 403 Forbidden\r\nContent-Length: %d\r\n\r\nForbidden\n", 10);
-        log_entry(req->command, req->target, 403, req->id);
+    cached_file *cached;
+    int file_fd;
+    struct stat st;
+    trace_phase_begin(req->trace, PHASE_IO);
+    int status = open_for_read(req->node, req->target, &cached, &file_fd, &st);
+    trace_phase_end(req->trace, PHASE_IO);
+    if (status == 404 && may_fill && proxy_enabled()) {
+        // Nothing is sent yet; the caller fetches it from the origin
+        return GET_MISS;
+    }
+    if (status != 200) {
+        // Respond with the matching canned response and log the entry
+        response_send_status(req->socket_fd, status);
+        log_entry(req->command, req->target, status, req->id);
         return EXIT_FAILURE;
     }
-    // Open the target file
-    file_fd = open(req->target, O_RDONLY);
-    if (file_fd == -1) {
-        int err_code;
-        const char *message;
-        // Determine error code and message based on errno
-        if (errno == ENOENT) {
-            err_code = 404;
-            message = "HTTP/1.1 404 Not Found\r\nContent-Length: %d\r\n\r\nNot Found\n";
-        } else if (errno == EACCES) {
-            err_code = 403;
-            message = "HTTP/1.1 403 Forbidden\r\nContent-Length: %d\r\n\r\nForbidden\n";
+    // A fetched copy answers with the origin's tag, so conditional PUTs forwarded there match
+    char etag[RESPONSE_ETAG_MAX];
+    size_t etag_len = proxy_enabled() ? proxy_tag_load(req->target, etag) : 0;
+    if (etag_len == 0) {
+        etag_len = response_etag(etag, &st);
+    }
+    char header[RESPONSE_HEADER_MAX];
+    size_t header_len = response_header(header, st.st_size, etag, etag_len);
+    log_entry(req->command, req->target, 200, req->id);
+    trace_phase_begin(req->trace, PHASE_SEND);
+    ssize_t sent = send_opened(req->socket_fd, header, header_len, cached, file_fd, st.st_size);
+    trace_phase_end(req->trace, PHASE_SEND);
+    req->moved = st.st_size;
+    if (cached != NULL) {
+        cache_release(cached);
+    } else {
+        close(file_fd);
+    }
+    if (sent == -1) {
+        if (cached != NULL) {
+            // The file changed underneath the cache, so stop trusting it
+            cache_invalidate(&(req->node->cache));
         } else {
-            err_code = 500;
-            message = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal "
-                      "Server Error\n";
+            response_send_status(req->socket_fd, 500);
         }
-        // Respond with the appropriate error message and log the entry
-        dprintf(req->socket_fd, message, 10);
-        log_entry(req->command, req->target, err_code, req->id);
+        log_entry(req->command, req->target, 500, req->id);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int process_fill(user_req *req) {
+    // Another miss may have fetched the target while this one waited for the lock
+    if (access(req->target, F_OK) == 0) {
+        return process_get(req, false);
+    }
+    trace_phase_begin(req->trace, PHASE_IO);
+    char buffer[BUFFER_SIZE];
+    proxy_reply reply = { .status = 502 };
+    int upstream = proxy_connect();
+    if (upstream != -1 && proxy_send_head(upstream, "GET", req->target, -1, req->id, NULL, NULL)
+        && proxy_read_reply(upstream, buffer, sizeof(buffer), &reply)
+        && reply.status == 200 && reply.content_len == -1) {
+        // Without a length there is no telling a complete body from a cut-off one
+        reply.status = 502;
+    }
+    trace_phase_end(req->trace, PHASE_IO);
+    if (reply.status != 200) {
+        // Pass the origin's answer on, or 502 if there was none
+        if (upstream != -1) {
+            close(upstream);
+        }
+        response_send_status(req->socket_fd, reply.status);
+        log_entry(req->command, req->target, reply.status, req->id);
         return EXIT_FAILURE;
     }
-    // Get the file size and send the response header
-    fstat(file_fd, &stat_buf);
-    off_t size = stat_buf.st_size;
-    dprintf(req->socket_fd, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", size);
+    // The copy goes to a temp and is only renamed into place once complete
+    char temp[TEMP_MAX];
+    int file_fd = open_temp(req->target, temp);
+    char header[RESPONSE_HEADER_MAX];
+    size_t header_len
+        = response_header(header, reply.content_len, reply.etag, reply.etag_len);
     log_entry(req->command, req->target, 200, req->id);
-    // Send the file content
-    if (pass_n_bytes(file_fd, req->socket_fd, size) == -1) {
-        dprintf(req->socket_fd,
-            "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal Server "
-            "Error\n",
-            22);
-        log_entry(req->command, req->target, 500, req->id);
+    // Stream to the client while storing; the store goes on if the client leaves
+    trace_phase_begin(req->trace, PHASE_SEND);
+    bool client_ok = proxy_write(req->socket_fd, header, header_len);
+    ssize_t copied = proxy_relay(upstream, req->socket_fd, file_fd, buffer + reply.head_len,
+        reply.buffered - reply.head_len, reply.content_len, &client_ok);
+    trace_phase_end(req->trace, PHASE_SEND);
+    close(upstream);
+    if (file_fd != -1) {
+        if (reply.etag_len > 0) {
+            proxy_tag_store(file_fd, reply.etag, reply.etag_len);
+        }
         close(file_fd);
+        if (copied == reply.content_len && rename(temp, req->target) == 0) {
+            cache_invalidate(&(req->node->cache));
+        } else {
+            unlink(temp);
+        }
+    }
+    if (copied != reply.content_len) {
+        log_entry(req->command, req->target, 500, req->id);
+        return EXIT_FAILURE;
+    }
+    return client_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int process_put_forward(user_req *req) {
+    // Check if Content-Length header is present
+    if (req->content_len == -1) {
+        response_send_status(req->socket_fd, 400);
+        log_entry(req->command, req->target, 400, req->id);
+        return EXIT_FAILURE;
+    }
+    trace_phase_begin(req->trace, PHASE_IO);
+    char buffer[BUFFER_SIZE];
+    proxy_reply reply = { .status = 502 };
+    bool origin_ok = true;
+    // The origin judges If-Match and If-None-Match against its own tags
+    int upstream = proxy_connect();
+    if (upstream != -1
+        && proxy_send_head(upstream, "PUT", req->target, req->content_len, req->id,
+            req->if_match, req->if_none_match)) {
+        ssize_t relayed = proxy_relay(req->socket_fd, upstream, -1, req->body,
+            req->remaining_len, req->content_len, &origin_ok);
+        if (origin_ok && relayed < req->content_len) {
+            // The client stopped short; closing makes the origin see the same
+            reply.status = 400;
+        } else if (origin_ok) {
+            proxy_read_reply(upstream, buffer, sizeof(buffer), &reply);
+        }
+    }
+    if (upstream != -1) {
+        close(upstream);
+    }
+    // Write-through: the origin has the new version, so drop the local copy
+    bool written = reply.status == 200 || reply.status == 201;
+    if (written) {
+        unlink(req->target);
+        cache_invalidate(&(req->node->cache));
+    }
+    trace_phase_end(req->trace, PHASE_IO);
+    trace_phase_begin(req->trace, PHASE_SEND);
+    if (written) {
+        response_send_tagged(req->socket_fd, reply.status, reply.etag, reply.etag_len);
+    } else {
+        response_send_status(req->socket_fd, reply.status);
+    }
+    log_entry(req->command, req->target, reply.status, req->id);
+    trace_phase_end(req->trace, PHASE_SEND);
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int process_put_snapshot(user_req *req, linked_list *list) {
+    // Check if Content-Length header is present
+    if (req->content_len == -1) {
+        response_send_status(req->socket_fd, 400);
+        log_entry(req->command, req->target, 400, req->id);
+        return EXIT_FAILURE;
+    }
+    // Fail early without the upload; the check is repeated under the writer lock
+    if (check_preconditions(req) != 0) {
+        response_send_status(req->socket_fd, 412);
+        log_entry(req->command, req->target, 412, req->id);
+        return EXIT_FAILURE;
+    }
+    trace_phase_begin(req->trace, PHASE_IO);
+    // The upload goes to a temp on the same filesystem so rename stays atomic
+    char temp[TEMP_MAX];
+    int file_fd = open_temp(req->target, temp);
+    if (file_fd == -1) {
+        int err_code = (errno == EACCES) ? 403 : 500;
+        response_send_status(req->socket_fd, err_code);
+        log_entry(req->command, req->target, err_code, req->id);
         return EXIT_FAILURE;
     }
+    ssize_t written = receive_put_body(req, file_fd);
+    // A cut-off upload must not replace the target
+    int status = (written == -1) ? 500 : ((written < req->content_len) ? 400 : 0);
+    // Renaming keeps the inode and mtime, so the tag can be taken now
+    char etag[RESPONSE_ETAG_MAX];
+    size_t etag_len = (status == 0) ? stamp_written(file_fd, etag) : 0;
+    // Flush before the rename so a crash leaves the old file or the new one, never a mix
+    if (status == 0 && fdatasync(file_fd) == -1) {
+        status = 500;
+    }
     close(file_fd);
-    return EXIT_SUCCESS;
+    if (status != 0) {
+        unlink(temp);
+        response_send_status(req->socket_fd, status);
+        log_entry(req->command, req->target, status, req->id);
+        return EXIT_FAILURE;
+    }
+    trace_phase_end(req->trace, PHASE_IO);
+    // Readers keep their open descriptors on the old file through the rename
+    lock_target(list, req, true);
+    status = (access(req->target, F_OK) == 0) ? 200 : 201;
+    if (check_preconditions(req) != 0) {
+        status = 412;
+        unlink(temp);
+    } else if (rename(temp, req->target) == -1) {
+        status = (errno == EACCES) ? 403 : 500;
+        unlink(temp);
+    } else {
+        cache_invalidate(&(req->node->cache));
+    }
+    log_entry(req->command, req->target, status, req->id);
+    unlock_target(list, req, true);
+    trace_phase_begin(req->trace, PHASE_SEND);
+    if (status == 200 || status == 201) {
+        response_send_tagged(req->socket_fd, status, etag, etag_len);
+    } else {
+        response_send_status(req->socket_fd, status);
+    }
+    trace_phase_end(req->trace, PHASE_SEND);
+    return (status == 200 || status == 201) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool process_upgrade(user_req *req, linked_list *list) {
+    // Only plain GETs switch; anything with a body is served as HTTP/1.1
+    if (!coroutine_mode || req->upgrade == NULL || strcmp(req->upgrade, "h2c") != 0
+        || req->h2_settings == NULL || strcmp(req->command, "GET") != 0
+        || strncmp(req->http_version, "HTTP/1.1", 8) != 0 || req->content_len != -1
+        || req->remaining_len > 0) {
+        return false;
+    }
+    response_send_status(req->socket_fd, 101);
+    // The request that asked for the upgrade is answered on stream 1
+    char head[TARGET_MAX + 48];
+    snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\nRequest-Id: %d\r\n\r\n", req->target,
+        req->id);
+    h2_serve(req->socket_fd, NULL, 0, head, req->h2_settings, serve_connection, list);
+    return true;
+}
+
+bool target_busy(linked_list *list, char *name) {
+    list_node *node = lock_and_find_in_list(list, name);
+    return node != NULL && atomic_load(&(node->writers)) > 0;
+}
+
+bool serve_batch_item(user_req *req, linked_list *list, char *name) {
+    char header[RESPONSE_HEADER_MAX];
+    // Names follow the same rules as request targets
+    size_t name_len = strlen(name);
+    bool valid = name_len > 0 && name_len <= TARGET_MAX;
+    for (size_t i = 0; valid && i < name_len; i++) {
+        valid = is_token_char(name[i]);
+    }
+    if (!valid) {
+        log_entry(req->command, name, 400, req->id);
+        struct iovec frame = { .iov_base = header,
+            .iov_len = response_item_header(header, 400, 0, name) };
+        return response_writev(req->socket_fd, &frame, 1) != -1;
+    }
+    // Each item is read under its own target's reader lock
+    user_req item = *req;
+    item.target = name;
+    item.trace = NULL;
+    lock_and_push_to_list(list, name);
+    item.node = lock_and_find_in_list(list, name);
+    lock_target(list, &item, false);
+    cached_file *cached;
+    int file_fd;
+    struct stat st;
+    int status = open_for_read(item.node, name, &cached, &file_fd, &st);
+    log_entry(req->command, name, status, req->id);
+    off_t size = (status == 200) ? st.st_size : 0;
+    size_t header_len = response_item_header(header, status, size, name);
+    ssize_t sent;
+    if (status != 200) {
+        struct iovec frame = { .iov_base = header, .iov_len = header_len };
+        sent = response_writev(req->socket_fd, &frame, 1);
+    } else {
+        sent = send_opened(req->socket_fd, header, header_len, cached, file_fd, size);
+        if (cached != NULL) {
+            cache_release(cached);
+        } else {
+            close(file_fd);
+        }
+        if (sent == -1 && cached != NULL) {
+            cache_invalidate(&(item.node->cache));
+        }
+    }
+    unlock_target(list, &item, false);
+    return sent != -1;
+}
+
+int process_mget(user_req *req, linked_list *list) {
+    // The body lists the targets, separated by whitespace
+    if (req->content_len <= 0 || req->content_len > BATCH_BODY
+        || req->remaining_len > req->content_len) {
+        response_send_status(req->socket_fd, 400);
+        log_entry(req->command, req->target, 400, req->id);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&batch_slab_mutex);
+    batch_scratch *scratch = slab_alloc(&batch_slab);
+    pthread_mutex_unlock(&batch_slab_mutex);
+    if (scratch == NULL) {
+        response_send_status(req->socket_fd, 500);
+        log_entry(req->command, req->target, 500, req->id);
+        return EXIT_FAILURE;
+    }
+    char *body = scratch->body;
+    char **names = scratch->names;
+    bool *deferred = scratch->deferred;
+    memset(deferred, 0, sizeof(scratch->deferred));
+    // Part of the body may have arrived with the head; read the rest
+    memcpy(body, req->body, req->remaining_len);
+    ssize_t have = req->remaining_len;
+    while (have < req->content_len) {
+        ssize_t got = coro_read(req->socket_fd, body + have, req->content_len - have);
+        if (got <= 0) {
+            break;
+        }
+        have += got;
+    }
+    body[have] = '\0';
+    int count = 0;
+    char *save = NULL;
+    for (char *name = strtok_r(body, " \t\r\n", &save); name != NULL && count <= BATCH_ITEMS;
+         name = strtok_r(NULL, " \t\r\n", &save)) {
+        if (count < BATCH_ITEMS) {
+            names[count] = (name[0] == '/') ? name + 1 : name;
+        }
+        count++;
+    }
+    int status = EXIT_SUCCESS;
+    if (have < req->content_len || count == 0 || count > BATCH_ITEMS) {
+        response_send_status(req->socket_fd, 400);
+        log_entry(req->command, req->target, 400, req->id);
+        status = EXIT_FAILURE;
+    } else if (response_send_batch(req->socket_fd) != -1) {
+        // Items go out as they are served; in completion order, targets that a
+        // writer is waiting on or holding are left until the others are done
+        bool ok = true;
+        for (int i = 0; ok && i < count; i++) {
+            if (req->completion_order && target_busy(list, names[i])) {
+                deferred[i] = true;
+            } else {
+                ok = serve_batch_item(req, list, names[i]);
+            }
+        }
+        for (int i = 0; ok && i < count; i++) {
+            if (deferred[i]) {
+                ok = serve_batch_item(req, list, names[i]);
+            }
+        }
+        status = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&batch_slab_mutex);
+    slab_free(&batch_slab, scratch);
+    pthread_mutex_unlock(&batch_slab_mutex);
+    return status;
 }
 
 int process_put(user_req *req) {
+    // Drop the cached file now that the writer lock keeps readers out
+    cache_invalidate(&(req->node->cache));
     // Check if Content-Length header is present
     if (req->content_len == -1) {
-        dprintf(req->socket_fd,
-            "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
+        response_send_status(req->socket_fd, 400);
         log_entry(req->command, req->target, 400, req->id);
         return EXIT_FAILURE;
     }
-    int file_fd = open(req->target, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    // If-Match and If-None-Match are judged while the writer lock is held
+    if (check_preconditions(req) != 0) {
+        response_send_status(req->socket_fd, 412);
+        log_entry(req->command, req->target, 412, req->id);
+        return EXIT_FAILURE;
+    }
+    trace_phase_begin(req->trace, PHASE_IO);
+    int file_fd = open(req->target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
     int status_code = 0;
     // Check if the file already exists
     if (file_fd == -1) {
         if (errno == EEXIST) {
-            file_fd = open(req->target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            file_fd = open(req->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
             status_code = 200;
         } else {
             if (errno == EACCES) {
-                dprintf(req->socket_fd,
-                    "HTTP/1.1 403 Forbidden\r\nContent-Length: %d\r\n\r\nForbidden\n", 10);
+                response_send_status(req->socket_fd, 403);
                 log_entry(req->command, req->target, 403, req->id);
             } else {
-                dprintf(req->socket_fd,
-                    "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal "
-                    "Server Error\n",
-                    22);
+                response_send_status(req->socket_fd, 500);
                 log_entry(req->command, req->target, 500, req->id);
             }
             return EXIT_FAILURE;
@@ -627,43 +1759,21 @@ int process_put(user_req *req) {
     } else {
         status_code = 201;
     }
-    ssize_t bytes_written = 0;
-    ssize_t total_len = req->content_len;
-    // Write the remaining content length from the request body
-    if (req->remaining_len > 0) {
-        bytes_written = write_n_bytes(file_fd, req->body, req->remaining_len);
-        if (bytes_written == -1) {
-            dprintf(req->socket_fd,
-                "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal Server "
-                "Error\n",
-                22);
-            log_entry(req->command, req->target, 500, req->id);
-            close(file_fd);
-            return EXIT_FAILURE;
-        }
-        total_len -= bytes_written;
-    }
-    // Write any remaining content from the socket to the file
-    if (total_len > 0) {
-        bytes_written = pass_n_bytes(req->socket_fd, file_fd, total_len);
-        if (bytes_written == -1) {
-            dprintf(req->socket_fd,
-                "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal Server "
-                "Error\n",
-                22);
-            log_entry(req->command, req->target, 500, req->id);
-            close(file_fd);
-            return EXIT_FAILURE;
-        }
-    }
-    // Respond with the appropriate status code and log the entry
-    if (status_code == 201) {
-        dprintf(req->socket_fd, "HTTP/1.1 201 Created\r\nContent-Length: %d\r\n\r\nCreated\n", 8);
-        log_entry(req->command, req->target, 201, req->id);
-    } else {
-        dprintf(req->socket_fd, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\nOK\n", 3);
-        log_entry(req->command, req->target, 200, req->id);
+    // Write the body, from the request buffer and then the socket
+    if (receive_put_body(req, file_fd) == -1) {
+        response_send_status(req->socket_fd, 500);
+        log_entry(req->command, req->target, 500, req->id);
+        close(file_fd);
+        return EXIT_FAILURE;
     }
+    char etag[RESPONSE_ETAG_MAX];
+    size_t etag_len = stamp_written(file_fd, etag);
+    trace_phase_end(req->trace, PHASE_IO);
+    // Respond with the appropriate status code and the new tag, and log the entry
+    trace_phase_begin(req->trace, PHASE_SEND);
+    response_send_tagged(req->socket_fd, status_code, etag, etag_len);
+    log_entry(req->command, req->target, status_code, req->id);
+    trace_phase_end(req->trace, PHASE_SEND);
 
     close(file_fd);
     return EXIT_SUCCESS;
@@ -674,47 +1784,148 @@ int process_put(user_req *req) {
 int main(int argc, char **argv) {
     // Create the linked list
     linked_list *list = create_list();
+#ifdef LOCK_STATS
+    lock_table = list;
+#endif
     // Parse command-line arguments and configure signal handlers
     parse_arguments(argc, argv);
+    server_argv = argv;
     configure_signals();
-    // Initialize the server listener socket
+    cache_init(mmap_threshold, cache_entries);
+    sweep_temps();
+    slab_init(&batch_slab, sizeof(batch_scratch), 1);
+    scan_set_kernel(SCAN_AUTO);
+    trace_init(trace_sample);
+    lane_init(bulk_slots, bulk_size);
+    if (client_requests > 0 || client_bytes > 0 || fair_dispatch) {
+        client_init(client_requests, client_bytes);
+    }
+    // Block SIGUSR1/2 before any thread starts so only the stats thread receives them
+    static sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    sigaddset(&stats_signals, SIGUSR2);
+    sigaddset(&stats_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+    // Background threads inherit the CPU main is on when they are created
+    affinity_pin(ROLE_BACKGROUND, 0);
+    cache_watch(invalidate_target, list);
+    pthread_t stats_thread;
+    pthread_create(&stats_thread, NULL, stats_worker, &stats_signals);
+    pthread_detach(stats_thread);
+    // Take the listener over from a running server if there is one, otherwise open the port
     Listener_Socket server_socket;
-    int socket_fd = listener_init(&server_socket, server_port);
-    if (socket_fd == -1) {
+    int upgrade_conn = -1;
+    server_socket.fd = (upgrade_path != NULL) ? upgrade_inherit(upgrade_path, &upgrade_conn) : -1;
+    if (server_socket.fd == -1 && listener_init(&server_socket, server_port) == -1) {
         fprintf(stderr, "Failed to initialize server socket\n");
         exit(EXIT_FAILURE);
     }
-    // Initialize the request queue and other resources
-    request_queue = queue_new(thread_count);
+    // A replacement started by SIGHUP gets the socket through SCM_RIGHTS, not by inheriting it
+    fcntl(server_socket.fd, F_SETFD, FD_CLOEXEC);
+    // Let the listener hand out connections in batches
+    if (listener_tune(server_socket.fd) == -1) {
+        fprintf(stderr, "Failed to configure server socket\n");
+        exit(EXIT_FAILURE);
+    }
+    // Be ready to hand the listener on to the next upgrade
+    static int upgrade_fds[2];
+    if (upgrade_path != NULL) {
+        upgrade_fds[0] = upgrade_listen(upgrade_path);
+        upgrade_fds[1] = server_socket.fd;
+        if (upgrade_fds[0] == -1) {
+            fprintf(stderr, "Failed to create upgrade socket\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_t upgrade_thread;
+        pthread_create(&upgrade_thread, NULL, upgrade_worker, upgrade_fds);
+        pthread_detach(upgrade_thread);
+    }
+    // Initialize the request queue, with room for a full accept batch, and other resources
+    request_queue = dispatch_new(thread_count + ACCEPT_BATCH);
+    if (fair_dispatch && !dispatch_make_fair(request_queue, FAIR_FLOWS, FAIR_QUANTUM)) {
+        fprintf(stderr, "Failed to create fair queue\n");
+        exit(EXIT_FAILURE);
+    }
     pthread_mutex_init(&log_mutex, NULL);
     rw_lock = rwlock_new(N_WAY, 1);
-    // Create worker threads
-    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    // Create worker threads, each with its own scheduler in coroutine mode
+    pthread_t *threads = counted_malloc(thread_count * sizeof(pthread_t));
+    coro_sched **schedulers = NULL;
+    if (coroutine_mode) {
+        schedulers = counted_calloc(thread_count, sizeof(coro_sched *));
+        for (int i = 0; i < thread_count; i++) {
+            schedulers[i] = coro_sched_new(serve_connection, list);
+            if (schedulers[i] == NULL) {
+                fprintf(stderr, "Failed to create coroutine scheduler\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
     for (int i = 0; i < thread_count; i++) {
-        pthread_create(&threads[i], NULL, thread_worker, (void *) list);
+        if (coroutine_mode) {
+            pthread_create(&threads[i], NULL, coro_worker, schedulers[i]);
+        } else {
+            pthread_create(&threads[i], NULL, thread_worker, (void *) list);
+        }
     }
-    // Accept incoming client connections
+    // Main becomes the acceptor
+    affinity_pin(ROLE_ACCEPTOR, 0);
+    // Workers are up, so the server we took over from can stop accepting
+    if (upgrade_conn != -1) {
+        upgrade_ready(upgrade_conn);
+    }
+    // Accept incoming client connections a batch at a time
+    void *batch[ACCEPT_BATCH];
+    unsigned keys[ACCEPT_BATCH];
+    int next_worker = 0;
     while (!atomic_load(&server_shutdown)) {
-        uintptr_t client_socket = listener_accept(&server_socket);
-        if (client_socket == (uintptr_t) -1) {
-            if (atomic_load(&server_shutdown)) {
-                break;
-            }
+        int accepted = accept_batch(server_socket.fd, batch,
+            (fair_dispatch && !coroutine_mode) ? keys : NULL, ACCEPT_BATCH, ACCEPT_POLL,
+            coroutine_mode ? SOCK_NONBLOCK : 0);
+        if (accepted <= 0) {
+            continue;
+        }
+        trace_accepted(batch, accepted);
+        if (!coroutine_mode) {
+            dispatch_push_batch(request_queue, batch, fair_dispatch ? keys : NULL, accepted);
             continue;
         }
-        queue_push(request_queue, (void *) client_socket);
+        // Deal the batch out in even slices, starting where the last one stopped
+        int slice = (accepted + thread_count - 1) / thread_count;
+        for (int start = 0; start < accepted; start += slice) {
+            int count = (accepted - start < slice) ? accepted - start : slice;
+            if (!coro_sched_submit(schedulers[next_worker], batch + start, count)) {
+                for (int i = start; i < start + count; i++) {
+                    close((int) (uintptr_t) batch[i]);
+                }
+            }
+            next_worker = (next_worker + 1) % thread_count;
+        }
+    }
+    // Let the workers drain what is queued or running, then join them
+    dispatch_close(request_queue);
+    for (int i = 0; coroutine_mode && i < thread_count; i++) {
+        coro_sched_close(schedulers[i]);
     }
-    // Join worker threads
     for (int i = 0; i < thread_count; i++) {
         pthread_join(threads[i], NULL);
     }
     // Clean up resources
+    for (int i = 0; coroutine_mode && i < thread_count; i++) {
+        coro_sched_delete(&schedulers[i]);
+    }
+    free(schedulers);
     free(threads);
     delete_list(&list);
-    queue_delete(&request_queue);
+    dispatch_delete(&request_queue);
     pthread_mutex_destroy(&log_mutex);
     rwlock_delete(&rw_lock);
-    close(socket_fd);
+    close(server_socket.fd);
+    // The upgrade socket belongs to the replacement once it has taken over
+    if (upgrade_path != NULL && !atomic_load(&handed_off)) {
+        unlink(upgrade_path);
+    }
 
     return 0;
 }
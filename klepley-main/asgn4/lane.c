@@ -0,0 +1,101 @@
+#include <pthread.h>
+
+#include "coro.h"
+#include "lane.h"
+
+/***********GLOBALS************/
+static int lane_slots = 0;
+static size_t lane_threshold = 0;
+// Slots in use and the parked jobs, oldest first; taking a slot and parking happen under
+// one lock so that a job is never parked just after the last slot holder looked
+static pthread_mutex_t lane_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int lane_active = 0;
+static lane_job *lane_head = NULL;
+static lane_job *lane_tail = NULL;
+static int lane_parked = 0;
+static long lane_deferred = 0;
+// Coroutines waiting in lane_wait for a slot to come free
+static coro_waitq lane_waiters;
+
+/***********LANE************/
+
+void lane_init(int slots, size_t threshold) {
+    lane_slots = (slots > 0) ? slots : 0;
+    lane_threshold = threshold;
+    coro_waitq_init(&lane_waiters);
+}
+
+bool lane_enabled(void) {
+    return lane_slots > 0;
+}
+
+bool lane_is_bulk(size_t bytes) {
+    return lane_slots > 0 && bytes >= lane_threshold;
+}
+
+bool lane_enter(lane_job *job) {
+    pthread_mutex_lock(&lane_mutex);
+    // Parked jobs go first, so a newcomer only takes a slot when nobody is waiting
+    bool run = lane_active < lane_slots && lane_head == NULL;
+    if (run) {
+        lane_active++;
+    } else {
+        job->next = NULL;
+        if (lane_tail != NULL) {
+            lane_tail->next = job;
+        } else {
+            lane_head = job;
+        }
+        lane_tail = job;
+        lane_parked++;
+        lane_deferred++;
+    }
+    pthread_mutex_unlock(&lane_mutex);
+    return run;
+}
+
+static bool take_slot(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&lane_mutex);
+    bool run = lane_active < lane_slots;
+    if (run) {
+        lane_active++;
+    }
+    pthread_mutex_unlock(&lane_mutex);
+    return run;
+}
+
+void lane_wait(void) {
+    // Parked like the coroutine locks, until lane_leave frees a slot
+    coro_wait(&lane_waiters, take_slot, NULL, -1);
+}
+
+lane_job *lane_leave(void) {
+    pthread_mutex_lock(&lane_mutex);
+    lane_job *job = lane_head;
+    if (job != NULL) {
+        // The slot changes hands without ever being free
+        lane_head = job->next;
+        if (lane_head == NULL) {
+            lane_tail = NULL;
+        }
+        lane_parked--;
+    } else {
+        lane_active--;
+    }
+    pthread_mutex_unlock(&lane_mutex);
+    if (job == NULL) {
+        coro_wake_all(&lane_waiters);
+    }
+    return job;
+}
+
+void lane_report(FILE *out) {
+    if (lane_slots == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lane_mutex);
+    fprintf(out, "bulk slots: %d/%d in use, %d parked, %ld deferred\n", lane_active, lane_slots,
+        lane_parked, lane_deferred);
+    pthread_mutex_unlock(&lane_mutex);
+}
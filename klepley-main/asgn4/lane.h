@@ -0,0 +1,62 @@
+/**
+ * @File lane.h
+ *
+ * Size-aware scheduling. Requests that move at least a threshold of bytes
+ * (a PUT's Content-Length, the size of a GET's file) are bulk transfers,
+ * and only a fixed number of them run at once, so the other workers stay
+ * free for small requests however much bulk traffic arrives. A worker that
+ * parses a bulk request while every slot is taken parks it in the bulk lane
+ * and goes back to the queue; the worker that next frees a slot serves it.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/** @struct lane_job
+ *  @brief Link of a parked request, embedded first in the caller's own
+ *         record of it.
+ */
+typedef struct lane_job {
+    struct lane_job *next;
+} lane_job;
+
+/** @brief Allows at most slots bulk transfers at once, bulk meaning at least
+ *         threshold bytes. 0 slots turns size-aware scheduling off.
+ */
+void lane_init(int slots, size_t threshold);
+
+/** @brief Whether size-aware scheduling is on.
+ */
+bool lane_enabled(void);
+
+/** @brief Whether a transfer of bytes counts as bulk.
+ */
+bool lane_is_bulk(size_t bytes);
+
+/** @brief Takes a bulk slot for job, or parks job if there is none.
+ *
+ *  @return true if the caller holds a slot and should serve job now; false
+ *          if job was parked and now belongs to the lane.
+ */
+bool lane_enter(lane_job *job);
+
+/** @brief Takes a bulk slot inside a coroutine, parking it until one is
+ *         free. Parked coroutines keep their worker serving the others.
+ */
+void lane_wait(void);
+
+/** @brief Gives up the caller's slot after a bulk transfer. If a job is
+ *         parked the slot passes straight to it instead.
+ *
+ *  @return The parked job the caller must now serve, still holding the
+ *          slot, or NULL once the slot has been freed.
+ */
+lane_job *lane_leave(void);
+
+/** @brief Prints the slots in use and how many bulk requests have been
+ *         parked.
+ */
+void lane_report(FILE *out);
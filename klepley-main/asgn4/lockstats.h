@@ -0,0 +1,139 @@
+/**
+ * @File lockstats.h
+ *
+ * Contention statistics for the per-target reader/writer locks, kept in
+ * each node of the URI lock table. Everything here only exists when the
+ * server is built with LOCK_STATS defined ('make LOCK_STATS=1'); the
+ * regular build does not contain any of it.
+ */
+
+#pragma once
+
+#ifdef LOCK_STATS
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/** Bucket i counts durations in [2^i, 2^(i+1)) nanoseconds. */
+#define LOCK_HIST_BUCKETS 40
+
+/** @struct lock_stats
+ *  @brief Counters for one lock. Updated with relaxed atomics by every
+ *         thread that takes the lock.
+ */
+typedef struct lock_stats {
+    atomic_long reads;
+    atomic_long writes;
+    // Total time spent waiting, for ranking targets
+    atomic_long wait_ns;
+    atomic_long wait_hist[LOCK_HIST_BUCKETS];
+    atomic_long hold_hist[LOCK_HIST_BUCKETS];
+    // Threads currently waiting, and the most there have ever been
+    atomic_int waiting;
+    atomic_int max_waiting;
+} lock_stats;
+
+/** @brief Clears every counter.
+ */
+static inline void lock_stats_init(lock_stats *stats) {
+    atomic_init(&(stats->reads), 0);
+    atomic_init(&(stats->writes), 0);
+    atomic_init(&(stats->wait_ns), 0);
+    for (int i = 0; i < LOCK_HIST_BUCKETS; i++) {
+        atomic_init(&(stats->wait_hist[i]), 0);
+        atomic_init(&(stats->hold_hist[i]), 0);
+    }
+    atomic_init(&(stats->waiting), 0);
+    atomic_init(&(stats->max_waiting), 0);
+}
+
+/** @brief Monotonic time in nanoseconds.
+ */
+static inline uint64_t lock_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static inline void lock_stats_record(atomic_long *hist, uint64_t ns) {
+    int bucket = (ns == 0) ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= LOCK_HIST_BUCKETS) {
+        bucket = LOCK_HIST_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&hist[bucket], 1, memory_order_relaxed);
+}
+
+/** @brief Called just before blocking on the lock.
+ *
+ *  @return The time the wait started.
+ */
+static inline uint64_t lock_stats_wait(lock_stats *stats) {
+    int waiting = atomic_fetch_add_explicit(&(stats->waiting), 1, memory_order_relaxed) + 1;
+    int max = atomic_load_explicit(&(stats->max_waiting), memory_order_relaxed);
+    while (waiting > max
+           && !atomic_compare_exchange_weak_explicit(
+               &(stats->max_waiting), &max, waiting, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return lock_stats_now();
+}
+
+/** @brief Called once the lock is held.
+ *
+ *  @return The time the hold started.
+ */
+static inline uint64_t lock_stats_acquired(lock_stats *stats, bool write, uint64_t wait_start) {
+    uint64_t now = lock_stats_now();
+    atomic_fetch_sub_explicit(&(stats->waiting), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(write ? &(stats->writes) : &(stats->reads), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(stats->wait_ns), (long) (now - wait_start), memory_order_relaxed);
+    lock_stats_record(stats->wait_hist, now - wait_start);
+    return now;
+}
+
+/** @brief Called just after the lock is released.
+ */
+static inline void lock_stats_released(lock_stats *stats, uint64_t hold_start) {
+    lock_stats_record(stats->hold_hist, lock_stats_now() - hold_start);
+}
+
+/** @brief The upper bound in nanoseconds of the bucket holding percentile
+ *         p (0 to 100) of a histogram, or 0 if it is empty.
+ */
+static inline uint64_t lock_stats_percentile(const atomic_long *hist, double p) {
+    long total = 0;
+    for (int i = 0; i < LOCK_HIST_BUCKETS; i++) {
+        total += atomic_load_explicit(&hist[i], memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    long rank = (long) (total * p / 100.0);
+    long seen = 0;
+    for (int i = 0; i < LOCK_HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist[i], memory_order_relaxed);
+        if (seen > rank) {
+            return (uint64_t) 1 << (i + 1);
+        }
+    }
+    return (uint64_t) 1 << LOCK_HIST_BUCKETS;
+}
+
+/** @brief Prints one line describing the lock of target.
+ */
+static inline void lock_stats_print(FILE *out, const char *target, lock_stats *stats) {
+    fprintf(out,
+        "lock /%s: reads %ld writes %ld wait total %ldus p50 <%luus p99 <%luus hold p50 <%luus "
+        "p99 <%luus max queue %d\n",
+        target, atomic_load(&(stats->reads)), atomic_load(&(stats->writes)),
+        atomic_load(&(stats->wait_ns)) / 1000,
+        (unsigned long) (lock_stats_percentile(stats->wait_hist, 50) + 999) / 1000,
+        (unsigned long) (lock_stats_percentile(stats->wait_hist, 99) + 999) / 1000,
+        (unsigned long) (lock_stats_percentile(stats->hold_hist, 50) + 999) / 1000,
+        (unsigned long) (lock_stats_percentile(stats->hold_hist, 99) + 999) / 1000,
+        atomic_load(&(stats->max_waiting)));
+}
+
+#endif
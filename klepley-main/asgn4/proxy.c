@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "proxy.h"
+#include "scan.h"
+
+#define HEAD_MAX      640
+#define RELAY_BUFFER  16384
+#define TAG_ATTRIBUTE "user.etag"
+
+/***********GLOBALS************/
+// The origin's address, resolved once at startup
+static struct sockaddr_storage origin;
+static socklen_t origin_len = 0;
+
+/***********ORIGIN************/
+
+bool proxy_parse(const char *spec) {
+    // Split at the last colon so the host part may be anything getaddrinfo takes
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0') {
+        return false;
+    }
+    char host[256];
+    size_t host_len = colon - spec;
+    if (host_len >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *found;
+    if (getaddrinfo(host, colon + 1, &hints, &found) != 0) {
+        return false;
+    }
+    memcpy(&origin, found->ai_addr, found->ai_addrlen);
+    origin_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+bool proxy_enabled(void) {
+    return origin_len != 0;
+}
+
+int proxy_connect(void) {
+    int fd = socket(origin.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // The origin is expected to be close by, so the connect itself blocks
+    int result;
+    do {
+        result = connect(fd, (struct sockaddr *) &origin, origin_len);
+    } while (result == -1 && errno == EINTR);
+    // Same read timeout and no-delay setting as the client sockets
+    struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    int on = 1;
+    if (result == -1 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        close(fd);
+        return -1;
+    }
+    // Coroutines park on EAGAIN, which needs a non-blocking socket
+    if (coro_active()) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/***********MESSAGES************/
+
+bool proxy_send_head(int upstream, const char *method, const char *target, ssize_t content_len,
+    int id, const char *if_match, const char *if_none_match) {
+    // Targets and header values are bounded by the parser, so the head always fits
+    char head[HEAD_MAX];
+    int len = snprintf(head, sizeof(head), "%s /%s HTTP/1.1\r\n", method, target);
+    if (content_len != -1) {
+        len += snprintf(head + len, sizeof(head) - len, "Content-Length: %lld\r\n",
+            (long long) content_len);
+    }
+    if (id != 0) {
+        len += snprintf(head + len, sizeof(head) - len, "Request-Id: %d\r\n", id);
+    }
+    if (if_match != NULL) {
+        len += snprintf(head + len, sizeof(head) - len, "If-Match: %s\r\n", if_match);
+    }
+    if (if_none_match != NULL) {
+        len += snprintf(head + len, sizeof(head) - len, "If-None-Match: %s\r\n", if_none_match);
+    }
+    len += snprintf(head + len, sizeof(head) - len, "\r\n");
+    return (size_t) len < sizeof(head) && proxy_write(upstream, head, len);
+}
+
+bool proxy_read_reply(int upstream, char *buf, size_t n, proxy_reply *reply) {
+    // The request head scanner works just as well on a response head
+    header_scanner scanner;
+    scanner_init(&scanner);
+    ssize_t got = read_request_head(upstream, buf, n, &scanner);
+    if (got <= 0 || scanner.head_end == 0 || scanner.invalid || scanner.line_count == 0) {
+        return false;
+    }
+    // Status line: "HTTP/1.x NNN Reason"
+    if (scanner.line_ends[0] < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') {
+        return false;
+    }
+    int status = (int) strtol(buf + 9, NULL, 10);
+    reply->content_len = -1;
+    reply->etag_len = 0;
+    for (int i = 1; i < scanner.line_count; i++) {
+        const char *line = buf + scanner.line_ends[i - 1] + 2;
+        size_t len = scanner.line_ends[i] - (scanner.line_ends[i - 1] + 2);
+        // The value runs up to the CR and must be nothing but digits; a negative or
+        // out-of-range length makes the whole reply bad
+        if (len > 16 && strncasecmp(line, "Content-Length: ", 16) == 0) {
+            char *end;
+            errno = 0;
+            reply->content_len = strtoll(line + 16, &end, 10);
+            if (!isdigit((unsigned char) line[16]) || end != line + len || errno == ERANGE) {
+                return false;
+            }
+        } else if (len > 6 && len - 6 <= sizeof(reply->etag)
+            && strncasecmp(line, "ETag: ", 6) == 0) {
+            reply->etag_len = len - 6;
+            memcpy(reply->etag, line + 6, reply->etag_len);
+        }
+    }
+    // The status goes in last, so callers that preset one keep it for a bad reply
+    reply->status = status;
+    reply->head_len = scanner.head_end;
+    reply->buffered = got;
+    return true;
+}
+
+bool proxy_tag_store(int fd, const char *etag, size_t etag_len) {
+    return fsetxattr(fd, TAG_ATTRIBUTE, etag, etag_len, 0) == 0;
+}
+
+size_t proxy_tag_load(const char *path, char *buf) {
+    ssize_t len = getxattr(path, TAG_ATTRIBUTE, buf, RESPONSE_ETAG_MAX);
+    return (len > 0) ? (size_t) len : 0;
+}
+
+/***********COPYING************/
+
+bool proxy_write(int fd, const char *buf, size_t n) {
+    size_t written = 0;
+    while (written < n) {
+        ssize_t result = coro_write(fd, buf + written, n - written);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+ssize_t proxy_relay(int from, int to, int copy, const char *pending, size_t pending_len,
+    ssize_t n, bool *to_ok) {
+    char buffer[RELAY_BUFFER];
+    if (n < 0) {
+        return 0;
+    }
+    // The pending bytes count towards n like any others
+    const char *chunk = pending;
+    ssize_t chunk_len = ((ssize_t) pending_len < n) ? (ssize_t) pending_len : n;
+    ssize_t moved = 0;
+    while (true) {
+        if (chunk_len > 0) {
+            if (*to_ok && !proxy_write(to, chunk, chunk_len)) {
+                *to_ok = false;
+            }
+            if (copy != -1 && !proxy_write(copy, chunk, chunk_len)) {
+                return -1;
+            }
+            moved += chunk_len;
+        }
+        // Done, or nobody left to copy to
+        if (moved == n || (!*to_ok && copy == -1)) {
+            return moved;
+        }
+        size_t want = (n - moved < RELAY_BUFFER) ? (size_t) (n - moved) : RELAY_BUFFER;
+        chunk_len = coro_read(from, buffer, want);
+        if (chunk_len <= 0) {
+            // The source ran dry or timed out
+            return moved;
+        }
+        chunk = buffer;
+    }
+}
@@ -0,0 +1,102 @@
+/**
+ * @File proxy.h
+ *
+ * The upstream side of the caching proxy mode: connecting to the origin
+ * server, sending it a request head, reading the head of its response and
+ * copying bodies between sockets and files. All socket I/O goes through
+ * the coro_ calls, so a coroutine waiting on the origin lets the others
+ * run.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "response.h"
+
+/** @struct proxy_reply
+ *  @brief What the origin answered, and how much of it has been read.
+ */
+typedef struct proxy_reply {
+    int status;
+    // -1 if the origin did not send a Content-Length
+    ssize_t content_len;
+    // Offset of the body in the buffer passed to proxy_read_reply
+    size_t head_len;
+    // Bytes read into that buffer, head included
+    size_t buffered;
+    // The origin's ETag, if it sent one that fits
+    char etag[RESPONSE_ETAG_MAX];
+    size_t etag_len;
+} proxy_reply;
+
+/** @brief Resolves the origin given as "host:port" and turns the proxy mode
+ *         on.
+ *
+ *  @return false if spec is not a reachable-looking host and port.
+ */
+bool proxy_parse(const char *spec);
+
+/** @brief Whether an origin has been configured.
+ */
+bool proxy_enabled(void);
+
+/** @brief Connects to the origin. Inside a coroutine the socket is made
+ *         non-blocking afterwards so that waits on it park the coroutine.
+ *         Reads give up after 5 idle seconds either way.
+ *
+ *  @return The socket, or -1 on error.
+ */
+int proxy_connect(void);
+
+/** @brief Sends the head of a request for /target. Content-Length is only
+ *         sent if content_len is not -1, Request-Id if id is not 0, and
+ *         the conditional headers if they are not NULL.
+ */
+bool proxy_send_head(int upstream, const char *method, const char *target, ssize_t content_len,
+    int id, const char *if_match, const char *if_none_match);
+
+/** @brief Reads the origin's response head into buf and parses its status
+ *         and Content-Length. Bytes of the body may be read as well.
+ *
+ *  @param n The size of buf, at most 64 KB.
+ *
+ *  @return false if the head is missing, malformed or larger than buf, or
+ *          its Content-Length is not a plain decimal count. reply->status is
+ *          left as it was then.
+ */
+bool proxy_read_reply(int upstream, char *buf, size_t n, proxy_reply *reply);
+
+/** @brief Records the origin's ETag on a fetched file, in the user.etag
+ *         extended attribute, so that later hits answer with the same tag
+ *         a miss did.
+ *
+ *  @return false if the filesystem does not take user attributes.
+ */
+bool proxy_tag_store(int fd, const char *etag, size_t etag_len);
+
+/** @brief Reads the tag recorded by proxy_tag_store.
+ *
+ *  @param buf A buffer of at least RESPONSE_ETAG_MAX bytes.
+ *
+ *  @return The length of the tag, or 0 if the file has none.
+ */
+size_t proxy_tag_load(const char *path, char *buf);
+
+/** @brief Writes all of buf to fd, retrying partial writes.
+ */
+bool proxy_write(int fd, const char *buf, size_t n);
+
+/** @brief Copies n bytes to `to`, and also to `copy` unless it is -1. The
+ *         pending bytes, already read, go first, then the rest is read from
+ *         `from`. If writing to `to` fails, *to_ok is cleared and copying
+ *         goes on into `copy` alone, so a client hanging up does not
+ *         abandon a fill; without a copy it stops there.
+ *
+ *  @return The number of bytes taken from the source, short if it ran out
+ *          or failed (0 for a negative n), or -1 if writing to copy failed.
+ */
+ssize_t proxy_relay(int from, int to, int copy, const char *pending, size_t pending_len,
+    ssize_t n, bool *to_ok);
@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "response.h"
+
+/***********CANNED RESPONSES************/
+// Whole responses, bodies included, so errors cost one write and no formatting
+static const char SWITCHING_RESPONSE[]
+    = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+static const char OK_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nOK\n";
+static const char CREATED_RESPONSE[] = "HTTP/1.1 201 Created\r\nContent-Length: 8\r\n\r\nCreated\n";
+static const char BAD_REQUEST_RESPONSE[]
+    = "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n";
+static const char FORBIDDEN_RESPONSE[]
+    = "HTTP/1.1 403 Forbidden\r\nContent-Length: 10\r\n\r\nForbidden\n";
+static const char NOT_FOUND_RESPONSE[]
+    = "HTTP/1.1 404 Not Found\r\nContent-Length: 10\r\n\r\nNot Found\n";
+static const char PRECONDITION_RESPONSE[]
+    = "HTTP/1.1 412 Precondition Failed\r\nContent-Length: 20\r\n\r\nPrecondition Failed\n";
+static const char TOO_MANY_RESPONSE[]
+    = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+      "Content-Length: 18\r\n\r\nToo Many Requests\n";
+static const char INTERNAL_ERROR_RESPONSE[]
+    = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 22\r\n\r\nInternal Server Error\n";
+static const char BAD_GATEWAY_RESPONSE[]
+    = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 12\r\n\r\nBad Gateway\n";
+static const char NOT_IMPLEMENTED_RESPONSE[]
+    = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 16\r\n\r\nNot Implemented\n";
+static const char VERSION_RESPONSE[]
+    = "HTTP/1.1 505 Version Not Supported\r\nContent-Length: 22\r\n\r\nVersion Not Supported\n";
+
+// Status lines used in front of bodies whose length is only known at runtime
+static const char OK_STATUS[] = "HTTP/1.1 200 OK\r\nContent-Length: ";
+static const char HEADER_END[] = "\r\n\r\n";
+static const char ETAG_FIELD[] = "\r\nETag: ";
+static const char BATCH_RESPONSE[]
+    = "HTTP/1.1 200 OK\r\nContent-Type: application/x-batch\r\nConnection: close\r\n\r\n";
+
+/***********HELPERS************/
+
+static size_t format_size(char *buf, size_t value) {
+    char digits[24];
+    size_t count = 0;
+    // Produce the digits back to front, then copy them out in order
+    do {
+        digits[count++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (size_t i = 0; i < count; i++) {
+        buf[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+static size_t format_hex(char *buf, uint64_t value) {
+    static const char hex[] = "0123456789abcdef";
+    char digits[16];
+    size_t count = 0;
+    do {
+        digits[count++] = hex[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    for (size_t i = 0; i < count; i++) {
+        buf[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+static ssize_t write_all(int fd, const char *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t result = coro_write(fd, buf + written, len - written);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += result;
+    }
+    return written;
+}
+
+/***********RESPONSE FUNCTIONS************/
+
+ssize_t response_send_status(int fd, int status) {
+    const char *bytes;
+    size_t len;
+    switch (status) {
+    case 101:
+        bytes = SWITCHING_RESPONSE;
+        len = sizeof(SWITCHING_RESPONSE) - 1;
+        break;
+    case 200:
+        bytes = OK_RESPONSE;
+        len = sizeof(OK_RESPONSE) - 1;
+        break;
+    case 201:
+        bytes = CREATED_RESPONSE;
+        len = sizeof(CREATED_RESPONSE) - 1;
+        break;
+    case 400:
+        bytes = BAD_REQUEST_RESPONSE;
+        len = sizeof(BAD_REQUEST_RESPONSE) - 1;
+        break;
+    case 403:
+        bytes = FORBIDDEN_RESPONSE;
+        len = sizeof(FORBIDDEN_RESPONSE) - 1;
+        break;
+    case 404:
+        bytes = NOT_FOUND_RESPONSE;
+        len = sizeof(NOT_FOUND_RESPONSE) - 1;
+        break;
+    case 412:
+        bytes = PRECONDITION_RESPONSE;
+        len = sizeof(PRECONDITION_RESPONSE) - 1;
+        break;
+    case 429:
+        bytes = TOO_MANY_RESPONSE;
+        len = sizeof(TOO_MANY_RESPONSE) - 1;
+        break;
+    case 501:
+        bytes = NOT_IMPLEMENTED_RESPONSE;
+        len = sizeof(NOT_IMPLEMENTED_RESPONSE) - 1;
+        break;
+    case 502:
+        bytes = BAD_GATEWAY_RESPONSE;
+        len = sizeof(BAD_GATEWAY_RESPONSE) - 1;
+        break;
+    case 505:
+        bytes = VERSION_RESPONSE;
+        len = sizeof(VERSION_RESPONSE) - 1;
+        break;
+    default:
+        bytes = INTERNAL_ERROR_RESPONSE;
+        len = sizeof(INTERNAL_ERROR_RESPONSE) - 1;
+        break;
+    }
+    return write_all(fd, bytes, len);
+}
+
+size_t response_header(char *buf, size_t content_length, const char *etag, size_t etag_len) {
+    // Copy the template, then append the length, the tag and the blank line
+    size_t len = sizeof(OK_STATUS) - 1;
+    memcpy(buf, OK_STATUS, len);
+    len += format_size(buf + len, content_length);
+    if (etag_len > 0) {
+        memcpy(buf + len, ETAG_FIELD, sizeof(ETAG_FIELD) - 1);
+        len += sizeof(ETAG_FIELD) - 1;
+        memcpy(buf + len, etag, etag_len);
+        len += etag_len;
+    }
+    memcpy(buf + len, HEADER_END, sizeof(HEADER_END) - 1);
+    return len + sizeof(HEADER_END) - 1;
+}
+
+size_t response_etag(char *buf, const struct stat *st) {
+    // "inode-size-mtime", all in hex, with the mtime in nanoseconds
+    uint64_t mtime = (uint64_t) st->st_mtim.tv_sec * 1000000000u + st->st_mtim.tv_nsec;
+    size_t len = 0;
+    buf[len++] = '"';
+    len += format_hex(buf + len, st->st_ino);
+    buf[len++] = '-';
+    len += format_hex(buf + len, st->st_size);
+    buf[len++] = '-';
+    len += format_hex(buf + len, mtime);
+    buf[len++] = '"';
+    return len;
+}
+
+bool response_etag_listed(const char *list, const char *etag, size_t etag_len) {
+    // Walk the comma-separated entries; weak tags never match a strong one
+    const char *pos = list;
+    while (*pos != '\0') {
+        while (*pos == ' ' || *pos == ',') {
+            pos++;
+        }
+        const char *end = pos;
+        while (*end != '\0' && *end != ',' && *end != ' ') {
+            end++;
+        }
+        size_t len = end - pos;
+        if ((len == 1 && *pos == '*') || (len == etag_len && memcmp(pos, etag, len) == 0)) {
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+ssize_t response_send_tagged(int fd, int status, const char *etag, size_t etag_len) {
+    if (etag_len == 0) {
+        return response_send_status(fd, status);
+    }
+    // The canned PUT response with the tag spliced in after its status line
+    const char *canned = (status == 201) ? CREATED_RESPONSE : OK_RESPONSE;
+    size_t canned_len = (status == 201) ? sizeof(CREATED_RESPONSE) - 1 : sizeof(OK_RESPONSE) - 1;
+    size_t line_len = strstr(canned, "\r\n") - canned;
+    struct iovec iov[4] = {
+        { .iov_base = (char *) canned, .iov_len = line_len },
+        { .iov_base = (char *) ETAG_FIELD, .iov_len = sizeof(ETAG_FIELD) - 1 },
+        { .iov_base = (char *) etag, .iov_len = etag_len },
+        { .iov_base = (char *) canned + line_len, .iov_len = canned_len - line_len },
+    };
+    return response_writev(fd, iov, 4);
+}
+
+ssize_t response_send_batch(int fd) {
+    return write_all(fd, BATCH_RESPONSE, sizeof(BATCH_RESPONSE) - 1);
+}
+
+size_t response_item_header(char *buf, int status, size_t length, const char *target) {
+    // Status, length and target separated by single spaces
+    size_t len = format_size(buf, status);
+    buf[len++] = ' ';
+    len += format_size(buf + len, length);
+    buf[len++] = ' ';
+    buf[len++] = '/';
+    size_t target_len = strnlen(target, RESPONSE_HEADER_MAX - len - 2);
+    memcpy(buf + len, target, target_len);
+    len += target_len;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
+ssize_t response_writev(int fd, struct iovec *iov, int count) {
+    ssize_t total = 0;
+    int index = 0;
+    while (index < count) {
+        ssize_t written = coro_writev(fd, iov + index, count - index);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+        // Skip past whatever was fully written and trim a partial entry
+        while (index < count && (size_t) written >= iov[index].iov_len) {
+            written -= iov[index].iov_len;
+            index++;
+        }
+        if (index < count) {
+            iov[index].iov_base = (char *) iov[index].iov_base + written;
+            iov[index].iov_len -= written;
+        }
+    }
+    return total;
+}
+
+ssize_t response_send_file(
+    int fd, const char *header, size_t header_len, int file_fd, off_t offset, size_t size) {
+    // Hold the header back until the body joins it in the same segment
+    size_t sent = 0;
+    while (sent < header_len) {
+        ssize_t result = coro_send(fd, header + sent, header_len - sent, size > 0 ? MSG_MORE : 0);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += result;
+    }
+    // Let the kernel move the body straight from the page cache
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t result = coro_sendfile(fd, file_fd, &offset, remaining);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0) {
+            // The file shrank since it was stat'ed
+            return -1;
+        }
+        remaining -= result;
+    }
+    return size;
+}
@@ -0,0 +1,96 @@
+/**
+ * @File response.h
+ *
+ * Prebuilt status lines and canned responses, plus helpers that emit a
+ * header and its body with as few system calls as possible.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** The largest header response_header will ever produce. */
+#define RESPONSE_HEADER_MAX 192
+
+/** The longest ETag response_etag will ever produce. */
+#define RESPONSE_ETAG_MAX 56
+
+/** @brief Sends the complete canned response (status line, headers and
+ *         short body) for status with a single write. Supported codes are
+ *         101 (switching to h2c), 200 (the PUT "OK"), 201, 400, 403, 404,
+ *         412, 429 (with Retry-After: 1), 500, 501, 502 and 505.
+ *
+ *  @return The number of bytes written, or -1 on error.
+ */
+ssize_t response_send_status(int fd, int status);
+
+/** @brief Builds the 200 OK status line and Content-Length header into
+ *         buf from a precomputed template, followed by an ETag header if
+ *         etag_len is not 0.
+ *
+ *  @param buf A buffer of at least RESPONSE_HEADER_MAX bytes.
+ *
+ *  @return The length of the header, including the blank line.
+ */
+size_t response_header(char *buf, size_t content_length, const char *etag, size_t etag_len);
+
+/** @brief Builds the quoted strong ETag of a file from its inode, size
+ *         and modification time in nanoseconds.
+ *
+ *  @param buf A buffer of at least RESPONSE_ETAG_MAX bytes.
+ *
+ *  @return The length of the tag, quotes included.
+ */
+size_t response_etag(char *buf, const struct stat *st);
+
+/** @brief Whether an If-Match or If-None-Match value lists etag, or is
+ *         "*".
+ */
+bool response_etag_listed(const char *list, const char *etag, size_t etag_len);
+
+/** @brief Sends the canned 200 or 201 PUT response with an ETag header
+ *         for the file just written.
+ *
+ *  @return The number of bytes written, or -1 on error.
+ */
+ssize_t response_send_tagged(int fd, int status, const char *etag, size_t etag_len);
+
+/** @brief Sends the head of a batch (MGET) response: 200 OK without a
+ *         Content-Length, so the body runs until the connection closes.
+ *
+ *  @return The number of bytes written, or -1 on error.
+ */
+ssize_t response_send_batch(int fd);
+
+/** @brief Builds the frame line that precedes one item of a batch
+ *         response: "<status> <length> /<target>\r\n". The item's bytes
+ *         follow it directly; items that are not 200 have length 0.
+ *
+ *  @param buf A buffer of at least RESPONSE_HEADER_MAX bytes.
+ *
+ *  @param target At most 63 characters.
+ *
+ *  @return The length of the frame line.
+ */
+size_t response_item_header(char *buf, int status, size_t length, const char *target);
+
+/** @brief Writes every byte described by iov to fd, retrying partial
+ *         writes.
+ *
+ *  @return The number of bytes written, or -1 on error.
+ */
+ssize_t response_writev(int fd, struct iovec *iov, int count);
+
+/** @brief Sends header then size bytes of file_fd starting at offset.
+ *         The header is sent with MSG_MORE so that it leaves in the same
+ *         segment as the start of the body, which then goes out with
+ *         sendfile. The file offset of file_fd is left untouched.
+ *
+ *  @return The number of body bytes sent, or -1 on error.
+ */
+ssize_t response_send_file(
+    int fd, const char *header, size_t header_len, int file_fd, off_t offset, size_t size);
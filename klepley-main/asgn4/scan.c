@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#define BLOCK 32
+
+/***********KERNELS************/
+// Bit i of each mask describes byte i of a 32-byte block
+typedef struct scan_masks {
+    uint32_t cr;
+    uint32_t lf;
+    uint32_t bad;
+} scan_masks;
+
+static void classify_scalar_n(const char *p, size_t n, scan_masks *out) {
+    out->cr = 0;
+    out->lf = 0;
+    out->bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char) p[i];
+        if (c == '\r') {
+            out->cr |= 1u << i;
+        } else if (c == '\n') {
+            out->lf |= 1u << i;
+        } else if (c < 0x20 || c >= 0x7f) {
+            out->bad |= 1u << i;
+        }
+    }
+}
+
+static void classify_scalar(const char *p, scan_masks *out) {
+    classify_scalar_n(p, BLOCK, out);
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2"))) static void classify_sse2(const char *p, scan_masks *out) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    out->cr = 0;
+    out->lf = 0;
+    out->bad = 0;
+    for (int half = 0; half < BLOCK; half += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + half));
+        out->cr |= (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)) << half;
+        out->lf |= (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << half;
+        // A signed compare catches control bytes and everything from 0x80 up at once
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+        out->bad |= (uint32_t) _mm_movemask_epi8(bad) << half;
+    }
+    out->bad &= ~(out->cr | out->lf);
+}
+
+__attribute__((target("avx2"))) static void classify_avx2(const char *p, scan_masks *out) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    out->cr = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    out->lf = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    // A signed compare catches control bytes and everything from 0x80 up at once
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+    out->bad = (uint32_t) _mm256_movemask_epi8(bad) & ~(out->cr | out->lf);
+}
+#endif
+
+static void (*classify)(const char *p, scan_masks *out) = classify_scalar;
+static const char *kernel_name = "scalar";
+
+/***********SCANNER************/
+
+bool scan_set_kernel(SCAN_KERNEL kernel) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    bool has_sse2 = __builtin_cpu_supports("sse2");
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (kernel == SCAN_AUTO) {
+        kernel = has_avx2 ? SCAN_AVX2 : (has_sse2 ? SCAN_SSE2 : SCAN_SCALAR);
+    }
+    if (kernel == SCAN_AVX2 && has_avx2) {
+        classify = classify_avx2;
+        kernel_name = "avx2";
+        return true;
+    }
+    if (kernel == SCAN_SSE2 && has_sse2) {
+        classify = classify_sse2;
+        kernel_name = "sse2";
+        return true;
+    }
+#else
+    if (kernel == SCAN_AUTO) {
+        kernel = SCAN_SCALAR;
+    }
+#endif
+    if (kernel == SCAN_SCALAR) {
+        classify = classify_scalar;
+        kernel_name = "scalar";
+        return true;
+    }
+    return false;
+}
+
+const char *scan_kernel_name(void) {
+    return kernel_name;
+}
+
+void scanner_init(header_scanner *scanner) {
+    scanner->scanned = 0;
+    scanner->line_start = 0;
+    scanner->head_end = 0;
+    scanner->invalid = false;
+    scanner->line_count = 0;
+}
+
+bool scanner_feed(header_scanner *scanner, const char *buf, size_t len) {
+    if (scanner->head_end != 0) {
+        return true;
+    }
+    size_t pos = scanner->scanned;
+    while (pos < len) {
+        // Full blocks go through the vector kernel, the tail through the scalar one
+        scan_masks masks;
+        size_t n = (len - pos < BLOCK) ? len - pos : BLOCK;
+        if (n == BLOCK) {
+            classify(buf + pos, &masks);
+        } else {
+            classify_scalar_n(buf + pos, n, &masks);
+        }
+        // Walk the interesting bytes of the block in order
+        uint32_t events = masks.cr | masks.lf | masks.bad;
+        while (events != 0) {
+            int bit = __builtin_ctz(events);
+            uint32_t flag = 1u << bit;
+            size_t at = pos + bit;
+            events &= events - 1;
+            if (masks.bad & flag) {
+                scanner->invalid = true;
+            } else if (masks.lf & flag) {
+                // Every LF must finish a CRLF
+                if (at == 0 || buf[at - 1] != '\r') {
+                    scanner->invalid = true;
+                }
+            } else if (at + 1 == len) {
+                // The LF that should follow this CR has not arrived yet
+                scanner->scanned = at;
+                return false;
+            } else if (buf[at + 1] != '\n') {
+                scanner->invalid = true;
+            } else if (at == scanner->line_start) {
+                // An empty line ends the headers
+                scanner->head_end = at + 2;
+                scanner->scanned = at + 2;
+                return true;
+            } else {
+                if (scanner->line_count == SCAN_MAX_LINES) {
+                    scanner->invalid = true;
+                } else {
+                    scanner->line_ends[scanner->line_count++] = (uint16_t) at;
+                }
+                scanner->line_start = at + 2;
+            }
+        }
+        pos += n;
+    }
+    scanner->scanned = len;
+    return false;
+}
+
+ssize_t read_request_head(int fd, char *buf, size_t n, header_scanner *scanner) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t result = coro_read(fd, buf + total, n - total);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        total += result;
+        // Only the bytes that just arrived get scanned
+        if (scanner_feed(scanner, buf, total)) {
+            break;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,75 @@
+/**
+ * @File scan.h
+ *
+ * Incremental scanner for the request head. Each call only looks at bytes
+ * that arrived since the previous call; it records where every CRLF is,
+ * flags bytes that can never appear in a request head, and stops at the
+ * blank line that ends the headers. The byte classification runs 32 bytes
+ * at a time with AVX2 or SSE2 when the CPU has them, with a scalar
+ * fallback.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** The most lines (request line plus headers) a head may have. */
+#define SCAN_MAX_LINES 1024
+
+typedef enum { SCAN_AUTO, SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 } SCAN_KERNEL;
+
+/** @struct header_scanner
+ *  @brief The state carried between reads of one request head. Offsets
+ *         are relative to the start of the buffer, which must not be
+ *         larger than 64 KB.
+ */
+typedef struct header_scanner {
+    // Bytes already classified
+    size_t scanned;
+    // Where the line currently being read starts
+    size_t line_start;
+    // Offset just past the blank line, or 0 until it has been seen
+    size_t head_end;
+    // Set when a byte outside printable ASCII, a bare CR or a bare LF shows up
+    bool invalid;
+    int line_count;
+    // Offset of the CR ending each complete line
+    uint16_t line_ends[SCAN_MAX_LINES];
+} header_scanner;
+
+/** @brief Picks the classification kernel. SCAN_AUTO chooses the widest
+ *         one the CPU supports.
+ *
+ *  @return false if the requested kernel is not supported (the current
+ *          kernel is kept).
+ */
+bool scan_set_kernel(SCAN_KERNEL kernel);
+
+/** @brief The name of the kernel currently in use.
+ */
+const char *scan_kernel_name(void);
+
+/** @brief Resets scanner for a new request head.
+ */
+void scanner_init(header_scanner *scanner);
+
+/** @brief Scans the bytes of buf that have not been scanned yet.
+ *
+ *  @param buf The request buffer; the first len bytes are valid.
+ *
+ *  @return true once the end of the headers has been found.
+ */
+bool scanner_feed(header_scanner *scanner, const char *buf, size_t len);
+
+/** @brief Reads from fd into buf until either (1) the end of the headers
+ *         has been read, (2) n bytes have been read, (3) fd is out of
+ *         bytes, or (4) there is an error or timeout. Only newly read
+ *         bytes are scanned after each read. Bytes past the headers may be
+ *         read as well; they are the start of the body.
+ *
+ *  @return The number of bytes read, or -1 on error.
+ */
+ssize_t read_request_head(int fd, char *buf, size_t n, header_scanner *scanner);
@@ -0,0 +1,209 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "trace.h"
+
+/***********DEFS************/
+#define TRACE_RING    1024
+#define TRACE_MAX_FDS 65536
+#define TRACE_TARGET  64
+
+typedef struct trace_record {
+    uint64_t start[TRACE_PHASES];
+    uint64_t end[TRACE_PHASES];
+    int id;
+    char method[8];
+    char target[TRACE_TARGET];
+} trace_record;
+
+// One per thread that has committed a request; only its owner writes to it
+typedef struct trace_ring {
+    struct trace_ring *next;
+    int tid;
+    // Records ever written; slot i % TRACE_RING holds record i
+    atomic_ulong head;
+    trace_record records[TRACE_RING];
+} trace_ring;
+
+/***********GLOBALS************/
+static int sample_rate = 0;
+static _Atomic uint64_t *accept_times = NULL;
+static trace_ring *rings = NULL;
+static int ring_count = 0;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local trace_ring *local_ring = NULL;
+static _Thread_local unsigned long local_seen = 0;
+
+static const char *phase_names[TRACE_PHASES] = { "queue", "read", "parse", "lock", "io", "send" };
+
+/***********HELPERS************/
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static trace_ring *get_ring(void) {
+    if (local_ring == NULL) {
+        trace_ring *ring = counted_malloc(sizeof(trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&(ring->head), 0);
+        // Register the ring so the dump can find it
+        pthread_mutex_lock(&rings_mutex);
+        ring->tid = ++ring_count;
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_mutex);
+        local_ring = ring;
+    }
+    return local_ring;
+}
+
+// Writes s as the body of a JSON string, dropping anything that needs escaping
+static void write_json_text(FILE *out, const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s != '"' && *s != '\\' && (unsigned char) *s >= 0x20) {
+            fputc(*s, out);
+        }
+    }
+}
+
+/***********TRACING************/
+
+void trace_init(int sample_every) {
+    if (sample_every <= 0) {
+        return;
+    }
+    accept_times = counted_calloc(TRACE_MAX_FDS, sizeof(*accept_times));
+    if (accept_times != NULL) {
+        sample_rate = sample_every;
+    }
+}
+
+void trace_accepted(void **fds, int count) {
+    if (sample_rate == 0) {
+        return;
+    }
+    // One timestamp covers the whole batch
+    uint64_t now = now_ns();
+    for (int i = 0; i < count; i++) {
+        uintptr_t fd = (uintptr_t) fds[i];
+        if (fd < TRACE_MAX_FDS) {
+            atomic_store_explicit(&accept_times[fd], now, memory_order_relaxed);
+        }
+    }
+}
+
+void trace_begin(trace_req *trace, int fd) {
+    trace->active = false;
+    if (sample_rate == 0 || local_seen++ % sample_rate != 0) {
+        return;
+    }
+    trace->active = true;
+    memset(trace->start, 0, sizeof(trace->start));
+    memset(trace->end, 0, sizeof(trace->end));
+    uint64_t now = now_ns();
+    // The queue phase is only known if the acceptor recorded this fd
+    if (fd >= 0 && fd < TRACE_MAX_FDS) {
+        uint64_t accepted = atomic_load_explicit(&accept_times[fd], memory_order_relaxed);
+        if (accepted != 0 && accepted <= now) {
+            trace->start[PHASE_QUEUE] = accepted;
+            trace->end[PHASE_QUEUE] = now;
+        }
+    }
+    trace->start[PHASE_READ] = now;
+}
+
+void trace_phase_begin(trace_req *trace, TRACE_PHASE phase) {
+    if (trace != NULL && trace->active) {
+        trace->start[phase] = now_ns();
+    }
+}
+
+void trace_phase_end(trace_req *trace, TRACE_PHASE phase) {
+    if (trace != NULL && trace->active && trace->start[phase] != 0) {
+        trace->end[phase] = now_ns();
+    }
+}
+
+void trace_commit(trace_req *trace, int id, const char *method, const char *target) {
+    if (!trace->active) {
+        return;
+    }
+    trace_ring *ring = get_ring();
+    if (ring == NULL) {
+        return;
+    }
+    unsigned long head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+    trace_record *record = &(ring->records[head % TRACE_RING]);
+    memcpy(record->start, trace->start, sizeof(record->start));
+    memcpy(record->end, trace->end, sizeof(record->end));
+    record->id = id;
+    strncpy(record->method, method, sizeof(record->method) - 1);
+    record->method[sizeof(record->method) - 1] = '\0';
+    strncpy(record->target, target, TRACE_TARGET - 1);
+    record->target[TRACE_TARGET - 1] = '\0';
+    // Publish the record only once it is complete
+    atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+}
+
+int trace_dump(const char *path) {
+    // The path is predictable, so never follow or reuse anything already there
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return -1;
+    }
+    // Rings are never freed, so the list can be walked once it is read
+    pthread_mutex_lock(&rings_mutex);
+    trace_ring *ring = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    int written = 0;
+    bool first = true;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    for (; ring != NULL; ring = ring->next) {
+        unsigned long head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+        unsigned long oldest = (head > TRACE_RING) ? head - TRACE_RING : 0;
+        for (unsigned long i = oldest; i < head; i++) {
+            trace_record record = ring->records[i % TRACE_RING];
+            // Skip the record if the owner wrapped around onto it while it was copied
+            unsigned long now_head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+            if (now_head >= TRACE_RING && i < now_head - TRACE_RING + 1) {
+                continue;
+            }
+            for (int phase = 0; phase < TRACE_PHASES; phase++) {
+                if (record.start[phase] == 0 || record.end[phase] == 0) {
+                    continue;
+                }
+                fprintf(out,
+                    "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"request_id\":%d,\"method\":\"",
+                    first ? "" : ",\n", phase_names[phase], record.start[phase] / 1000.0,
+                    (record.end[phase] - record.start[phase]) / 1000.0, ring->tid, record.id);
+                write_json_text(out, record.method);
+                fputs("\",\"target\":\"/", out);
+                write_json_text(out, record.target);
+                fputs("\"}}", out);
+                first = false;
+            }
+            written++;
+        }
+    }
+    fputs("\n]}\n", out);
+    fclose(out);
+    return written;
+}
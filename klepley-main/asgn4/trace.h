@@ -0,0 +1,71 @@
+/**
+ * @File trace.h
+ *
+ * Sampled per-request phase tracing. Each worker records the start and end
+ * of every phase of a sampled request into its own ring buffer, without
+ * locking. A dump writes the rings out as Chrome trace JSON that can be
+ * opened in Perfetto or chrome://tracing.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PHASE_QUEUE, // Accepted until a worker popped the connection
+    PHASE_READ, // Reading the request head
+    PHASE_PARSE, // Parsing the request line and headers
+    PHASE_LOCK, // Waiting for the target's reader or writer lock
+    PHASE_IO, // Opening, reading or writing the target file
+    PHASE_SEND, // Writing the response
+    TRACE_PHASES
+} TRACE_PHASE;
+
+/** @struct trace_req
+ *  @brief The phases of one request, kept by the worker while it is being
+ *         handled. A timestamp of 0 means the phase did not happen.
+ */
+typedef struct trace_req {
+    bool active;
+    uint64_t start[TRACE_PHASES];
+    uint64_t end[TRACE_PHASES];
+} trace_req;
+
+/** @brief Enables tracing of one request in every sample_every; 0 leaves
+ *         tracing off and every other call cheap.
+ */
+void trace_init(int sample_every);
+
+/** @brief Records the accept time of a batch of connections (fds stored as
+ *         void pointers, as accept_batch returns them).
+ */
+void trace_accepted(void **fds, int count);
+
+/** @brief Starts tracing the connection on fd if it is sampled. The queue
+ *         phase ends and the read phase starts here.
+ */
+void trace_begin(trace_req *trace, int fd);
+
+/** @brief Marks the start of a phase. Does nothing if trace is NULL or the
+ *         request is not sampled.
+ */
+void trace_phase_begin(trace_req *trace, TRACE_PHASE phase);
+
+/** @brief Marks the end of a phase started with trace_phase_begin.
+ */
+void trace_phase_end(trace_req *trace, TRACE_PHASE phase);
+
+/** @brief Copies a finished request into the calling thread's ring, tagged
+ *         with its Request-Id, method and target.
+ */
+void trace_commit(trace_req *trace, int id, const char *method, const char *target);
+
+/** @brief Writes every recorded request to path as Chrome trace JSON. The
+ *         file is created with mode 0600 and must not exist yet, so a
+ *         symlink planted at path is refused rather than followed.
+ *
+ *  @return The number of requests written, or -1 if path could not be
+ *          created.
+ */
+int trace_dump(const char *path);
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+
+/***********HELPERS************/
+
+static bool unix_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/***********NEW SERVER************/
+
+int upgrade_inherit(const char *path, int *conn) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // Nobody listening means there is no server to take over from
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    // The descriptor rides along with a single byte of data
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got;
+    do {
+        got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (got == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = (got == 1) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return -1;
+    }
+    int listen_fd;
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    *conn = fd;
+    return listen_fd;
+}
+
+void upgrade_ready(int conn) {
+    char byte = 'R';
+    while (write(conn, &byte, 1) == -1 && errno == EINTR) {
+    }
+    close(conn);
+}
+
+/***********OLD SERVER************/
+
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // The previous server is done with the path once it has handed off
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool upgrade_serve(int upgrade_fd, int listen_fd) {
+    int conn = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        return false;
+    }
+    char byte = 'L';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+        close(conn);
+        return false;
+    }
+    // Keep accepting until the replacement says it is; if it dies first, carry on
+    ssize_t got;
+    do {
+        got = read(conn, &byte, 1);
+    } while (got == -1 && errno == EINTR);
+    close(conn);
+    return got == 1 && byte == 'R';
+}
+
+bool upgrade_spawn(char **argv) {
+    pid_t child = fork();
+    if (child == -1) {
+        return false;
+    }
+    if (child == 0) {
+        // Fork again so the new server is reparented instead of left as our child
+        if (fork() == 0) {
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            execvp(argv[0], argv);
+            // Only async-signal-safe calls are allowed in a child forked from threads
+            static const char message[] = "execvp: failed to start the new server\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            _exit(1);
+        }
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+    return true;
+}
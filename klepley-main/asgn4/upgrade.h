@@ -0,0 +1,49 @@
+/**
+ * @File upgrade.h
+ *
+ * Hands the listening socket from a running server to its replacement
+ * over a Unix socket, so that a new binary can be deployed without ever
+ * closing the port. Connections that arrive during the handoff wait in the
+ * shared backlog until one of the two servers accepts them.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** @brief Asks a server already running on the upgrade socket at path for
+ *         its listening socket.
+ *
+ *  @param conn Set to the connection to the old server, which must be
+ *         passed to upgrade_ready once the caller is able to accept.
+ *
+ *  @return The inherited listening socket, or -1 if no server answered.
+ */
+int upgrade_inherit(const char *path, int *conn);
+
+/** @brief Tells the old server that its replacement is accepting, so it
+ *         can stop accepting and drain. Closes conn.
+ */
+void upgrade_ready(int conn);
+
+/** @brief Creates the upgrade socket at path, replacing any stale one.
+ *
+ *  @return The listening Unix socket, or -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/** @brief Waits for one replacement to connect to upgrade_fd and passes it
+ *         listen_fd with SCM_RIGHTS.
+ *
+ *  @return true once the replacement has confirmed that it is accepting;
+ *          false if the attempt failed and the caller should keep serving.
+ */
+bool upgrade_serve(int upgrade_fd, int listen_fd);
+
+/** @brief Starts argv as a new process that is not a child of the caller,
+ *         with every signal unblocked. Used on SIGHUP to re-exec the
+ *         server's own (possibly replaced) binary.
+ *
+ *  @return true if the process was started.
+ */
+bool upgrade_spawn(char **argv);